@@ -4,25 +4,301 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
-#include <queue>
 #include <stdexcept>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <fstream>
-#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <system_error>
+#include <chrono>
+#include "cpu.hpp"
+#include "memory.hpp"
+#include "io.hpp"
 #define KB32 32768
 
 // deflate
-//  - compression level 1 broken
 //  - optimize
     //  - more compression options for better or faster compression (like zlib)
     //  - heuristic for when to use dynamic huffman vs fixed huffman vs uncompressed
-// inflate
-//  -if ever need to optimize inflate, add a code lookup table in huffman tree
-//  -support zlib better
-//      -parse dicts if fdict bit set
 class deflate_compressor {
+    public:
+    // one independent buffer for compressBatch or decompressBatch
+    // in, in_size, out and out_cap are filled in by the caller, out_size, ok and error by the batch
+    struct BatchItem {
+        const void* in = nullptr;
+        size_t in_size = 0;
+        void* out = nullptr;
+        size_t out_cap = 0;
+        size_t out_size = 0;
+        bool ok = false;
+        std::string error; // what was thrown when ok is false
+    };
+
+    // the optional fields of a gzip member header (rfc 1952)
+    // compressGzip writes whatever's set here, decompressGzip fills it in from the first member
+    struct GzipHeader {
+        std::string name;           // original file name, FNAME
+        std::string comment;        // FCOMMENT
+        std::vector<uint8_t> extra; // FEXTRA subfields, raw
+        uint32_t mtime = 0;         // unix time, 0 when unknown
+        uint8_t os = 255;           // 255 is unknown, 3 unix
+        bool text = false;          // FTEXT, only a hint
+        bool header_crc = false;    // FHCRC, the header carries the low 16 bits of its own crc-32
+    };
+
+    // where the chunks of a seekable stream are, see deflate::compressSeekable
+    // every chunk starts with an empty window on a byte boundary, so any of them decodes on its own
+    struct SeekTable {
+        struct Chunk {
+            uint64_t in_offset = 0;  // first byte of its deflate data, from the start of the whole stream
+            uint64_t out_offset = 0; // where its output goes in the whole output
+            uint32_t in_size = 0;
+            uint32_t out_size = 0;
+        };
+        std::vector<Chunk> chunks;
+
+        uint64_t outSize () const {
+            return chunks.empty() ? 0 : chunks.back().out_offset + chunks.back().out_size;
+        }
+
+        // the sizes of each chunk, 8 bytes apiece little endian, which is also what a seekable gzip stream carries
+        std::vector<uint8_t> entries () const {
+            std::vector<uint8_t> bytes;
+            for (const Chunk& chunk : chunks) {
+                for (int i = 0; i < 4; i++) {
+                    bytes.push_back((uint8_t)(chunk.in_size >> (8 * i)));
+                }
+                for (int i = 0; i < 4; i++) {
+                    bytes.push_back((uint8_t)(chunk.out_size >> (8 * i)));
+                }
+            }
+            return bytes;
+        }
+        // appends the chunks in bytes, laid out right after the ones already there or at in_offset for the first
+        void addEntries (const uint8_t* bytes, size_t size, uint64_t in_offset = 0) {
+            if (size % 8 != 0) {
+                throw std::runtime_error("Corrupt seek table!");
+            }
+            for (size_t at = 0; at < size; at += 8) {
+                Chunk chunk;
+                chunk.in_offset = chunks.empty() ? in_offset : chunks.back().in_offset + chunks.back().in_size;
+                chunk.out_offset = outSize();
+                for (int i = 0; i < 4; i++) {
+                    chunk.in_size |= (uint32_t)bytes[at + i] << (8 * i);
+                    chunk.out_size |= (uint32_t)bytes[at + 4 + i] << (8 * i);
+                }
+                chunks.push_back(chunk);
+            }
+        }
+
+        // sidecar form for raw streams, "DFSK" and a version byte, where the first chunk starts and then the entries
+        std::vector<uint8_t> serialize () const {
+            std::vector<uint8_t> bytes = {'D', 'F', 'S', 'K', 1};
+            uint64_t start = chunks.empty() ? 0 : chunks[0].in_offset;
+            for (int i = 0; i < 8; i++) {
+                bytes.push_back((uint8_t)(start >> (8 * i)));
+            }
+            std::vector<uint8_t> rest = entries();
+            bytes.insert(bytes.end(), rest.begin(), rest.end());
+            return bytes;
+        }
+        static SeekTable deserialize (const void* data, size_t size) {
+            const uint8_t* bytes = (const uint8_t*)data;
+            if (size < 13 || std::memcmp(bytes, "DFSK", 4) != 0 || bytes[4] != 1) {
+                throw std::runtime_error("Not a seek table!");
+            }
+            uint64_t start = 0;
+            for (int i = 0; i < 8; i++) {
+                start |= (uint64_t)bytes[5 + i] << (8 * i);
+            }
+            SeekTable table;
+            table.addEntries(bytes + 13, size - 13, start);
+            return table;
+        }
+        void save (std::string file_path) const {
+            std::vector<uint8_t> bytes = serialize();
+            std::ofstream f(file_path, std::ios::binary);
+            f.write((const char*)bytes.data(), bytes.size());
+            if (!f) {
+                throw std::runtime_error("Couldn't write the seek table file!");
+            }
+        }
+        static SeekTable load (std::string file_path) {
+            std::ifstream f(file_path, std::ios::binary);
+            if (!f) {
+                throw std::runtime_error("Couldn't open the seek table file!");
+            }
+            f.seekg(0, std::ios::end);
+            std::vector<uint8_t> bytes((size_t)f.tellg());
+            f.seekg(0);
+            f.read((char*)bytes.data(), bytes.size());
+            return deserialize(bytes.data(), bytes.size());
+        }
+    };
+
+    // counters for one or more compress or decompress calls, only filled in when a context is given one with setStats
+    // everything adds up, so a Stats can collect over many calls, reset it at the end of each interval to graph rates
+    // phases don't overlap, io that happens inside another phase is taken out of it
+    // cycles are the x86 time stamp counter and stay 0 on other cpus
+    // the match and chain counters are only known while compressing, decompress fills in the rest
+    struct Stats {
+        enum Phase {
+            MATCH_FINDING,
+            TREE_BUILDING,  // huffman trees on compress, the dynamic header and its decode tables on decompress
+            HEADER,         // the code length encoding of a dynamic header
+            ENTROPY_CODING, // bit encoding blocks, or decoding them
+            IO,             // reading the source and writing out blocks, or writing decoded bytes out
+            PHASES
+        };
+        static constexpr uint32_t LENGTH_BUCKETS = 8;    // 3-4, 5-8, 9-16 ... 129-256, 257-258
+        static constexpr uint32_t DISTANCE_BUCKETS = 15; // 1, 2-3, 4-7 ... 16384-32768
+        uint64_t nanoseconds[PHASES] = {};
+        uint64_t cycles[PHASES] = {};
+        uint64_t stored_blocks = 0;
+        uint64_t fixed_blocks = 0;
+        uint64_t dynamic_blocks = 0;
+        uint64_t literals = 0;
+        uint64_t matches = 0;
+        uint64_t length_buckets[LENGTH_BUCKETS] = {};
+        uint64_t distance_buckets[DISTANCE_BUCKETS] = {};
+        uint64_t chain_searches = 0; // positions the matchfinder looked up
+        uint64_t chain_steps = 0;    // candidates it compared against across all of them
+        uint64_t bytes_in = 0;
+        uint64_t bytes_out = 0;
+
+        static const char* phaseName (Phase phase) {
+            static const char* names[PHASES] = {"match_finding", "tree_building", "header", "entropy_coding", "io"};
+            return names[phase];
+        }
+        double averageChainDepth () const {
+            return chain_searches == 0 ? 0.0 : (double)chain_steps / chain_searches;
+        }
+        void addMatch (uint32_t length, uint32_t distance) {
+            matches++;
+            length_buckets[std::min(floorLog2(length - 1) - 1, LENGTH_BUCKETS - 1)]++;
+            distance_buckets[std::min(floorLog2(distance), DISTANCE_BUCKETS - 1)]++;
+        }
+        void reset () {
+            *this = Stats();
+        }
+        Stats& operator+= (const Stats& o) {
+            for (int i = 0; i < PHASES; i++) {
+                nanoseconds[i] += o.nanoseconds[i];
+                cycles[i] += o.cycles[i];
+            }
+            for (uint32_t i = 0; i < LENGTH_BUCKETS; i++) {
+                length_buckets[i] += o.length_buckets[i];
+            }
+            for (uint32_t i = 0; i < DISTANCE_BUCKETS; i++) {
+                distance_buckets[i] += o.distance_buckets[i];
+            }
+            stored_blocks += o.stored_blocks;
+            fixed_blocks += o.fixed_blocks;
+            dynamic_blocks += o.dynamic_blocks;
+            literals += o.literals;
+            matches += o.matches;
+            chain_searches += o.chain_searches;
+            chain_steps += o.chain_steps;
+            bytes_in += o.bytes_in;
+            bytes_out += o.bytes_out;
+            return *this;
+        }
+
+        // every counter with a flat name, fn(const std::string& name, uint64_t value), the exporters below go through it
+        template <typename Fn>
+        void visit (Fn&& fn) const {
+            for (int i = 0; i < PHASES; i++) {
+                fn(std::string(phaseName((Phase)i)) + "_ns", nanoseconds[i]);
+                fn(std::string(phaseName((Phase)i)) + "_cycles", cycles[i]);
+            }
+            fn("stored_blocks", stored_blocks);
+            fn("fixed_blocks", fixed_blocks);
+            fn("dynamic_blocks", dynamic_blocks);
+            fn("literals", literals);
+            fn("matches", matches);
+            for (uint32_t i = 0; i < LENGTH_BUCKETS; i++) {
+                uint32_t lo = (i == 0) ? 3 : (2u << i) + 1;
+                uint32_t hi = (i == LENGTH_BUCKETS - 1) ? 258 : 4u << i;
+                fn("length_" + std::to_string(lo) + "_" + std::to_string(hi), length_buckets[i]);
+            }
+            for (uint32_t i = 0; i < DISTANCE_BUCKETS; i++) {
+                uint32_t lo = 1u << i;
+                uint32_t hi = (i == DISTANCE_BUCKETS - 1) ? KB32 : (2u << i) - 1;
+                fn("distance_" + std::to_string(lo) + (lo == hi ? "" : "_" + std::to_string(hi)), distance_buckets[i]);
+            }
+            fn("chain_searches", chain_searches);
+            fn("chain_steps", chain_steps);
+            fn("bytes_in", bytes_in);
+            fn("bytes_out", bytes_out);
+        }
+        // one flat json object
+        std::string json () const {
+            std::string s = "{";
+            visit([&](const std::string& name, uint64_t value) {
+                s += (s.size() > 1 ? ",\"" : "\"") + name + "\":" + std::to_string(value);
+            });
+            return s + "}";
+        }
+        // prometheus text format, every counter as prefix_name
+        std::string prometheus (const std::string& prefix = "deflate") const {
+            std::string s;
+            visit([&](const std::string& name, uint64_t value) {
+                s += "# TYPE " + prefix + "_" + name + " counter\n" + prefix + "_" + name + " " + std::to_string(value) + "\n";
+            });
+            return s;
+        }
+
+        // times a phase into stats from construction to destruction, does nothing at all when stats is null
+        class Timer {
+            private:
+            Stats* stats;
+            Phase phase;
+            std::chrono::steady_clock::time_point start;
+            uint64_t start_cycles = 0;
+            uint64_t io_ns = 0;
+            uint64_t io_cycles = 0;
+            public:
+            Timer (Stats* stats, Phase phase) : stats(stats), phase(phase) {
+                if (stats) {
+                    io_ns = stats->nanoseconds[IO];
+                    io_cycles = stats->cycles[IO];
+                    start = std::chrono::steady_clock::now();
+                    start_cycles = deflate_cpu::cycles();
+                }
+            }
+            Timer (const Timer&) = delete;
+            Timer& operator= (const Timer&) = delete;
+            ~Timer () {
+                if (stats) {
+                    uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                    uint64_t c = deflate_cpu::cycles() - start_cycles;
+                    if (phase != IO) {
+                        // io that happened in the meantime already went in under IO
+                        ns -= std::min(ns, stats->nanoseconds[IO] - io_ns);
+                        c -= std::min(c, stats->cycles[IO] - io_cycles);
+                    }
+                    stats->nanoseconds[phase] += ns;
+                    stats->cycles[phase] += c;
+                }
+            }
+        };
+
+        private:
+        static uint32_t floorLog2 (uint32_t v) {
+            uint32_t r = 0;
+            while (v >>= 1) {
+                r++;
+            }
+            return r;
+        }
+    };
+
     protected:
 
     //from right to left
@@ -34,6 +310,21 @@ class deflate_compressor {
     return (c >> (31 - n)) & 1;
     }
 
+    // how many leading bytes a and b have in common, never reads past max bytes of either
+    // goes through the kernel picked for this cpu, see cpu.hpp
+    static inline uint32_t matchLength (const uint8_t* a, const uint8_t* b, uint32_t max) {
+        return deflate_cpu::kernels().matchLength(a, b, max);
+    }
+
+    // pulls the cache line at p in ahead of a load that's coming soon
+    static inline void prefetch (const void* p) {
+        #if defined(_MSC_VER) && defined(DEFLATE_X86)
+        _mm_prefetch((const char*)p, _MM_HINT_T0);
+        #elif defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(p);
+        #endif
+    }
+
     struct Code {
         uint16_t code; //actual code
         int32_t len; //code length
@@ -56,12 +347,7 @@ class deflate_compressor {
                 int32_t left;
                 int32_t right;
             };
-            struct PreMember {
-                PreCode p;
-                int32_t left = -1;
-                int32_t right = -1;
-            };
-            std::vector<Member> members;
+            std::pmr::vector<Member> members;
             int32_t value_lookup_table[300];
             int32_t head = -1;
 
@@ -101,7 +387,7 @@ class deflate_compressor {
                     }
                 }
             }
-            void construct (std::vector<Code>& codes) {
+            void construct (std::pmr::vector<Code>& codes) {
                  // sort the codes based on len, then sort by smallest value upward
                 static struct {
                     bool operator()(Code a, Code b) const { 
@@ -144,60 +430,6 @@ class deflate_compressor {
                 }
             }
             
-            static PreMember* findPreMemb (std::vector<PreMember>& tree, int32_t index, uint32_t value, int32_t d, uint32_t* depth) {
-                if (tree[index].p.value == value) {
-                    *depth = d;
-                    return &tree[index];
-                }
-                PreMember* left = nullptr;
-                PreMember* right = nullptr;
-                if (tree[index].left != -1) {
-                    left = findPreMemb(tree, tree[index].left, value, d + 1, depth);
-                }
-                if (tree[index].right != -1) {
-                    right = findPreMemb(tree, tree[index].right, value, d + 1, depth);
-                }
-                if (left != nullptr) {
-                    return left;
-                }
-                if (right != nullptr) {
-                    return right;
-                }
-                return nullptr;
-            }
-            
-            static constexpr double round1Up(double val) {
-                if (val <= 1.0 && std::abs(1.0 - val) < 1e-4) {
-                    return 1.0;
-                }
-                return val;
-            }
-            
-
-            static double checkCodesOversubscribed (std::vector<Code> codes) {
-                static struct {
-                    bool operator()(Code a, Code b) const { 
-                        if (a.len < b.len) return true;
-                        if (b.len < a.len) return false;
-
-                        if (a.value < b.value) return true;
-                        if (b.value < a.value) return false;
-                        return false;
-                    }
-                } compareCode;
-                std::sort(codes.begin(), codes.end(), compareCode);
-                double total = 0.0;
-                for (uint32_t i = 0; i < codes.size();) {
-                    double count = 0;
-                    for(size_t j = i; j < codes.size() && codes[j].len == codes[i].len; j++, count += 1.0);   
-                    double v = (count / (double)(std::pow(2, codes[i].len)));
-                    total += v;
-                    i += (uint32_t)count;   
-                }
-                total = round1Up(total);
-                return total;
-            }
-
             Member findMemberCode (uint32_t code, uint32_t len) {
                 int index = head;
                 uint32_t bit = 0;
@@ -250,12 +482,15 @@ class deflate_compressor {
                 return {0, 0, -1};
             }
         public:
-            FlatHuffmanTree() {
+            FlatHuffmanTree (std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : members(mem) {
                 for(size_t i = 0; i < 300; i++) {
                     value_lookup_table[i] = -1;
                 }
             }
-            FlatHuffmanTree (std::vector<Code> codes){
+            // builds the tree for codes, the member storage is kept for the next tree
+            void rebuild (std::pmr::vector<Code>& codes) {
+                members.clear();
+                head = -1;
                 for(size_t i = 0; i < 300; i++) {
                     value_lookup_table[i] = -1;
                 }
@@ -303,104 +538,86 @@ class deflate_compressor {
                 }
                 return {m.code, m.len, m.extra_bits, m.value};
             }
-            std::vector<Code> decode () {
-                std::vector<Code> codes;
-                for (auto& i : members) {
-                    if (i.len > -1) {
-                        codes.push_back({i.code, i.len, i.extra_bits, i.value});
-                    }
-                }
-                struct {
-                    bool operator()(Code a, Code b) const { return a.value < b.value; }
-                } compareCodeV;
-                std::sort(codes.begin(), codes.end(), compareCodeV);
-                return codes;
-            }
             // https://github.com/ebiggers/libdeflate/blob/master/lib/deflate_compress.c
             //      -https://brandougherty.github.io/blog/posts/implementing_deflate:_incomplete_and_oversubscribed_codes.html
             // The tree is built by repeatedly combining the two least frequent symbols or trees, assigning them longer codes as the process progresses.
-            static std::vector<Code> generateCodeLengths (std::vector<PreCode> precodes, uint32_t max_bit_length) {
-                struct Compare {
-                    bool operator()(PreMember l, PreMember r) {
-                        return l.p.occurs > r.p.occurs;
+            // leaves sorted by frequency and the combined nodes come out in order too, so two queues in one array do instead of a heap
+            // lengths over max_bit_length get clamped and then the kraft sum is walked back down to exactly 1 like miniz does
+            // nothing is allocated, codes is cleared and refilled
+            static void generateCodeLengths (const PreCode precodes[], size_t n, uint32_t max_bit_length, std::pmr::vector<Code>& codes) {
+                codes.clear();
+                if (n == 0) {
+                    return;
+                }
+                if (n == 1) {
+                    codes.push_back({0, 1, 0, (uint16_t)precodes[0].value});
+                    return;
+                }
+                uint16_t order[300];
+                for (size_t i = 0; i < n; i++) {
+                    order[i] = (uint16_t)i;
+                }
+                std::sort(order, order + n, [&](uint16_t a, uint16_t b) {
+                    if (precodes[a].occurs != precodes[b].occurs) {
+                        return precodes[a].occurs < precodes[b].occurs;
                     }
-                };
-                std::priority_queue<PreMember, std::vector<PreMember>, Compare> pq;
-                for (auto& i : precodes) {
-                    pq.push({{i.value, i.occurs}, -1, -1});
-                }
-                // combine the two least frequent till we have nothing left
-                std::vector<PreMember> output_array;
-                while (!pq.empty()) {
-                    if (pq.size() == 1) {
-                        output_array.push_back(pq.top());
-                        pq.pop();
-                    } else {
-                        // first
-                        PreMember p1 = pq.top();
-                        output_array.push_back(p1);
-                        pq.pop();
-                        // second
-                        PreMember p2 = pq.top();
-                        output_array.push_back(p2);
-                        pq.pop();
-                        PreMember comb = {{-1, p1.p.occurs+p2.p.occurs}, (int32_t)output_array.size() - 2, (int32_t)output_array.size() - 1};
-                        pq.push(comb);
-                    }
-                }
-                int32_t head = output_array.size() - 1;
-                std::vector<Code> codes;
-                // constructing code lengths
-                std::queue<PreMember*> code_lens[16] = {};
-                for (auto& i : precodes) {
-                    uint32_t depth = 0;
-                    PreMember* pre = findPreMemb(output_array, head, i.value, 0, &depth);
-                    // this shouldn't happen but is possible and will corrupt entire stack so better off
-                    if (depth > 15) {
-                        depth = 15;
-                    }
-                    code_lens[depth].push(pre);
-                }
-                // https://github.com/madler/zlib/blob/develop/trees.c
-                // https://www.infinitepartitions.com/art001.html
-                // https://www.mrbluyee.com/2024/03/28/huffman-coding-in-deflate/
-                // ripped this from zlib, move a higher level leaf down one and move two overflows up to the same level, we maintain kraft = 1
-                for (size_t bits = 15; bits > max_bit_length; bits--) {
-                    while(code_lens[bits].size() > 0) {
-                        // get the longest code which can be moved down
-                        size_t tbits = max_bit_length - 1;
-                        while (code_lens[tbits].size() == 0) tbits--;
-                        PreMember* p = code_lens[tbits].front();
-                        code_lens[tbits].pop();
-                        PreMember* p2 = code_lens[bits].front();
-                        code_lens[bits].pop();
-                        bool second = false;
-                        PreMember* p3;
-                        if (code_lens[bits].size() > 0) {
-                            p3 = code_lens[bits].front();
-                            code_lens[bits].pop();
-                            second = true;
+                    return precodes[a].value < precodes[b].value;
+                });
+                // 0..n-1 are the leaves in frequency order, n.. the combined nodes in the order they were made
+                uint64_t weight[600];
+                uint16_t parent[600];
+                for (size_t i = 0; i < n; i++) {
+                    weight[i] = precodes[order[i]].occurs;
+                }
+                size_t leaf = 0;
+                size_t node = n;
+                for (size_t next = n; next < 2 * n - 1; next++) {
+                    size_t pick[2];
+                    for (size_t k = 0; k < 2; k++) {
+                        if (leaf < n && (node >= next || weight[leaf] <= weight[node])) {
+                            pick[k] = leaf++;
+                        } else {
+                            pick[k] = node++;
                         }
-                        code_lens[tbits + 1].push(p);
-                        code_lens[tbits + 1].push(p2);
-                        if (second) {
-                            code_lens[tbits + 1].push(p3);
+                    }
+                    weight[next] = weight[pick[0]] + weight[pick[1]];
+                    parent[pick[0]] = (uint16_t)next;
+                    parent[pick[1]] = (uint16_t)next;
+                }
+                // parents always come later, so one backwards pass gives every depth
+                uint32_t depth[600];
+                size_t root = 2 * n - 2;
+                depth[root] = 0;
+                for (size_t i = root; i-- > 0;) {
+                    depth[i] = depth[parent[i]] + 1;
+                }
+                uint32_t bl_count[16] = {0};
+                for (size_t i = 0; i < n; i++) {
+                    bl_count[std::min(depth[i], max_bit_length)]++;
+                }
+                // clamping only made codes shorter so the sum is over 1, each step moves one leaf down a level and drops one max length code
+                uint64_t total = 0;
+                for (uint32_t bits = 1; bits <= max_bit_length; bits++) {
+                    total += (uint64_t)bl_count[bits] << (max_bit_length - bits);
+                }
+                while (total != ((uint64_t)1 << max_bit_length)) {
+                    bl_count[max_bit_length]--;
+                    for (uint32_t bits = max_bit_length - 1; bits > 0; bits--) {
+                        if (bl_count[bits]) {
+                            bl_count[bits]--;
+                            bl_count[bits + 1] += 2;
+                            break;
                         }
                     }
+                    total--;
                 }
-                for (uint8_t i = 15; i >= 1; i--) {
-                    while (code_lens[i].size() > 0) {
-                        codes.push_back({0, i, 0, (uint16_t)code_lens[i].front()->p.value});
-                        code_lens[i].pop();
+                // least frequent symbols get the longest codes
+                size_t i = 0;
+                for (uint32_t bits = max_bit_length; bits >= 1; bits--) {
+                    for (uint32_t k = 0; k < bl_count[bits]; k++, i++) {
+                        codes.push_back({0, (int32_t)bits, 0, (uint16_t)precodes[order[i]].value});
                     }
                 }
-                // try fixing tree first
-                if (checkCodesOversubscribed(codes) != 1.0) {
-                    std::string str = "Code tree is over or under subscribed!" + std::to_string(checkCodesOversubscribed(codes));
-                    std::cerr << str << "\n";
-                    throw std::runtime_error(str.c_str());
-                }
-                return codes;
             }
     };
 
@@ -412,17 +629,20 @@ class deflate_compressor {
         int32_t extra_bits;
     };
 
+    // at most 30 ranges (the distance codes), so they live inline
     class RangeLookup {
     private:
-        std::vector <Range> ranges;
+        Range ranges[30];
+        size_t count = 0;
     public:
         RangeLookup () {
         }
         void addRange (Range r) {
-            ranges.push_back(r);
+            ranges[count++] = r;
         }
         Range lookup (uint32_t length) {
-            for (Range i : ranges) {
+            for (size_t j = 0; j < count; j++) {
+                Range i = ranges[j];
                 if (length >= i.start && length <= i.end) {
                     return i;
                 }
@@ -430,7 +650,8 @@ class deflate_compressor {
             return {0, 0, 0, -1};
         }
         Range findCode (uint32_t code) {
-            for (Range i : ranges) {
+            for (size_t j = 0; j < count; j++) {
+                Range i = ranges[j];
                 if (i.code == code) {
                     return i;
                 }
@@ -439,8 +660,8 @@ class deflate_compressor {
         }
     };
 
-    static std::vector<Code> generateFixedCodes () {
-        std::vector <Code> fixed_codes;
+    static void generateFixedCodes (std::pmr::vector<Code>& fixed_codes) {
+        fixed_codes.clear();
         uint16_t i = 0;
         //regular alphabet
         for (uint16_t code = 48; i < 144; i++, code++) {
@@ -478,11 +699,10 @@ class deflate_compressor {
             }
             fixed_codes.push_back({code, 8, extra_bits, i});
         }
-        return fixed_codes;
     }
 
-    static std::vector <Code> generateFixedDistanceCodes () {
-        std::vector <Code> fixed_codes;
+    static void generateFixedDistanceCodes (std::pmr::vector<Code>& fixed_codes) {
+        fixed_codes.clear();
         uint8_t extra_bits = 0;
         //regular alphabet
         for (uint16_t i = 0; i < 32; i++) {
@@ -491,7 +711,6 @@ class deflate_compressor {
             } 
             fixed_codes.push_back({i, 5, extra_bits, i});
         }
-        return fixed_codes;
     }
 
     static std::streampos getFileSize (std::string file) {
@@ -573,4 +792,198 @@ class deflate_compressor {
         rl.addRange({24577, 32768, 29, 13});
         return rl;
     }
+
+    // runs work(state, i) for every i below count on up to threads workers, 0 means one per core
+    // items are handed out one at a time off a shared counter so uneven sizes still balance out,
+    // every worker makes its own state once with makeState and reuses it for all its items
+    // the calling thread is one of the workers, if a thread can't be started the others pick up its share
+    // the first exception out of makeState or work stops the handing out, and is rethrown once every worker is joined
+    template <typename MakeState, typename Work>
+    static void parallelItems (size_t count, size_t threads, MakeState makeState, Work work) {
+        if (count == 0) {
+            return;
+        }
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = std::min(threads, count);
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::mutex error_lock;
+        auto worker = [&]() {
+            try {
+                auto state = makeState();
+                for (size_t i = next++; i < count; i = next++) {
+                    work(state, i);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_lock);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = count;
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t t = 1; t < threads; t++) {
+            try {
+                pool.emplace_back(worker);
+            } catch (std::system_error& e) {
+                break;
+            }
+        }
+        worker();
+        for (auto& t : pool) {
+            t.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // the threads of parallelItems kept up between runs, each worker holding on to one State built once out of the constructor's args
+    // run hands items out off a shared counter the same way, the calling thread takes its part with the first state
+    // one run at a time, run isn't synchronized against itself
+    template <typename State>
+    class WorkerPool {
+    private:
+        std::deque<State> states; // never moves them, so workers keep their reference
+        std::vector<std::thread> pool;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        uint64_t generation = 0;
+        size_t busy = 0;
+        bool stopping = false;
+        // the running batch, work is whatever run was given behind a plain function pointer
+        void* work = nullptr;
+        void (*call)(void* fn, State& state, size_t i) = nullptr;
+        size_t count = 0;
+        std::atomic<size_t> next{0};
+        std::exception_ptr error;
+
+        void takeItems (State& state) {
+            try {
+                for (size_t i = next++; i < count; i = next++) {
+                    call(work, state, i);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = count;
+            }
+        }
+        void workerLoop (State& state) {
+            uint64_t seen = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [&] { return stopping || generation != seen; });
+                    if (stopping) {
+                        return;
+                    }
+                    seen = generation;
+                }
+                takeItems(state);
+                std::lock_guard<std::mutex> guard(lock);
+                if (--busy == 0) {
+                    done.notify_one();
+                }
+            }
+        }
+    public:
+        // threads is the worker count with the calling thread included, 0 means one per core
+        // if a thread can't be started the pool just runs with fewer
+        template <typename... Args>
+        WorkerPool (size_t threads, const Args&... args) {
+            if (threads == 0) {
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            for (size_t t = 0; t < threads; t++) {
+                states.emplace_back(args...);
+            }
+            for (size_t t = 1; t < threads; t++) {
+                try {
+                    pool.emplace_back([this, t]() {
+                        workerLoop(states[t]);
+                    });
+                } catch (std::system_error& e) {
+                    break;
+                }
+            }
+            while (states.size() > pool.size() + 1) {
+                states.pop_back();
+            }
+        }
+        ~WorkerPool () {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& t : pool) {
+                t.join();
+            }
+        }
+        WorkerPool (const WorkerPool&) = delete;
+        WorkerPool& operator= (const WorkerPool&) = delete;
+
+        size_t threads () const {
+            return states.size();
+        }
+        // runs work(state, i) for every i below count and returns once they're all done
+        // the first exception out of work stops the handing out, and is rethrown once every worker is idle again
+        template <typename Work>
+        void run (size_t count, Work work) {
+            if (count == 0) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                this->work = &work;
+                call = [](void* fn, State& state, size_t i) {
+                    (*(Work*)fn)(state, i);
+                };
+                this->count = count;
+                next = 0;
+                error = nullptr;
+                busy = pool.size();
+                generation++;
+            }
+            wake.notify_all();
+            takeItems(states.front());
+            std::exception_ptr failed;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                done.wait(guard, [&] { return busy == 0; });
+                failed = error;
+            }
+            if (failed) {
+                std::rethrow_exception(failed);
+            }
+        }
+    };
+
+    // fills in item from fn, which returns the output size or throws, errors stay with the item instead of ending the batch
+    template <typename Fn>
+    static void runBatchItem (BatchItem& item, Fn fn) {
+        try {
+            item.out_size = fn();
+            item.ok = true;
+            item.error.clear();
+        } catch (std::exception& e) {
+            item.out_size = 0;
+            item.ok = false;
+            item.error = e.what();
+        }
+    }
+    static size_t failedItems (const BatchItem items[], size_t count) {
+        size_t failed = 0;
+        for (size_t i = 0; i < count; i++) {
+            failed += items[i].ok ? 0 : 1;
+        }
+        return failed;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,536 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define DEFLATE_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+// gcc and clang can build a single function for a wider instruction set than the rest of the binary,
+// msvc lets intrinsics through anywhere so nothing is needed there
+#if defined(DEFLATE_X86) && (defined(__GNUC__) || defined(__clang__))
+#define DEFLATE_TARGET(x) __attribute__((target(x)))
+#define DEFLATE_HAS_TARGETS
+#elif defined(DEFLATE_X86) && defined(_MSC_VER)
+#define DEFLATE_TARGET(x)
+#define DEFLATE_HAS_TARGETS
+#else
+#define DEFLATE_TARGET(x)
+#endif
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DEFLATE_LITTLE_ENDIAN
+#endif
+#if defined(_MSC_VER)
+#define DEFLATE_FORCE_INLINE __forceinline
+#else
+#define DEFLATE_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+// runtime cpu detection for the hot kernels
+// features are read once with cpuid, then every kernel is bound to the widest variant the cpu supports
+// there is always a portable scalar variant, so anything that isn't x86 just runs that
+// restrict is there so tests and benchmarks can pin narrower variants, it isn't synchronized so call it before any work starts
+class deflate_cpu {
+public:
+    struct Features {
+        bool sse2 = false;
+        bool ssse3 = false;
+        bool sse42 = false;
+        bool avx2 = false;
+        bool bmi2 = false;
+        bool pclmulqdq = false;
+    };
+
+    typedef uint32_t (*MatchLengthFunc)(const uint8_t* a, const uint8_t* b, uint32_t max);
+    typedef void (*MatchCopyFunc)(uint8_t* dst, uint32_t distance, uint32_t length);
+    typedef uint32_t (*Crc32Func)(uint32_t crc, const uint8_t* data, size_t n);
+    typedef uint32_t (*Adler32Func)(uint32_t adler, const uint8_t* data, size_t n);
+
+    struct Kernels {
+        MatchLengthFunc matchLength;
+        MatchCopyFunc matchCopy;
+        Crc32Func crc32;
+        Adler32Func adler32;
+        bool bmi2_decode;
+    };
+
+    static Features detected () {
+        Features f;
+        #if defined(DEFLATE_X86)
+        uint32_t regs[4] = {0};
+        cpuid(0, 0, regs);
+        uint32_t max_leaf = regs[0];
+        if (max_leaf < 1) {
+            return f;
+        }
+        cpuid(1, 0, regs);
+        f.sse2 = (regs[3] >> 26) & 1;
+        f.ssse3 = (regs[2] >> 9) & 1;
+        f.sse42 = (regs[2] >> 20) & 1;
+        f.pclmulqdq = (regs[2] >> 1) & 1;
+        bool osxsave = (regs[2] >> 27) & 1;
+        bool avx = (regs[2] >> 28) & 1;
+        // the os has to save the ymm registers on a context switch before avx2 is usable
+        bool ymm = osxsave && avx && (xgetbv0() & 0x6) == 0x6;
+        if (max_leaf >= 7) {
+            cpuid(7, 0, regs);
+            f.avx2 = ymm && ((regs[1] >> 5) & 1);
+            f.bmi2 = (regs[1] >> 8) & 1;
+        }
+        #endif
+        return f;
+    }
+
+    static const Features& features () {
+        return state().features;
+    }
+
+    static const Kernels& kernels () {
+        return state().kernels;
+    }
+
+    // the time stamp counter on x86, for the stats counters, 0 anywhere else
+    static inline uint64_t cycles () {
+        #if defined(DEFLATE_X86)
+        return __rdtsc();
+        #else
+        return 0;
+        #endif
+    }
+
+    // only keeps the features that are set in both allowed and the detected set, then rebinds
+    static void restrict (const Features& allowed) {
+        Features d = detected();
+        Features f;
+        f.sse2 = d.sse2 && allowed.sse2;
+        f.ssse3 = d.ssse3 && allowed.ssse3;
+        f.sse42 = d.sse42 && allowed.sse42;
+        f.avx2 = d.avx2 && allowed.avx2;
+        f.bmi2 = d.bmi2 && allowed.bmi2;
+        f.pclmulqdq = d.pclmulqdq && allowed.pclmulqdq;
+        state().features = f;
+        bind(state());
+    }
+
+    // kernels
+
+    static inline uint32_t ctz32 (uint32_t v) {
+        #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, v);
+        return index;
+        #else
+        return __builtin_ctz(v);
+        #endif
+    }
+    static inline uint32_t ctz64 (uint64_t v) {
+        #if defined(_MSC_VER) && defined(_M_X64)
+        unsigned long index;
+        _BitScanForward64(&index, v);
+        return index;
+        #elif defined(_MSC_VER)
+        return ((uint32_t)v != 0) ? ctz32((uint32_t)v) : 32 + ctz32((uint32_t)(v >> 32));
+        #else
+        return __builtin_ctzll(v);
+        #endif
+    }
+
+    // how many leading bytes a and b have in common, never reads past max bytes of either
+    // 8 bytes a step through a 64 bit xor, the first differing byte comes out of a ctz
+    static uint32_t matchLengthScalar (const uint8_t* a, const uint8_t* b, uint32_t max) {
+        return matchLengthTail(a, b, 0, max);
+    }
+    #if defined(DEFLATE_HAS_TARGETS)
+    DEFLATE_TARGET("sse2") static uint32_t matchLengthSse2 (const uint8_t* a, const uint8_t* b, uint32_t max) {
+        uint32_t len = 0;
+        while (len + 16 <= max) {
+            __m128i va = _mm_loadu_si128((const __m128i*)(a + len));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(b + len));
+            uint32_t mask = (~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))) & 0xffff;
+            if (mask != 0) {
+                return len + ctz32(mask);
+            }
+            len += 16;
+        }
+        return matchLengthTail(a, b, len, max);
+    }
+    DEFLATE_TARGET("avx2") static uint32_t matchLengthAvx2 (const uint8_t* a, const uint8_t* b, uint32_t max) {
+        uint32_t len = 0;
+        while (len + 32 <= max) {
+            __m256i va = _mm256_loadu_si256((const __m256i*)(a + len));
+            __m256i vb = _mm256_loadu_si256((const __m256i*)(b + len));
+            uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+            if (mask != 0) {
+                return len + ctz32(mask);
+            }
+            len += 32;
+        }
+        if (len + 16 <= max) {
+            __m128i va = _mm_loadu_si128((const __m128i*)(a + len));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(b + len));
+            uint32_t mask = (~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))) & 0xffff;
+            if (mask != 0) {
+                return len + ctz32(mask);
+            }
+            len += 16;
+        }
+        return matchLengthTail(a, b, len, max);
+    }
+    #endif
+
+    // lz77 copy of length bytes from distance back, inside the output buffer
+    // callers keep 32 bytes of slack past dst + length, the wide variants overshoot into it instead of finishing byte by byte
+    static void matchCopyScalar (uint8_t* dst, uint32_t distance, uint32_t length) {
+        const uint8_t* src = dst - distance;
+        if (distance >= 8) {
+            for (uint32_t i = 0; i < length; i += 8) {
+                std::memcpy(dst + i, src + i, 8);
+            }
+        } else if (distance == 1) {
+            std::memset(dst, src[0], length);
+        } else {
+            for (uint32_t i = 0; i < length; i++) {
+                dst[i] = src[i];
+            }
+        }
+    }
+    #if defined(DEFLATE_HAS_TARGETS)
+    DEFLATE_TARGET("sse2") static void matchCopySse2 (uint8_t* dst, uint32_t distance, uint32_t length) {
+        if (distance < 16) {
+            matchCopyScalar(dst, distance, length);
+            return;
+        }
+        const uint8_t* src = dst - distance;
+        for (uint32_t i = 0; i < length; i += 16) {
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+        }
+    }
+    DEFLATE_TARGET("avx2") static void matchCopyAvx2 (uint8_t* dst, uint32_t distance, uint32_t length) {
+        if (distance < 32) {
+            matchCopySse2(dst, distance, length);
+            return;
+        }
+        const uint8_t* src = dst - distance;
+        for (uint32_t i = 0; i < length; i += 32) {
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+        }
+    }
+    #endif
+
+    // crc-32 the way gzip and zip use it (reflected polynomial 0xedb88320), crc is the value so far and 0 to start
+    // slice by 8, eight independent table lookups for every 8 bytes instead of a chain of 8 dependent ones
+    static uint32_t crc32Scalar (uint32_t crc, const uint8_t* data, size_t n) {
+        const Crc32Tables& t = crc32Tables();
+        crc = ~crc;
+        while (n >= 8) {
+            uint32_t a = crc ^ (data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+            uint32_t b = data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+            crc = t.t[7][a & 0xff] ^ t.t[6][(a >> 8) & 0xff] ^ t.t[5][(a >> 16) & 0xff] ^ t.t[4][a >> 24]
+                ^ t.t[3][b & 0xff] ^ t.t[2][(b >> 8) & 0xff] ^ t.t[1][(b >> 16) & 0xff] ^ t.t[0][b >> 24];
+            data += 8;
+            n -= 8;
+        }
+        while (n > 0) {
+            crc = t.t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+            n--;
+        }
+        return ~crc;
+    }
+    #if defined(DEFLATE_HAS_TARGETS)
+    // folds four 128 bit lanes 64 bytes a step with carryless multiplies, then down to one lane and barrett reduces it
+    // the constants are the bit reflected ones from intel's "fast crc computation for generic polynomials using pclmulqdq"
+    // whatever doesn't fill a 16 byte block at the end goes through the scalar one
+    DEFLATE_TARGET("sse2,pclmul") static uint32_t crc32Pclmul (uint32_t crc, const uint8_t* data, size_t n) {
+        if (n < 64) {
+            return crc32Scalar(crc, data, n);
+        }
+        size_t folded = n & ~(size_t)15;
+        const uint8_t* p = data;
+        size_t left = folded;
+        __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+        __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+        __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+        __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+        __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+        __m128i x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+        __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+        __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+        __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)~crc));
+        p += 64;
+        left -= 64;
+        while (left >= 64) {
+            __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+            __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+            __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+            __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+            p += 64;
+            left -= 64;
+        }
+        // four lanes into one
+        __m128i lanes[3] = {x2, x3, x4};
+        for (int i = 0; i < 3; i++) {
+            __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+        }
+        while (left >= 16) {
+            __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)p)), x5);
+            p += 16;
+            left -= 16;
+        }
+        // 128 bits to 64
+        x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, low32);
+        x1 = _mm_clmulepi64_si128(x1, k5, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+        // barrett reduction to 32
+        x2 = _mm_and_si128(x1, low32);
+        x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+        x2 = _mm_and_si128(x2, low32);
+        x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+        crc = ~(uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+        return crc32Scalar(crc, data + folded, n - folded);
+    }
+    #endif
+
+    // adler-32 the way zlib uses it, adler is the value so far and 1 to start
+    // both sums only get reduced mod 65521 every 5552 bytes, the most that can go by before s2 could overflow 32 bits
+    static constexpr uint32_t adler_mod = 65521;
+    static constexpr size_t adler_block = 5552;
+    static uint32_t adler32Scalar (uint32_t adler, const uint8_t* data, size_t n) {
+        uint32_t s1 = adler & 0xffff;
+        uint32_t s2 = adler >> 16;
+        while (n > 0) {
+            size_t block = (n < adler_block) ? n : adler_block;
+            n -= block;
+            while (block >= 8) {
+                s1 += data[0]; s2 += s1;
+                s1 += data[1]; s2 += s1;
+                s1 += data[2]; s2 += s1;
+                s1 += data[3]; s2 += s1;
+                s1 += data[4]; s2 += s1;
+                s1 += data[5]; s2 += s1;
+                s1 += data[6]; s2 += s1;
+                s1 += data[7]; s2 += s1;
+                data += 8;
+                block -= 8;
+            }
+            while (block > 0) {
+                s1 += *data++;
+                s2 += s1;
+                block--;
+            }
+            s1 %= adler_mod;
+            s2 %= adler_mod;
+        }
+        return s1 | (s2 << 16);
+    }
+    #if defined(DEFLATE_HAS_TARGETS)
+    // 32 bytes a step, s1 gets the byte sums out of psadbw and s2 the position weighted ones out of pmaddubsw
+    // every step also adds the s1 so far into ps, which becomes the 32 * s1 each step owes s2, all of it is reduced once a block
+    DEFLATE_TARGET("ssse3") static uint32_t adler32Ssse3 (uint32_t adler, const uint8_t* data, size_t n) {
+        uint32_t s1 = adler & 0xffff;
+        uint32_t s2 = adler >> 16;
+        const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+        const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+        size_t steps = n / 32;
+        n -= steps * 32;
+        while (steps > 0) {
+            size_t block = (steps < adler_block / 32) ? steps : adler_block / 32;
+            steps -= block;
+            __m128i ps = _mm_cvtsi32_si128((int)(s1 * block));
+            __m128i v2 = _mm_cvtsi32_si128((int)s2);
+            __m128i v1 = _mm_setzero_si128();
+            do {
+                __m128i a = _mm_loadu_si128((const __m128i*)data);
+                __m128i b = _mm_loadu_si128((const __m128i*)(data + 16));
+                ps = _mm_add_epi32(ps, v1);
+                v1 = _mm_add_epi32(v1, _mm_add_epi32(_mm_sad_epu8(a, zero), _mm_sad_epu8(b, zero)));
+                v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(a, tap1), ones));
+                v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(b, tap2), ones));
+                data += 32;
+            } while (--block);
+            v2 = _mm_add_epi32(v2, _mm_slli_epi32(ps, 5));
+            v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+            v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(2, 3, 0, 1)));
+            v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2)));
+            s1 = (s1 + (uint32_t)_mm_cvtsi128_si32(v1)) % adler_mod;
+            s2 = (uint32_t)_mm_cvtsi128_si32(v2) % adler_mod;
+        }
+        return adler32Scalar(s1 | (s2 << 16), data, n);
+    }
+    DEFLATE_TARGET("avx2") static uint32_t adler32Avx2 (uint32_t adler, const uint8_t* data, size_t n) {
+        uint32_t s1 = adler & 0xffff;
+        uint32_t s2 = adler >> 16;
+        const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi16(1);
+        size_t steps = n / 32;
+        n -= steps * 32;
+        while (steps > 0) {
+            size_t block = (steps < adler_block / 32) ? steps : adler_block / 32;
+            steps -= block;
+            __m256i ps = _mm256_setr_epi32((int)(s1 * block), 0, 0, 0, 0, 0, 0, 0);
+            __m256i v2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+            __m256i v1 = _mm256_setzero_si256();
+            do {
+                __m256i a = _mm256_loadu_si256((const __m256i*)data);
+                ps = _mm256_add_epi32(ps, v1);
+                v1 = _mm256_add_epi32(v1, _mm256_sad_epu8(a, zero));
+                v2 = _mm256_add_epi32(v2, _mm256_madd_epi16(_mm256_maddubs_epi16(a, tap), ones));
+                data += 32;
+            } while (--block);
+            v2 = _mm256_add_epi32(v2, _mm256_slli_epi32(ps, 5));
+            s1 = (s1 + sum32(v1)) % adler_mod;
+            s2 = sum32(v2) % adler_mod;
+        }
+        return adler32Scalar(s1 | (s2 << 16), data, n);
+    }
+    #endif
+
+private:
+    struct State {
+        Features features;
+        Kernels kernels;
+    };
+
+    static State& state () {
+        // built on first use, c++11 makes this thread safe
+        static State s = initial();
+        return s;
+    }
+    static State initial () {
+        State s;
+        s.features = detected();
+        bind(s);
+        return s;
+    }
+    static void bind (State& s) {
+        s.kernels.matchLength = matchLengthScalar;
+        s.kernels.matchCopy = matchCopyScalar;
+        s.kernels.crc32 = crc32Scalar;
+        s.kernels.adler32 = adler32Scalar;
+        s.kernels.bmi2_decode = false;
+        #if defined(DEFLATE_HAS_TARGETS)
+        if (s.features.sse2) {
+            s.kernels.matchLength = matchLengthSse2;
+            s.kernels.matchCopy = matchCopySse2;
+        }
+        if (s.features.avx2) {
+            s.kernels.matchLength = matchLengthAvx2;
+            s.kernels.matchCopy = matchCopyAvx2;
+        }
+        if (s.features.sse2 && s.features.pclmulqdq) {
+            s.kernels.crc32 = crc32Pclmul;
+        }
+        if (s.features.ssse3) {
+            s.kernels.adler32 = adler32Ssse3;
+        }
+        if (s.features.avx2) {
+            s.kernels.adler32 = adler32Avx2;
+        }
+        s.kernels.bmi2_decode = s.features.bmi2;
+        #endif
+    }
+
+    struct Crc32Tables {
+        uint32_t t[8][256];
+    };
+    // t[0] is the usual byte at a time table, t[k] is a byte followed by k zero bytes
+    static const Crc32Tables& crc32Tables () {
+        static const Crc32Tables tables = []() {
+            Crc32Tables tables;
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int bit = 0; bit < 8; bit++) {
+                    c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+                }
+                tables.t[0][i] = c;
+            }
+            for (uint32_t i = 0; i < 256; i++) {
+                for (int k = 1; k < 8; k++) {
+                    uint32_t prev = tables.t[k - 1][i];
+                    tables.t[k][i] = (prev >> 8) ^ tables.t[0][prev & 0xff];
+                }
+            }
+            return tables;
+        }();
+        return tables;
+    }
+
+    #if defined(DEFLATE_HAS_TARGETS)
+    // all eight 32 bit lanes added up
+    DEFLATE_TARGET("avx2") static inline uint32_t sum32 (__m256i v) {
+        __m128i x = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+        x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+        return (uint32_t)_mm_cvtsi128_si32(x);
+    }
+    #endif
+
+    static inline uint32_t matchLengthTail (const uint8_t* a, const uint8_t* b, uint32_t len, uint32_t max) {
+        #if defined(DEFLATE_LITTLE_ENDIAN)
+        while (len + 8 <= max) {
+            uint64_t va;
+            uint64_t vb;
+            std::memcpy(&va, a + len, 8);
+            std::memcpy(&vb, b + len, 8);
+            uint64_t diff = va ^ vb;
+            if (diff != 0) {
+                return len + (ctz64(diff) >> 3);
+            }
+            len += 8;
+        }
+        #endif
+        while (len < max && a[len] == b[len]) {
+            len++;
+        }
+        return len;
+    }
+
+    #if defined(DEFLATE_X86)
+    static void cpuid (uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+        #if defined(_MSC_VER)
+        int r[4];
+        __cpuidex(r, (int)leaf, (int)subleaf);
+        for (int i = 0; i < 4; i++) {
+            regs[i] = (uint32_t)r[i];
+        }
+        #else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+        #endif
+    }
+    static uint64_t xgetbv0 () {
+        #if defined(_MSC_VER)
+        return _xgetbv(0);
+        #else
+        uint32_t eax;
+        uint32_t edx;
+        __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((uint64_t)edx << 32) | eax;
+        #endif
+    }
+    #endif
+};
@@ -1,10 +1,7 @@
 #pragma once
 #include "common.hpp"
 #include <utility>
-#ifdef DEBUG
-#include <iostream>
-#include <chrono>
-#endif
+#include <unordered_map>
 #define MAX_LITLEN_CODE_LEN 15
 #define MAX_DIST_CODE_LEN 15
 #define MAX_PRE_CODE_LEN 7
@@ -21,6 +18,28 @@
 // https://www.cs.ucdavis.edu/~martel/122a/deflate.html
 
 class deflate : deflate_compressor {
+public:
+    enum Flush {
+        NO_FLUSH,
+        SYNC_FLUSH,
+        FULL_FLUSH,
+        FINISH
+    };
+    // how matches are searched for, independent of the level
+    // DEFAULT_STRATEGY - whatever the level does
+    // FILTERED         - level matching but short matches are dropped for literals, for data that is mostly noise
+    // HUFFMAN_ONLY     - no matching at all, literals are just entropy coded
+    // RLE              - only runs, distance 1 to 4, good for images
+    enum Strategy {
+        DEFAULT_STRATEGY,
+        FILTERED,
+        HUFFMAN_ONLY,
+        RLE
+    };
+    using deflate_compressor::BatchItem;
+    using deflate_compressor::GzipHeader;
+    using deflate_compressor::SeekTable;
+    using deflate_compressor::Stats;
 private:
 
      static uint32_t flipBits (uint32_t value, uint8_t max_bit) {
@@ -37,11 +56,14 @@ private:
         uint32_t codes[300];
     public:
         CodeMap () {
-            std::memset(codes, 0, sizeof(uint32_t) * 300);
+            clear();
         }
         CodeMap (const CodeMap& c) {
             std::memcpy(codes, c.codes, sizeof(uint32_t) * 300);
         }
+        void clear () {
+            std::memset(codes, 0, sizeof(uint32_t) * 300);
+        }
         void addOccur (uint32_t code) {
             if (code < 300) {
                 codes[code] += 1;
@@ -53,37 +75,40 @@ private:
             }
             return 0;
         }
-        std::vector<Code> generateCodes (uint32_t max_bit_length) {   
-            std::vector <PreCode> temp_codes;
+        // a code needs at least two symbols to be complete, so pad with unused ones like libdeflate does
+        size_t usedCodes (PreCode temp_codes[300]) {
+            size_t n = 0;
             for (uint32_t i = 0; i < 300; i++) {
                 uint32_t occurs = getOccur(i);
                 if (occurs) {
-                    temp_codes.push_back({(int32_t)i, occurs});
+                    temp_codes[n++] = {(int32_t)i, occurs};
                 }
             }
-            std::vector<Code> out_codes = FlatHuffmanTree::generateCodeLengths(temp_codes, max_bit_length);
-            return out_codes;
-        }
-        FlatHuffmanTree generateTree (uint32_t max_bit_length) {
-            std::vector <PreCode> temp_codes;
-            for (uint32_t i = 0; i < 300; i++) {
-                uint32_t occurs = getOccur(i);
-                if (occurs) {
-                    temp_codes.push_back({(int32_t)i, occurs});
+            for (int32_t i = 0; n < 2; i++) {
+                if (n == 0 || temp_codes[0].value != i) {
+                    temp_codes[n++] = {i, 0};
                 }
             }
-            std::vector<Code> tree_codes = FlatHuffmanTree::generateCodeLengths(temp_codes, max_bit_length);
-            FlatHuffmanTree tree = FlatHuffmanTree(tree_codes);
-            return tree;
+            return n;
+        }
+        // codes is scratch the caller keeps around, so neither of these allocate once it has grown
+        void generateCodes (uint32_t max_bit_length, std::pmr::vector<Code>& codes) {
+            PreCode temp_codes[300];
+            size_t n = usedCodes(temp_codes);
+            FlatHuffmanTree::generateCodeLengths(temp_codes, n, max_bit_length, codes);
+        }
+        void generateTree (uint32_t max_bit_length, FlatHuffmanTree& tree, std::pmr::vector<Code>& codes) {
+            generateCodes(max_bit_length, codes);
+            tree.rebuild(codes);
         }
     };
     class Bitstream {
         private:
             uint8_t bit_offset;
             uint32_t offset;
-            std::vector<uint8_t> data;
+            std::pmr::vector<uint8_t> data;
         public:
-            Bitstream () {
+            Bitstream (std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : data(mem) {
                 bit_offset = 0;
                 offset = 0;
                 data.push_back(0);
@@ -127,12 +152,45 @@ private:
             }
 
             std::vector<uint8_t> getData () {
-                return data;
+                return std::vector<uint8_t>(data.begin(), data.begin() + getSize());
             }
-            void addRawBuffer (uint8_t buffer[], size_t n) {
-                for (size_t i = 0; i < n; i++) {
-                    addBits(buffer[i], 8);
+            // writes n bytes of src starting bit_offset bits into dst[0], whose bits from there up have to be clear
+            // dst needs n + 1 bytes, the last one gets the bits that spill over
+            // unaligned it's done 8 bytes at a time, each word shifted up with the top of the one before carried in
+            static void spliceBytes (uint8_t* dst, uint8_t bit_offset, const uint8_t src[], size_t n) {
+                if (bit_offset == 0) {
+                    std::memcpy(dst, src, n);
+                    dst[n] = 0;
+                    return;
                 }
+                uint64_t carry = dst[0] & ((1u << bit_offset) - 1);
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    uint64_t word;
+                    std::memcpy(&word, src + i, 8);
+                    uint64_t shifted = carry | (word << bit_offset);
+                    std::memcpy(dst + i, &shifted, 8);
+                    carry = word >> (64 - bit_offset);
+                }
+                for (; i < n; i++) {
+                    dst[i] = (uint8_t)(carry | ((uint32_t)src[i] << bit_offset));
+                    carry = src[i] >> (8 - bit_offset);
+                }
+                dst[n] = (uint8_t)carry;
+            }
+            void addRawBuffer (const uint8_t buffer[], size_t n) {
+                // byte aligned, so the raw bytes can go in as is
+                if (bit_offset == 0) {
+                    data.pop_back();
+                    data.insert(data.end(), buffer, buffer + n);
+                    data.push_back(0);
+                    offset += n;
+                    return;
+                }
+                // otherwise each byte straddles two, low bits finish the current byte and the rest start the next
+                data.resize(offset + n + 1);
+                spliceBytes(data.data() + offset, bit_offset, buffer, n);
+                offset += n;
             }
             size_t getSize () {
                 if (bit_offset == 0) {
@@ -141,9 +199,7 @@ private:
                 return data.size();
             }
             void copyBitstream(const Bitstream& bs) {
-                for(size_t i = 0; i < bs.offset; i++) {
-                    addBits(bs.data[i], 8);
-                }
+                addRawBuffer(bs.data.data(), bs.offset);
                 if (bs.bit_offset > 0) {
                     addBits(bs.data[bs.offset], bs.bit_offset);
                 }
@@ -152,32 +208,99 @@ private:
                 bit_offset = 0;
                 offset = 0;
                 data.clear();
+                data.push_back(0);
             }
             uint8_t getBits () {
                 return bit_offset;
             }
+            size_t getBitSize () const {
+                return (size_t)offset * 8 + bit_offset;
+            }
+            const uint8_t* getBuffer () const {
+                return data.data();
+            }
+            // hands the finished bytes to sink.write, the byte still being filled stays behind unless partial is set
+            template <typename Sink>
+            void drain (Sink& sink, bool partial = false) {
+                size_t n = (partial) ? getSize() : offset;
+                if (n > 0) {
+                    sink.write(data.data(), n);
+                }
+                uint8_t last = data[offset];
+                uint8_t bits = bit_offset;
+                clear();
+                if (!partial) {
+                    data[0] = last;
+                    bit_offset = bits;
+                }
+            }
     };
-    class BitFile {
+    // blocks to bytes for any sink from io.hpp, whole bytes go straight out and the partial one waits for the next block
+    template <typename Sink>
+    class BitWriter {
     private:
-        Bitstream bs;
-        std::ofstream out_file;
+        Bitstream pending;
+        Sink& sink;
     public:
-        BitFile (std::string file) {
-            out_file.open(file.c_str(), std::ios::binary);
+        BitWriter (Sink& sink) : sink(sink) {
         }
-        ~BitFile() {
-            out_file.close();
+        void addBitStream (const Bitstream& b) {
+            pending.copyBitstream(b);
+            pending.drain(sink);
         }
-        void writeFile () {
-            std::vector<uint8_t> c = bs.getData();
-            out_file.write((char*)c.data(), c.size());
-            bs.clear();
+        // the last partial byte, once the final block is in
+        void finish () {
+            pending.drain(sink, true);
+        }
+    };
+    // same idea as BitWriter but the bits land straight in a caller owned buffer
+    class BufferWriter {
+    private:
+        uint8_t* out;
+        size_t out_cap;
+        size_t offset = 0;
+        uint8_t bit_offset = 0;
+    public:
+        BufferWriter (void* out, size_t out_cap) {
+            this->out = (uint8_t*)out;
+            this->out_cap = out_cap;
         }
         void addBitStream (const Bitstream& b) {
-            bs.copyBitstream(b);
-            if (bs.getBits() == 0) {
-                writeFile();
-            } 
+            size_t bits = b.getBitSize();
+            if (offset + (bit_offset + bits + 7) / 8 > out_cap) {
+                throw std::runtime_error("Output buffer too small for compressed data! Size it with compressBound");
+            }
+            const uint8_t* src = b.getBuffer();
+            size_t full = bits / 8;
+            uint8_t rem = bits % 8;
+            if (bit_offset == 0) {
+                std::memcpy(out + offset, src, full);
+                offset += full;
+                if (rem > 0) {
+                    out[offset] = src[full] & ((1 << rem) - 1);
+                }
+                bit_offset = rem;
+                return;
+            }
+            // not aligned, every byte gets split across two output bytes
+            Bitstream::spliceBytes(out + offset, bit_offset, src, full);
+            offset += full;
+            if (rem > 0) {
+                uint8_t val = src[full] & ((1 << rem) - 1);
+                out[offset] |= (uint8_t)(val << bit_offset);
+                if (bit_offset + rem >= 8) {
+                    offset++;
+                    if (bit_offset + rem > 8) {
+                        out[offset] = val >> (8 - bit_offset);
+                    }
+                    bit_offset = bit_offset + rem - 8;
+                } else {
+                    bit_offset += rem;
+                }
+            }
+        }
+        size_t getSize () {
+            return offset + ((bit_offset != 0) ? 1 : 0);
         }
     };
     
@@ -190,453 +313,532 @@ private:
     class LZ77 {
         private:
         size_t window_index;
-        struct member {
-            uint32_t data;  // 9 bits for length, 16 for start
-            int32_t next; // index of next member in bucket
-        };
-        std::vector<member> map; // 9 bits for length, 16 for start
-        inline uint32_t hashFunc (uint32_t n) {
-            // constant stolen from libdeflate :)
-            uint32_t t = (n * 0x1E35A7BD) >> (32 - 15);
-            return t;
+        // flat table of the newest position for every hash, sized per level so it stays in cache
+        // level 2 gets 2^14 heads (64K, L2), level 3 gets 2^15 heads plus a chain of 16 bit deltas back to the previous position with the same hash (256K together)
+        static constexpr uint32_t none = UINT32_MAX;
+        static constexpr size_t chain_mask = 2 * KB32 - 1;
+        // hashes are computed this far ahead of the cursor so their buckets can be prefetched
+        static constexpr size_t ahead = 8;
+        static constexpr uint32_t max_chain = 4096;
+        std::pmr::vector<uint32_t> head;
+        std::pmr::vector<uint16_t> prev;
+        uint32_t hash_bits = 0;
+        uint32_t ring[ahead];
+
+        static inline uint32_t load32 (const uint8_t* p) {
+            uint32_t w;
+            std::memcpy(&w, p, 4);
+            return w;
         }
-        inline std::pair<uint32_t, uint32_t> grabThreeBytes (uint8_t buffer[], size_t size, size_t offset) {
-            int32_t n = ((int32_t)size - (int32_t)offset);
-            if (n <= 0) {
-                return {0, 0};
-            }
-            else if (n >= 3) {
-                uint32_t out = (uint32_t)(buffer[offset]) | (buffer[offset + 1] << 8) | (buffer[offset + 2] << 16);
-                offset += 3;
-                return {out, 3};
-            } else {
-                uint32_t c = 0;
-                for (size_t i = 0; i < (uint32_t)n; i++, offset++) {
-                    c |= (buffer[offset] << (i * 8));
-                }
-                return {c, n};
+        static inline uint64_t load64 (const uint8_t* p) {
+            uint64_t w;
+            std::memcpy(&w, p, 8);
+            return w;
+        }
+        // constant stolen from libdeflate :)
+        inline uint32_t hash4 (uint32_t w) const {
+            return (w * 0x1E35A7BD) >> (32 - hash_bits);
+        }
+        inline uint32_t hash3 (uint32_t w) const {
+            return ((w & 0xffffff) * 0x1E35A7BD) >> (32 - hash_bits);
+        }
+        // bytes are 3 for the chained hash and 4 for the plain one
+        inline uint32_t hashAt (const uint8_t raw_buffer[], size_t size, size_t i, uint32_t bytes) const {
+            if (i + 4 <= size) {
+                uint32_t w = load32(raw_buffer + i);
+                return (bytes == 3) ? hash3(w) : hash4(w);
             }
+            return hash3((uint32_t)raw_buffer[i] | (raw_buffer[i + 1] << 8) | (raw_buffer[i + 2] << 16));
         }
-        inline std::pair<uint32_t, int32_t> grabFourBytes (uint8_t buffer[], size_t size, size_t offset) {
-            int32_t n = ((int32_t)size - (int32_t)offset);
-            if (n <= 0) {
-                return {0, 0};
+        // hashes four positions out of one 8 byte load and prefetches their buckets, until the ring is ahead positions past cursor
+        inline void hashAhead (const uint8_t raw_buffer[], size_t size, size_t cursor, size_t& hashed, uint32_t bytes) {
+            if (hashed < cursor) {
+                hashed = cursor;
             }
-            else if (n >= 4) {
-                uint32_t out = (uint32_t)(buffer[offset]) | (buffer[offset + 1] << 8) | (buffer[offset + 2] << 16) | (buffer[offset + 3] << 24);
-                offset += 4;
-                return {out, 4};
-            } else {
-                uint32_t c = 0;
-                for (size_t i = 0; i < (uint32_t)n; i++, offset++) {
-                    c |= (buffer[offset] << (i * 8));
+            #if defined(DEFLATE_LITTLE_ENDIAN)
+            while (hashed < cursor + ahead - 3 && hashed + 8 <= size) {
+                uint64_t w = load64(raw_buffer + hashed);
+                for (uint32_t j = 0; j < 4; j++) {
+                    uint32_t h = (bytes == 3) ? hash3((uint32_t)(w >> (8 * j))) : hash4((uint32_t)(w >> (8 * j)));
+                    ring[(hashed + j) & (ahead - 1)] = h;
+                    prefetch(&head[h]);
                 }
-                return {c, n};
+                hashed += 4;
             }
+            #endif
         }
-        void addHash (uint32_t length, uint32_t start, uint32_t hash) {
-            member m;
-            m.next = -1;
-            m.data = length & 0x1ff;
-            m.data |= (start << 9);
-            if (map[hash].data == 0) {
-                map[hash] = m;
-            } else {
-                size_t s = hash;
-                while(map[s].next != -1) {
-                    s = map[s].next;
-                }
-                map.push_back(m);
-                map[s].next = map.size() - 1;
+        inline void insert (size_t i, uint32_t h) {
+            if (hash_bits == 15) {
+                uint32_t cand = head[h];
+                prev[i & chain_mask] = (cand != none && i - cand <= KB32) ? (uint16_t)(i - cand) : 0;
             }
+            head[h] = (uint32_t)i;
         }
-        inline bool hashMatch (uint32_t hash) {
-            if (map[hash].data != 0) {
-                return true;
+        // hash every position of the history so matches can reach back into it
+        void primeHistory (const uint8_t raw_buffer[], size_t history, uint32_t bytes) {
+            size_t start = (history > KB32) ? history - KB32 : 0;
+            for (size_t i = start; i + bytes <= history; i++) {
+                insert(i, hashAt(raw_buffer, history, i, bytes));
             }
-            return false;
+        }
+        void writeMatch (uint32_t read_buffer[], size_t index, uint32_t length, uint32_t distance, RangeLookup& rl) {
+            // need to write out char again, 9 bits for lit/length
+            // need to write length extra bits if needed, 5 bits for extra length data
+            // need to write distance value in remaining 18 bits
+            Range r = rl.lookup(length);
+            read_buffer[index] = (distance << 14) | ((length - r.start) << 9) | (r.code & CHAR_BITS);
         }
         public:
+        // positions looked up and candidates compared since the last reset or load, for Stats
+        uint64_t chain_searches = 0;
+        uint64_t chain_steps = 0;
 
-        LZ77 (size_t size) {
+        LZ77 (std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : head(mem), prev(mem) {
+            window_index = 0;
+        }
+        // gets ready for the next chunk, level 2 and 3 get their tables and anything else doesn't hash so doesn't need them
+        // the tables only get allocated the first time a level needs them
+        void reset (int compression_level) {
             window_index = 0;
-            map.reserve(size);
-            for (size_t i = 0; i < size; i++) {
-                map.push_back({0, -1});
+            hash_bits = 0;
+            chain_searches = 0;
+            chain_steps = 0;
+            if (compression_level == 2) {
+                hash_bits = 14;
+            } else if (compression_level >= 3) {
+                hash_bits = 15;
+                if (prev.empty()) {
+                    prev.assign(chain_mask + 1, 0);
+                }
+            }
+            if (hash_bits > 0) {
+                head.assign((size_t)1 << hash_bits, none);
+            }
+        }
+        // hashes all of raw_buffer[0..history) the way a chunk at compression_level with that history would start out
+        void prime (const uint8_t raw_buffer[], size_t history, int compression_level) {
+            reset(compression_level);
+            if (hash_bits > 0) {
+                primeHistory(raw_buffer, history, (hash_bits == 15) ? 3 : 4);
             }
+            window_index = history;
         }
-        void getMatchesSlow (uint32_t read_buffer[], uint8_t raw_buffer[], size_t read_buffer_index, RangeLookup& rl, RangeLookup& dl) {
+        // starts the next chunk from a primed copy instead of reset, the same history has to sit in front of that chunk
+        void load (const LZ77& primed) {
+            window_index = primed.window_index;
+            hash_bits = primed.hash_bits;
+            chain_searches = 0;
+            chain_steps = 0;
+            head.assign(primed.head.begin(), primed.head.end());
+            if (hash_bits == 15) {
+                prev.assign(primed.prev.begin(), primed.prev.end());
+            }
+        }
+        // moves every position back by shift after the caller memmoved its buffer down that far, the way zlib's slide_hash does
+        // positions that fall off the front are dropped and the chain ring turns with them so each delta stays on its position
+        void slide (size_t shift) {
+            for (uint32_t& pos : head) {
+                pos = (pos != none && pos >= shift) ? pos - (uint32_t)shift : none;
+            }
+            if (hash_bits == 15) {
+                std::rotate(prev.begin(), prev.begin() + (shift & chain_mask), prev.end());
+            }
+            window_index = (window_index > shift) ? window_index - shift : 0;
+        }
+        // carries on after a slide instead of reset, raw_buffer[0..history) has to be what the last chunk left behind
+        // the last few positions of that chunk had too few bytes after them to hash, they get their turn now that size has grown
+        // returns false when the tables were made for another level and a reset is needed
+        bool resume (const uint8_t raw_buffer[], size_t history, size_t size, int compression_level) {
+            uint32_t bits = (compression_level == 2) ? 14 : (compression_level >= 3) ? 15 : 0;
+            if (bits == 0 || bits != hash_bits) {
+                return false;
+            }
+            chain_searches = 0;
+            chain_steps = 0;
+            uint32_t bytes = (hash_bits == 15) ? 3 : 4;
+            for (; window_index < history && window_index + bytes <= size; window_index++) {
+                insert(window_index, hashAt(raw_buffer, size, window_index, bytes));
+            }
+            window_index = history;
+            return true;
+        }
+        // raw_buffer[0..history) is data from earlier chunks, matches are only searched for from history onwards
+        // and read_buffer is indexed relative to history
+        // walks the hash chain of every position nearest first, a 3 byte hash means every earlier position that could give a match of 3 or more is on it
+        // positions inside a match are only inserted, compressBuffer never looks at them
+        void getMatchesSlow (uint32_t read_buffer[], const uint8_t raw_buffer[], size_t read_buffer_index, RangeLookup& rl, size_t history = 0) {
             const size_t size = read_buffer_index;
-            #ifdef DEBUG
-            auto start = std::chrono::high_resolution_clock::now();
-            #endif
-            while (window_index < size) {
-                std::pair<uint32_t, uint32_t> windowBytes = grabThreeBytes(raw_buffer, size, window_index);
-                if (windowBytes.second < 3) {
-                    return;
-                }
+            if (window_index < history) {
+                primeHistory(raw_buffer, history, 3);
+                window_index = history;
+            }
+            size_t hashed = window_index;
+            // counted in locals so the loop doesn't write memory for them
+            uint64_t searches = 0;
+            uint64_t compared = 0;
+            while (window_index + 3 <= size) {
+                hashAhead(raw_buffer, size, window_index, hashed, 3);
+                uint32_t h = (window_index < hashed) ? ring[window_index & (ahead - 1)] : hashAt(raw_buffer, size, window_index, 3);
+                uint32_t cand = head[h];
+                insert(window_index, h);
+
+                uint32_t max = (size - window_index < 258) ? size - window_index : 258;
+                const uint8_t* cur = raw_buffer + window_index;
                 uint32_t match_length = 0;
-                uint32_t windowHash = hashFunc(windowBytes.first);
-                for (int32_t i = window_index-1; i >= 0; i--) {
-                    std::pair<uint32_t, uint32_t> lookbackBytes = grabThreeBytes(raw_buffer, size, i);
-                    if (lookbackBytes.first == windowBytes.first) {
-                        // loop forward seeing how long bytes are equal
-                        uint32_t tempLength = 3;
-                        size_t j = i + 3;
-                        size_t k = window_index + 3;
-                        for (; j < size && k < size && raw_buffer[j] == raw_buffer[k] && match_length < 258; j++, k++, tempLength++);
-                        if (tempLength > match_length) {
-                            match_length = tempLength;
-                            Range r = rl.lookup(match_length);
-                            uint32_t o = (match_length) - r.start;
-                            uint32_t of = window_index-i;
-                            read_buffer[window_index] = (of << 14) | (o << 9) | (r.code & CHAR_BITS);
+                uint32_t match_dist = 0;
+                searches++;
+                for (uint32_t steps = 0; cand != none && window_index - cand <= KB32 && steps < max_chain; steps++) {
+                    compared++;
+                    // a candidate has to at least get the byte right where the best one so far stopped
+                    if (raw_buffer[cand + match_length] == cur[match_length]) {
+                        uint32_t length = matchLength(cur, raw_buffer + cand, max);
+                        // nearest wins ties since only a strictly longer match replaces it
+                        if (length > match_length) {
+                            match_length = length;
+                            match_dist = window_index - cand;
+                            if (length == max) {
+                                break;
+                            }
                         }
                     }
+                    uint16_t delta = prev[cand & chain_mask];
+                    if (delta == 0) {
+                        break;
+                    }
+                    cand -= delta;
+                }
+                if (match_length < 3) {
+                    window_index++;
+                    continue;
+                }
+                writeMatch(read_buffer, window_index - history, match_length, match_dist, rl);
+                size_t end = window_index + match_length;
+                for (size_t i = window_index + 1; i < end && i + 3 <= size; i++) {
+                    insert(i, (i < hashed) ? ring[i & (ahead - 1)] : hashAt(raw_buffer, size, i, 3));
+                }
+                window_index = end;
+            }
+            chain_searches += searches;
+            chain_steps += compared;
+        }
+        // only looks for runs against the 1 to 4 bytes right behind, no hashing at all
+        void getMatchesRle (uint32_t read_buffer[], const uint8_t raw_buffer[], size_t read_buffer_index, RangeLookup& rl, size_t history = 0) {
+            const size_t size = read_buffer_index;
+            if (window_index < history) {
+                window_index = history;
+            }
+            while (window_index + 3 <= size) {
+                uint32_t best_length = 0;
+                uint32_t best_dist = 0;
+                uint32_t max = (size - window_index < 258) ? size - window_index : 258;
+                for (uint32_t dist = 1; dist <= 4 && dist <= window_index; dist++) {
+                    const uint8_t* cur = raw_buffer + window_index;
+                    uint32_t length = matchLength(cur, cur - dist, max);
+                    if (length > best_length) {
+                        best_length = length;
+                        best_dist = dist;
+                    }
+                }
+                if (best_length >= 3) {
+                    Range r = rl.lookup(best_length);
+                    read_buffer[window_index - history] = (best_dist << 14) | ((best_length - r.start) << 9) | (r.code & CHAR_BITS);
+                    // nothing inside the run gets looked at by compressBuffer anyway
+                    window_index += best_length;
+                } else {
+                    window_index++;
+                }
+            }
+        }
+        // turns matches shorter than min_length back into literals
+        static void filterMatches (uint32_t read_buffer[], const uint8_t raw_buffer[], size_t read_buffer_index, RangeLookup& rl, uint32_t min_length) {
+            for (size_t i = 0; i < read_buffer_index; i++) {
+                uint32_t car = read_buffer[i] & CHAR_BITS;
+                if (car > 256 && rl.findCode(car).start + ((read_buffer[i] & LENGTH_BITS) >> 9) < min_length) {
+                    read_buffer[i] = raw_buffer[i];
                 }
-                window_index++;
             }
-            #ifdef DEBUG
-            auto end = std::chrono::high_resolution_clock::now();
-            std::chrono::duration<double, std::milli> elapsed = end - start;
-            std::cout << "slow match execution time: " << elapsed.count() << " ms\n";
-            #endif
         }
         // modifies the read_buffer to contain matches lol
         //https://github.com/ebiggers/libdeflate/blob/master/lib/hc_matchfinder.h
         // https://www.youtube.com/watch?v=BfUejqd07yo
-        // hash each three byte run
-        // check if hash in map, if in map loop through each hash comparing the bytes to current hash bytes
-        void getMatches (uint32_t read_buffer[], uint8_t raw_buffer[], size_t read_buffer_index, RangeLookup& rl, RangeLookup& dl) {
+        // greedy, one candidate per position out of the 4 byte hash head, the first four bytes are checked before the kernel extends it
+        void getMatches (uint32_t read_buffer[], const uint8_t raw_buffer[], size_t read_buffer_index, RangeLookup& rl, size_t history = 0) {
             const size_t size = read_buffer_index;
-            #ifdef DEBUG
-            auto start = std::chrono::high_resolution_clock::now();
-            #endif
-            while (window_index < size) {
-                std::pair<uint32_t, uint32_t> bytes = grabFourBytes(raw_buffer, size, window_index);
-                if (bytes.second != 4) {
-                    break;
+            if (window_index < history) {
+                primeHistory(raw_buffer, history, 4);
+                window_index = history;
+            }
+            size_t hashed = window_index;
+            uint64_t searches = 0;
+            uint64_t compared = 0;
+            while (window_index + 4 <= size) {
+                hashAhead(raw_buffer, size, window_index, hashed, 4);
+                uint32_t h = (window_index < hashed) ? ring[window_index & (ahead - 1)] : hashAt(raw_buffer, size, window_index, 4);
+                uint32_t cand = head[h];
+                head[h] = (uint32_t)window_index;
+                const uint8_t* cur = raw_buffer + window_index;
+                searches++;
+                compared += cand != none && window_index - cand <= KB32;
+                if (cand == none || window_index - cand > KB32 || load32(raw_buffer + cand) != load32(cur)) {
+                    window_index++;
+                    continue;
                 }
-                uint32_t w = hashFunc(bytes.first);
-                if (hashMatch(w)) {
-                    int32_t h = w;
-                    while(map[h].next != -1 && grabFourBytes(raw_buffer, size, (map[h].data & 0xfffffe00) >> 9).first != bytes.first) {
-                        h = map[h].next;
-                    }
-                    uint32_t start = (map[h].data & 0xfffffe00) >> 9;
-                    std::pair<uint32_t, uint32_t> grab = grabFourBytes(raw_buffer, size, start);
-                    if (grab.first == bytes.first && grab.second == 4) {
-                        // read four bytes until unequal
-                        // if unequal read drop a byte from last four bytes until same or out
-                        uint32_t off = window_index+4;
-                        uint32_t off2 = start+4;
-                        uint32_t j = 4;
-                        while(true) {
-                            std::pair<uint32_t, uint32_t> w2 = grabFourBytes(raw_buffer, size, off);
-                            std::pair<uint32_t, uint32_t> f = grabFourBytes(raw_buffer, size, off2);
-                            if (w2 != f || j >= 258) {
-                                // drop bytes from each till equal or not :)))
-                                int32_t i = 1;
-                                for (; i < 4 && w2 != f && j + i < size; i++) {
-                                    w2.first = (w2.first & (0xffffffff >> (i * 8)));
-                                    f.first = f.first & (0xffffffff >> (i * 8));
-                                }
-                                if (j >= 258) {
-                                    j = 258;
-                                    i = 4;
-                                }
-                                if (w2 == f && i != 4 && window_index + j + i < size) {
-                                    // need to write out char again, 9 bits for lit/length
-                                    // need to write length extra bits if needed, 5 bits for extra length data
-                                    // need to write distance value in remaining 18 bits
-                                    Range r = rl.lookup(j + i); // this will be length btw
-                                    uint32_t o = j + i - r.start;
-                                    uint32_t of = window_index-start;
-                                    uint32_t of_m = (of << 14);
-                                    read_buffer[window_index] = (of << 14) | (o << 9) | (r.code & CHAR_BITS);
-                                    break;
-                                } else {
-                                    Range r = rl.lookup(j); // this will be length btw
-                                    uint32_t o = (j) - r.start;
-                                    uint32_t of = window_index-start;
-                                    uint32_t of_m = (of << 14);
-                                    read_buffer[window_index] = (of << 14) | (o << 9) | (r.code & CHAR_BITS);
-                                    break;
-                                }
-                            } else {
-                                off += 4;
-                                off2 += 4;
-                                j += 4;
-                            }
-                        }
-                    }
-                } else {
-                    addHash(4, window_index, w);
+                uint32_t max = (size - window_index < 258) ? size - window_index : 258;
+                uint32_t length = 4 + matchLength(cur + 4, raw_buffer + cand + 4, max - 4);
+                writeMatch(read_buffer, window_index - history, length, window_index - cand, rl);
+                size_t end = window_index + length;
+                for (size_t i = window_index + 1; i < end && i + 4 <= size; i++) {
+                    head[(i < hashed) ? ring[i & (ahead - 1)] : hash4(load32(raw_buffer + i))] = (uint32_t)i;
                 }
-                window_index+=4;
+                window_index = end;
             }
-            #ifdef DEBUG
-            auto end = std::chrono::high_resolution_clock::now();
-            std::chrono::duration<double, std::milli> elapsed = end - start;
-            std::cout << "match execution time: " << elapsed.count() << " ms\n";
-            #endif
+            chain_searches += searches;
+            chain_steps += compared;
         }
 
     };
     
-    static Bitstream makeUncompressedBlock (uint8_t read_buffer[], size_t read_buffer_index, bool final) {
-        Bitstream bs;
+    // cheap look at a chunk before any match finding, true when it is very unlikely to compress
+    // (jpegs, zip members, encrypted data), sampled so it costs a small fraction of a memcpy
+    // order 0 entropy from a byte histogram says whether huffman can help, exact repeats of sampled 4 byte strings say whether lz77 can
+    static bool looksIncompressible (const uint8_t chunk[], size_t n) {
+        // small chunks are cheap to just try
+        if (n < 1024) {
+            return false;
+        }
+        uint32_t histogram[256] = {0};
+        uint32_t seen[1024] = {0};
+        uint32_t samples = 0;
+        uint32_t repeats = 0;
+        // 64 bytes out of every 256
+        for (size_t start = 0; start + 64 + 3 <= n; start += 256) {
+            for (size_t i = start; i < start + 64; i++) {
+                histogram[chunk[i]]++;
+                uint32_t four;
+                std::memcpy(&four, chunk + i, 4);
+                uint32_t h = (four * 0x1E35A7BD) >> (32 - 10);
+                if (seen[h] == four) {
+                    repeats++;
+                }
+                seen[h] = four;
+                samples++;
+            }
+        }
+        if (samples == 0 || repeats * 64 > samples) {
+            return false;
+        }
+        double entropy = 0.0;
+        for (uint32_t i = 0; i < 256; i++) {
+            if (histogram[i]) {
+                double p = (double)histogram[i] / samples;
+                entropy -= p * std::log2(p);
+            }
+        }
+        // a few sampled bytes read low against the real entropy, random data lands around 7.95 here
+        return entropy > 7.85;
+    }
+
+    // out_bits is where this block starts in the output stream, the stored data has to be byte aligned there and not just in this bitstream
+    // appends to bs
+    static void makeUncompressedBlock (Bitstream& bs, const uint8_t read_buffer[], size_t read_buffer_index, bool final, size_t out_bits = 0) {
         uint8_t pre = 0b000;
         if (final) {
             pre |= 1;
         }
         bs.addBits(pre, 3);
-        bs.nextByteBoundaryConditional();
+        bs.addBits(0, (8 - ((out_bits + 3) & 7)) & 7);
         bs.addBits(read_buffer_index, 16);
         bs.addBits(~(read_buffer_index), 16);
         bs.addRawBuffer(read_buffer, read_buffer_index);
-        return bs;
     }
 
-    // this is segfaulting on multi chunk files
-    static std::pair<FlatHuffmanTree, FlatHuffmanTree> constructDynamicHuffmanTree (uint32_t read_buffer[], size_t read_buffer_index, RangeLookup& rl, RangeLookup& dl) {
-        CodeMap c_map;
+    // counts the symbols compressBuffer will actually write, positions covered by a match are skipped
+    // returns the extra bits the lengths and distances need, those cost the same whatever tree is used
+    static size_t countSymbols (uint32_t read_buffer[], size_t read_buffer_index, CodeMap& c_map, CodeMap& dist_codes, RangeLookup& rl, RangeLookup& dl) {
+        size_t extra_bits = 0;
         c_map.addOccur(256);
-        CodeMap dist_codes;
-        for (uint32_t i = 0; i < read_buffer_index; i++) {
+        for (size_t i = 0; i < read_buffer_index;) {
             uint32_t car = (read_buffer[i] & CHAR_BITS);
-            uint32_t dist = (read_buffer[i] & DISTANCE_BITS) >> 14;
             c_map.addOccur(car);
-            if (dist > 0) {
-                Range dran = dl.lookup(dist);
+            if (car > 256) {
+                Range r_len = rl.findCode(car);
+                Range dran = dl.lookup((read_buffer[i] & DISTANCE_BITS) >> 14);
                 dist_codes.addOccur(dran.code);
-            }
-        }
-        FlatHuffmanTree tree = c_map.generateTree(15);
-        FlatHuffmanTree dist_tree = dist_codes.generateTree(15);
-        return std::pair<FlatHuffmanTree, FlatHuffmanTree> (tree, dist_tree);
-    }
-    static uint32_t countRepeats (std::vector<uint8_t>& bytes, uint32_t index) {
-        uint32_t count = 0;
-        for (uint32_t i = index + 1; i < bytes.size(); i++) {
-            if (bytes[i] == bytes[index]) {
-                count++;
+                extra_bits += r_len.extra_bits + dran.extra_bits;
+                i += r_len.start + ((read_buffer[i] & LENGTH_BITS) >> 9);
             } else {
-                return count;
-            }
-        }
-        return count;
-    }
-    static FlatHuffmanTree constructDynamicHuffmanCodeLengthTree (std::vector<uint8_t>& bytes, std::vector<Code>& codes) {
-        CodeMap cm;
-        for (uint32_t i = 0; i < bytes.size();) {
-            uint32_t reps = countRepeats(bytes, i);
-            if (reps > 2) {
-                if (bytes[i] == 0) {
-                    if (reps <= 10) {
-                        cm.addOccur(17);
-                        i += reps + 1;
-                    } else {
-                        cm.addOccur(18);
-                        i += (reps <= 138) ? reps + 1 : 138;
-                    }
-                } else {
-                    cm.addOccur(bytes[i]);
-                    cm.addOccur(16);
-                    i += (reps <= 6) ? reps + 1 : 6;
-                }
-            } else {
-                cm.addOccur(bytes[i]);
                 i++;
             }
         }
-        std::vector<Code> t_codes = cm.generateCodes(MAX_PRE_CODE_LEN);
-        std::vector <Code> test_codes;
-        test_codes.push_back({16, 7, 0, 16});
-        test_codes.push_back({17, 3, 0, 17});
-        test_codes.push_back({18, 6, 0, 18});
-        test_codes.push_back({0, 3, 0, 0});
-        test_codes.push_back({8, 4, 0, 8});
-        test_codes.push_back({7, 4, 0, 7});
-        test_codes.push_back({9, 3, 0, 9});
-        test_codes.push_back({6, 3, 0, 6});
-        test_codes.push_back({10, 3, 0, 10});
-        test_codes.push_back({5, 4, 0, 5});
-        test_codes.push_back({11, 3, 0, 11});
-        test_codes.push_back({4, 5, 0, 4});
-        test_codes.push_back({2, 7, 0, 2});
-        for (auto& i : codes) {
-            for (auto& j : t_codes) {
-                if (i.value == j.value) {
-                    i.code = j.code;
-                    i.len = j.len;
-                    j.extra_bits = i.extra_bits;
-                }
-            }
-        }
-        return FlatHuffmanTree(codes);
-    }
-    static void writeDynamicHuffmanBytes (std::vector<Code> t_codes, std::vector<uint8_t>& bytes, size_t max) {
-        struct {
-            inline bool operator() (const Code& code1, const Code& code2) {
-                return code1.value < code2.value;
-            }
-        } compare_code_value;
-        std::sort(t_codes.begin(), t_codes.end(), compare_code_value);
-        for (uint32_t i = 0; i < max; i++) {
-            bool write = false;
-            for (auto& j : t_codes) {
-                // have to check contains the value
-                if (((uint32_t)j.value) == i) {
-                    bytes.push_back(j.len);
-                    write = true;
-                    break;
-                }
-            } 
-            if (!write) {
-                bytes.push_back(0);
+        return extra_bits;
+    }
+    static void constructDynamicHuffmanTree (CodeMap& c_map, CodeMap& dist_codes, FlatHuffmanTree& tree, FlatHuffmanTree& dist_tree, std::pmr::vector<Code>& codes) {
+        c_map.generateTree(MAX_LITLEN_CODE_LEN, tree, codes);
+        dist_codes.generateTree(MAX_DIST_CODE_LEN, dist_tree, codes);
+    }
+    // bits the symbols in c_map take up when coded with tree
+    static size_t symbolBits (CodeMap& c_map, FlatHuffmanTree& tree, uint32_t symbols) {
+        size_t bits = 0;
+        for (uint32_t i = 0; i < symbols; i++) {
+            uint32_t occurs = c_map.getOccur(i);
+            if (occurs) {
+                bits += (size_t)occurs * tree.getCodeValue(i).len;
             }
         }
+        return bits;
     }
-    // need to be able to repeat two in a row, so no break ups (look at infgen output for more detail)
-    static void compressDynamicHuffmanTreeCodes (std::vector<uint8_t>& bytes, Bitstream& bs, FlatHuffmanTree& code_tree) {
-        for (uint32_t i = 0; i < bytes.size();) {
-            uint32_t reps = countRepeats(bytes, i);
-            Code c;
-            uint32_t inc = 0;
-            if (bytes[i] != 0 || (reps <= 2 && bytes[i] == 0)) {
-                c = code_tree.getCodeValue(bytes[i]);
-                bs.addBits(flipBits(c.code, c.len), c.len);
-                inc = 1;
-            }
-            if (reps > 2) {
-                uint32_t reps_code;
-                uint32_t real_reps;
-                if (bytes[i] == 0) {
-                    if (reps <= 10) {
-                        reps_code = 17;
-                        inc += (reps < 10) ? reps + 1 : 10;
-                        real_reps = (reps < 10) ? reps + 1 : 10;
-                    } else {
-                        reps_code = 18;
-                        inc += (reps < 138) ? reps + 1 : 138;
-                        real_reps = (reps < 138) ? reps + 1 : 138;
+
+    // the order the precode lengths go out in, trailing zeros in this order can be left off (rfc1951 3.2.7)
+    static constexpr uint8_t precode_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    // extra bits and smallest repeat for precode symbols 16, 17, 18
+    static constexpr uint8_t repeat_extra_bits[3] = {2, 3, 7};
+    static constexpr uint8_t repeat_base[3] = {3, 3, 11};
+    static constexpr uint32_t unusable_precode = 1 << 16;
+
+    // everything a dynamic block header needs, built before picking the block type so its cost is known
+    struct DynamicHeader {
+        uint32_t hlit = 257;
+        uint32_t hdist = 1;
+        uint32_t hclen = 4;
+        uint32_t precode_lens[19] = {0};
+        FlatHuffmanTree precode;
+        std::pmr::vector<Code> precode_codes;
+        std::pmr::vector<std::pair<uint8_t, uint8_t>> ops; // precode symbol and its extra bits value
+        size_t bits = 0;
+        DynamicHeader (std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : precode(mem), precode_codes(mem), ops(mem) {
+        }
+    };
+
+    // cheapest split of the code length sequence into plain lengths and 16/17/18 runs for the given precode lengths
+    // runs can cross from the literal lengths into the distance lengths, its one sequence as far as the format cares
+    static void planCodeLengths (const uint8_t lens[], uint32_t n, const uint32_t plen[19], std::pmr::vector<std::pair<uint8_t, uint8_t>>& ops) {
+        uint32_t cost[320];
+        uint16_t step[320];
+        uint8_t symbol[320];
+        uint16_t run[320];
+        cost[n] = 0;
+        for (uint32_t i = n; i-- > 0;) {
+            run[i] = (i + 1 < n && lens[i + 1] == lens[i]) ? run[i + 1] + 1 : 1;
+        }
+        for (uint32_t i = n; i-- > 0;) {
+            cost[i] = plen[lens[i]] + cost[i + 1];
+            step[i] = 1;
+            symbol[i] = lens[i];
+            if (lens[i] == 0) {
+                uint32_t max = (run[i] < 138) ? run[i] : 138;
+                for (uint32_t k = 3; k <= max; k++) {
+                    uint32_t c = (k <= 10) ? plen[17] + 3 : plen[18] + 7;
+                    if (c + cost[i + k] < cost[i]) {
+                        cost[i] = c + cost[i + k];
+                        step[i] = k;
+                        symbol[i] = (k <= 10) ? 17 : 18;
                     }
-                } else {
-                    reps_code = 16;
-                    inc += (reps < 6) ? reps : 6;
-                    real_reps = (reps < 6) ? reps : 6;
                 }
-                c = code_tree.getCodeValue(reps_code);
-                bs.addBits(flipBits(c.code, c.len), c.len);
-                if (c.extra_bits > 0) {
-                    uint32_t start = 3;
-                    if (c.value == 18) {
-                        start = 11;
+            }
+            // 16 repeats whatever length came before, zeros included
+            if (i > 0 && lens[i - 1] == lens[i]) {
+                uint32_t max = (run[i] < 6) ? run[i] : 6;
+                for (uint32_t k = 3; k <= max; k++) {
+                    if (plen[16] + 2 + cost[i + k] < cost[i]) {
+                        cost[i] = plen[16] + 2 + cost[i + k];
+                        step[i] = k;
+                        symbol[i] = 16;
                     }
-                    uint32_t val = (real_reps) - start;
-                    bs.addBits(val, c.extra_bits);
-                }
-            }
-            i += inc;
-        }
-    }
-    static void writeDynamicHuffmanTree (Bitstream& bs, FlatHuffmanTree tree, FlatHuffmanTree dist_tree, RangeLookup rl, RangeLookup dl) {
-        // calculating how much above 257 to go for matches
-        std::vector<Code> huff_codes = tree.decode();
-        uint32_t matches_size = 257;
-        for (size_t i = 0; i < huff_codes.size(); i++) {
-            if (huff_codes[i].value > matches_size) {
-                matches_size = huff_codes[i].value;
-            }
-        }
-        matches_size = matches_size - 257 + 1;
-        // HLIT
-        bs.addBits(matches_size, 5);
-
-        // calculating how big the distance needs to be
-        std::vector<Code> dist_codes = dist_tree.decode();
-        uint32_t dist_codes_size = 0;
-        if (dist_codes.size() > 0) {
-            dist_codes_size = dist_codes[0].value;
-            for (auto& i : dist_codes) {
-                if (i.value > dist_codes_size) {
-                    dist_codes_size = i.value;
-                }
-            }
-        }
-        // HDIST
-        bs.addBits(dist_codes_size, 5);
-        // compress the code lengths and use that to generate the HCLEN
-        std::vector<Code> codes = {
-                {0, 0, 2, 16},
-                {0, 0, 3, 17},
-                {0, 0, 7, 18},
-                {0, 0, 0, 0},
-                {0, 0, 0, 8},
-                {0, 0, 0, 7},
-                {0, 0, 0, 9},
-                {0, 0, 0, 6},
-                {0, 0, 0, 10},
-                {0, 0, 0, 5},
-                {0, 0, 0, 11},
-                {0, 0, 0, 4},
-                {0, 0, 0, 12},
-                {0, 0, 0, 3},
-                {0, 0, 0, 13},
-                {0, 0, 0, 2},
-                {0, 0, 0, 14},
-                {0, 0, 0, 1},
-                {0, 0, 0, 15},
-        };
-        std::vector<uint8_t> bytes;
-        std::vector<uint8_t> huff_bytes;
-        // constructing raw bytes of the table
-        writeDynamicHuffmanBytes(huff_codes, huff_bytes, 257 + matches_size);
-        std::vector<uint8_t> dist_bytes;
-        writeDynamicHuffmanBytes(dist_codes, dist_bytes, 1 + dist_codes_size);
-        for (auto& i : huff_bytes) {
-            bytes.push_back(i);
-        }
-        for (auto& i : dist_bytes) {
-            bytes.push_back(i);
-        }
-        // constructing the code length huffman tree
-        // 3 bits for each code length
-        // start by computing how often each code length character will be used
-        FlatHuffmanTree code_tree = constructDynamicHuffmanCodeLengthTree(bytes, codes);
-        // write the code length tree
-        uint32_t max = 0;
-        for (int32_t i = codes.size() - 1; i >= 0; i--) {
-            if (codes[i].len > 0) {
-                max = i;
-                break;
+                }
+            }
+        }
+        ops.clear();
+        for (uint32_t i = 0; i < n; i += step[i]) {
+            uint8_t extra = (symbol[i] >= 16) ? step[i] - repeat_base[symbol[i] - 16] : 0;
+            ops.push_back({symbol[i], extra});
+        }
+    }
+
+    // fills in header, its vectors and precode tree get reused from the last block
+    static void buildDynamicHeader (FlatHuffmanTree& tree, FlatHuffmanTree& dist_tree, DynamicHeader& header) {
+        header.hlit = 257;
+        header.hdist = 1;
+        std::fill(header.precode_lens, header.precode_lens + 19, 0);
+        uint8_t lens[320];
+        for (uint32_t i = 0; i < 286; i++) {
+            if (tree.getCodeValue(i).len > 0) {
+                header.hlit = i + 1;
+            }
+        }
+        for (uint32_t i = 0; i < 30; i++) {
+            if (dist_tree.getCodeValue(i).len > 0) {
+                header.hdist = i + 1;
             }
         }
-        // HCLEN
-        bs.addBits(max - 3, 4);       
-        for (uint32_t i = 0; i <= max; i++) {
-            bs.addBits(codes[i].len, 3);
+        for (uint32_t i = 0; i < header.hlit; i++) {
+            int32_t len = tree.getCodeValue(i).len;
+            lens[i] = (len > 0) ? len : 0;
+        }
+        for (uint32_t i = 0; i < header.hdist; i++) {
+            int32_t len = dist_tree.getCodeValue(i).len;
+            lens[header.hlit + i] = (len > 0) ? len : 0;
+        }
+        uint32_t n = header.hlit + header.hdist;
+        // start from a flat guess, then alternate between planning the runs and fitting the precode to them
+        // the last plan only uses symbols its precode has, so the two always agree
+        uint32_t plen[19];
+        std::fill(plen, plen + 19, 4);
+        std::pmr::vector<Code>& precode_codes = header.precode_codes;
+        for (int pass = 0; pass < 3; pass++) {
+            planCodeLengths(lens, n, plen, header.ops);
+            CodeMap cm;
+            for (auto& op : header.ops) {
+                cm.addOccur(op.first);
+            }
+            cm.generateCodes(MAX_PRE_CODE_LEN, precode_codes);
+            std::fill(plen, plen + 19, unusable_precode);
+            for (auto& c : precode_codes) {
+                plen[c.value] = c.len;
+            }
+        }
+        for (auto& c : precode_codes) {
+            header.precode_lens[c.value] = c.len;
+        }
+        header.precode.rebuild(precode_codes);
+        header.hclen = 19;
+        while (header.hclen > 4 && header.precode_lens[precode_order[header.hclen - 1]] == 0) {
+            header.hclen--;
+        }
+        header.bits = 5 + 5 + 4 + 3 * header.hclen;
+        for (auto& op : header.ops) {
+            header.bits += header.precode_lens[op.first];
+            if (op.first >= 16) {
+                header.bits += repeat_extra_bits[op.first - 16];
+            }
+        }
+    }
+
+    static void writeDynamicHuffmanTree (Bitstream& bs, DynamicHeader& header) {
+        bs.addBits(header.hlit - 257, 5);
+        bs.addBits(header.hdist - 1, 5);
+        bs.addBits(header.hclen - 4, 4);
+        for (uint32_t i = 0; i < header.hclen; i++) {
+            bs.addBits(header.precode_lens[precode_order[i]], 3);
+        }
+        for (auto& op : header.ops) {
+            Code c = header.precode.getCodeValue(op.first);
+            bs.addBits(flipBits(c.code, c.len), c.len);
+            if (op.first >= 16) {
+                bs.addBits(op.second, repeat_extra_bits[op.first - 16]);
+            }
         }
-        // compressed separate, not treated as one run of bits
-        // main huffman tree
-        compressDynamicHuffmanTreeCodes(huff_bytes, bs, code_tree) ;
-        //  dist tree
-        compressDynamicHuffmanTreeCodes(dist_bytes, bs, code_tree);
     }
 
     // deflate
 
-    static Bitstream compressBuffer (uint32_t read_buffer[], size_t read_buffer_index, FlatHuffmanTree tree, FlatHuffmanTree dist_tree, uint32_t preamble, bool final, RangeLookup& rl, RangeLookup& dl, bool skip_pre = false) {
-        // compress into huffman code format
-        Bitstream bs;
+    // compress into huffman code format, appended to bs
+    // dynamic blocks need the header built for tree and dist_tree
+    static void compressBuffer (Bitstream& bs, uint32_t read_buffer[], size_t read_buffer_index, FlatHuffmanTree& tree, FlatHuffmanTree& dist_tree, uint32_t preamble, bool final, RangeLookup& rl, RangeLookup& dl, DynamicHeader* header = nullptr) {
         // writing the block out to file
-        if (!skip_pre) {
-            uint32_t pre = (final) ? (preamble | 0b001) : preamble; 
-            bs.addBits(pre, 3);
-        }
+        uint32_t pre = (final) ? (preamble | 0b001) : preamble; 
+        bs.addBits(pre, 3);
         if ((preamble & 0b100) == 4) {
-            writeDynamicHuffmanTree(bs, tree, dist_tree, rl, dl);
+            writeDynamicHuffmanTree(bs, *header);
         }
         for (uint32_t i = 0; i < read_buffer_index;) {
             uint32_t car = (read_buffer[i] & CHAR_BITS);
@@ -670,147 +872,1305 @@ private:
         }
         Code endcode = tree.getCodeValue(256);
         bs.addBits(flipBits(endcode.code, endcode.len), endcode.len);
-        return bs;
+    }
+    // everything compressChunk works in, allocated once out of mem and reused block after block
+    // the static compress calls make one per call in an arena, Compressor and Stream hold on to theirs
+    struct Workspace {
+        FlatHuffmanTree fixed_huffman;
+        FlatHuffmanTree fixed_dist_huffman;
+        RangeLookup rl;
+        RangeLookup dl;
+        LZ77 lz;
+        FlatHuffmanTree tree;
+        FlatHuffmanTree dist_tree;
+        DynamicHeader header;
+        std::pmr::vector<Code> codes;
+        std::pmr::vector<uint32_t> read_buffer;
+        std::pmr::vector<uint8_t> window; // history followed by the chunk, for callers that can't point at their input
+        Bitstream block; // the last block compressChunk made
+        Stats* stats = nullptr; // filled in as blocks go by when set, nothing is counted or timed otherwise
+        Workspace (std::pmr::memory_resource* mem) : fixed_huffman(mem), fixed_dist_huffman(mem), rl(generateLengthLookup()), dl(generateDistanceLookup()), lz(mem), tree(mem), dist_tree(mem), header(mem), codes(mem), read_buffer(KB32, mem), window(KB32 * 2, mem), block(mem) {
+            generateFixedCodes(codes);
+            fixed_huffman.rebuild(codes);
+            generateFixedDistanceCodes(codes);
+            fixed_dist_huffman.rebuild(codes);
+        }
+    };
+    // the parsing half of compressChunk, read_buffer comes in holding the chunk's literals and leaves with its matches too
+    // returns false when the chunk is going to be stored as is and there's nothing to entropy code
+    // live means ws.lz carries on from the chunk before, slid along with the buffer, rather than starting over on the history
+    static bool parseChunk (Workspace& ws, uint32_t read_buffer[], const uint8_t raw_buffer[], size_t history, size_t read_buffer_index, int compression_level, Strategy strategy, const LZ77* primed = nullptr, bool live = false) {
+        const uint8_t* chunk = raw_buffer + history;
+        RangeLookup& rl = ws.rl;
+        if (compression_level == 0) {
+            // raw uncompressed blocks, no huffman coding
+            return false;
+        }
+        if (looksIncompressible(chunk, read_buffer_index)) {
+            // skip matching and tree building, it would end up stored anyway
+            return false;
+        }
+        LZ77& lz = ws.lz;
+        int match_level = (strategy == DEFAULT_STRATEGY || strategy == FILTERED) ? compression_level : 0;
+        if (primed != nullptr && match_level >= 2) {
+            lz.load(*primed);
+        } else if (!live || !lz.resume(raw_buffer, history, history + read_buffer_index, match_level)) {
+            lz.reset(match_level);
+        }
+        switch (strategy) {
+            case HUFFMAN_ONLY:
+                // literals only
+            break;
+            case RLE:
+                lz.getMatchesRle(read_buffer, raw_buffer, history + read_buffer_index, rl, history);
+            break;
+            case FILTERED:
+            case DEFAULT_STRATEGY:
+                // finding the matches above length of 2
+                switch (compression_level) {
+                    case 3:
+                        lz.getMatchesSlow(read_buffer, raw_buffer, history + read_buffer_index, rl, history);
+                    break;
+                    case 2:
+                        lz.getMatches(read_buffer, raw_buffer, history + read_buffer_index, rl, history);
+                    break;
+                    case 1:
+                        // no matches, still huffman coded
+                    break;
+                }
+                if (strategy == FILTERED) {
+                    // same cut off zlib uses, a short match rarely beats its literals on noisy data
+                    LZ77::filterMatches(read_buffer, chunk, read_buffer_index, rl, 6);
+                }
+            break;
+        }
+        return true;
+    }
+    // exact sizes in bits, header included, of the block as fixed and as dynamic, dynamic is SIZE_MAX when its tree can't be built
+    struct BlockSizes {
+        size_t fixed_bits = 0;
+        size_t dynamic_bits = 0;
+    };
+    // builds ws.tree, ws.dist_tree and ws.header out of the symbol counts, extra_bits is what countSymbols returned
+    static BlockSizes planBlock (Workspace& ws, CodeMap& c_map, CodeMap& dist_codes, size_t extra_bits) {
+        BlockSizes sizes;
+        bool set_fixed = false;
+        try {
+            {
+                Stats::Timer timer(ws.stats, Stats::TREE_BUILDING);
+                constructDynamicHuffmanTree(c_map, dist_codes, ws.tree, ws.dist_tree, ws.codes);
+            }
+            Stats::Timer timer(ws.stats, Stats::HEADER);
+            buildDynamicHeader(ws.tree, ws.dist_tree, ws.header);
+        } catch (std::runtime_error& e) {
+            // oversubscribed, fixed codes it is
+            set_fixed = true;
+        }
+        sizes.fixed_bits = 3 + extra_bits + symbolBits(c_map, ws.fixed_huffman, 288) + symbolBits(dist_codes, ws.fixed_dist_huffman, 30);
+        sizes.dynamic_bits = (set_fixed) ? SIZE_MAX : 3 + extra_bits + ws.header.bits + symbolBits(c_map, ws.tree, 286) + symbolBits(dist_codes, ws.dist_tree, 30);
+        return sizes;
+    }
+    // a stored block of n bytes starting out_bits into the output, its padding depends on where it lands
+    static size_t storedBits (size_t read_buffer_index, size_t out_bits) {
+        return 3 + ((8 - ((out_bits + 3) & 7)) & 7) + 32 + read_buffer_index * 8;
+    }
+    // encodes the smaller of the two blocks planBlock sized into bs, dynamic only when it's strictly smaller
+    static void encodeBlock (Workspace& ws, Bitstream& bs, uint32_t read_buffer[], size_t read_buffer_index, bool q, const BlockSizes& sizes) {
+        if (sizes.dynamic_bits < sizes.fixed_bits) {
+            compressBuffer(bs, read_buffer, read_buffer_index, ws.tree, ws.dist_tree, 0b100, q, ws.rl, ws.dl, &ws.header);
+        } else {
+            compressBuffer(bs, read_buffer, read_buffer_index, ws.fixed_huffman, ws.fixed_dist_huffman, 0b010, q, ws.rl, ws.dl);
+        }
+    }
+    // the literals, matches and matchfinder work of a parsed chunk into stats, the same walk countSymbols does
+    static void countMatches (Stats& stats, Workspace& ws, const uint32_t read_buffer[], size_t read_buffer_index) {
+        for (size_t i = 0; i < read_buffer_index;) {
+            uint32_t car = read_buffer[i] & CHAR_BITS;
+            if (car > 256) {
+                uint32_t length = ws.rl.findCode(car).start + ((read_buffer[i] & LENGTH_BITS) >> 9);
+                stats.addMatch(length, (read_buffer[i] & DISTANCE_BITS) >> 14);
+                i += length;
+            } else {
+                stats.literals++;
+                i++;
+            }
+        }
+        stats.chain_searches += ws.lz.chain_searches;
+        stats.chain_steps += ws.lz.chain_steps;
+    }
+    // compresses a single chunk into one block, which ends up in ws.block
+    // raw_buffer[0..history) is data that already went out in earlier blocks and matches may reach back into it,
+    // the chunk itself is raw_buffer[history..history + read_buffer_index) and ws.read_buffer holds its literals
+    // out_bits is where the block will start in the output, stored blocks need it for alignment
+    // primed, when given, is the matchfinder already hashed over that history, so it doesn't get hashed again
+    // live is the same saving for a caller that keeps ws.lz going from block to block, see parseChunk
+    static void compressChunk (Workspace& ws, const uint8_t raw_buffer[], size_t history, size_t read_buffer_index, bool q, size_t out_bits, int compression_level, Strategy strategy, const LZ77* primed = nullptr, bool live = false) {
+        const uint8_t* chunk = raw_buffer + history;
+        uint32_t* read_buffer = ws.read_buffer.data();
+        Stats* stats = ws.stats;
+        ws.block.clear();
+        bool parsed;
+        {
+            Stats::Timer timer(stats, Stats::MATCH_FINDING);
+            parsed = parseChunk(ws, read_buffer, raw_buffer, history, read_buffer_index, compression_level, strategy, primed, live);
+        }
+        if (stats) {
+            stats->bytes_in += read_buffer_index;
+            if (parsed) {
+                countMatches(*stats, ws, read_buffer, read_buffer_index);
+            }
+        }
+        if (!parsed) {
+            Stats::Timer timer(stats, Stats::ENTROPY_CODING);
+            makeUncompressedBlock(ws.block, chunk, read_buffer_index, q, out_bits);
+            if (stats) {
+                stats->stored_blocks++;
+            }
+            return;
+        }
+        CodeMap c_map;
+        CodeMap dist_codes;
+        size_t extra_bits;
+        {
+            Stats::Timer timer(stats, Stats::TREE_BUILDING);
+            extra_bits = countSymbols(read_buffer, read_buffer_index, c_map, dist_codes, ws.rl, ws.dl);
+        }
+        BlockSizes sizes = planBlock(ws, c_map, dist_codes, extra_bits);
+        Stats::Timer timer(stats, Stats::ENTROPY_CODING);
+        // only the winner gets encoded
+        if (storedBits(read_buffer_index, out_bits) <= std::min(sizes.fixed_bits, sizes.dynamic_bits)) {
+            makeUncompressedBlock(ws.block, chunk, read_buffer_index, q, out_bits);
+            if (stats) {
+                stats->stored_blocks++;
+            }
+        } else {
+            encodeBlock(ws, ws.block, read_buffer, read_buffer_index, q, sizes);
+            if (stats) {
+                (sizes.dynamic_bits < sizes.fixed_bits ? stats->dynamic_blocks : stats->fixed_blocks)++;
+            }
+        }
+    }
+    // bytes out_bits of blocks come to, counted into ws.stats when it's set
+    static size_t countOut (Workspace& ws, size_t out_bits) {
+        size_t bytes = (out_bits + 7) / 8;
+        if (ws.stats) {
+            ws.stats->bytes_out += bytes;
+        }
+        return bytes;
     }
     // compression levels
     // 0 - no compression, just uncompressed blocks
     // 1 - fastest compression, no matching
     // 2 - default compression, some matching
     // 3 - best compression, more thorough matching
-    static size_t realCompress (std::function<size_t(uint32_t buffer[], uint8_t raw_buffer[], size_t n, size_t* read_buffer_index)> readFunc, std::function<void(Bitstream& bs)> writeFunc, int compression_level) {
-        size_t out_size = 0;
-        FlatHuffmanTree fixed_dist_huffman(generateFixedDistanceCodes());
-        FlatHuffmanTree fixed_huffman(generateFixedCodes());
-        RangeLookup rl = generateLengthLookup();
-        RangeLookup dl = generateDistanceLookup();
+    // pulls 32kb chunks out of source and hands each block to out.addBitStream, returns the compressed size in bytes
+    template <typename Source, typename BitSink>
+    static size_t realCompress (Workspace& ws, Source& source, BitSink& out, int compression_level, Strategy strategy) {
+        size_t out_bits = 0;
+        uint8_t* raw_buffer = ws.window.data();
+        uint32_t* read_buffer = ws.read_buffer.data();
         bool q = false;
+        while (!q) {
+            // sources can come up short, only a read of nothing is the end
+            size_t n = 0;
+            {
+                Stats::Timer timer(ws.stats, Stats::IO);
+                while (n < KB32) {
+                    size_t got = source.read(raw_buffer + n, KB32 - n);
+                    if (got == 0) {
+                        break;
+                    }
+                    n += got;
+                }
+            }
+            q = n < KB32;
+            for (size_t i = 0; i < n; i++) {
+                read_buffer[i] = raw_buffer[i];
+            }
+            compressChunk(ws, raw_buffer, 0, n, q, out_bits, compression_level, strategy);
+            out_bits += ws.block.getBitSize();
+            Stats::Timer timer(ws.stats, Stats::IO);
+            out.addBitStream(ws.block);
+        }
+        return countOut(ws, out_bits);
+    }
+    // for input that's all in memory already (a mapped file), chunks are compressed where they sit
+    // nothing gets copied into the window and matches can reach up to 32kb back into the chunk before
+    // check, when given, takes in each chunk right before it's compressed
+    // flush is FINISH or FULL_FLUSH, the last one ends on an empty stored block instead of a final block
+    template <typename BitSink, typename Check = deflate_io::Crc32>
+    static size_t realCompressInPlace (Workspace& ws, const uint8_t data[], size_t size, BitSink& out, int compression_level, Strategy strategy, Check* check = nullptr, Flush flush = FINISH) {
+        size_t out_bits = 0;
+        size_t offset = 0;
+        uint32_t* read_buffer = ws.read_buffer.data();
+        do {
+            size_t n = (size - offset < KB32) ? size - offset : KB32;
+            size_t history = (offset < KB32) ? offset : KB32;
+            const uint8_t* chunk = data + offset;
+            if (check != nullptr) {
+                check->update(chunk, n);
+            }
+            for (size_t i = 0; i < n; i++) {
+                read_buffer[i] = chunk[i];
+            }
+            bool q = flush == FINISH && offset + n == size;
+            compressChunk(ws, chunk - history, history, n, q, out_bits, compression_level, strategy);
+            out_bits += ws.block.getBitSize();
+            offset += n;
+            Stats::Timer timer(ws.stats, Stats::IO);
+            out.addBitStream(ws.block);
+        } while (offset < size);
+        if (flush != FINISH) {
+            ws.block.clear();
+            makeUncompressedBlock(ws.block, nullptr, 0, false, out_bits);
+            out_bits += ws.block.getBitSize();
+            Stats::Timer timer(ws.stats, Stats::IO);
+            out.addBitStream(ws.block);
+        }
+        return countOut(ws, out_bits);
+    }
+    // one chunk between the parsing thread and the coders, see realCompressPipelined
+    struct PipelineBlock {
+        std::vector<uint32_t> symbols;
+        CodeMap c_map;
+        CodeMap dist_codes;
+        size_t extra_bits = 0;
+        size_t offset = 0;
+        size_t size = 0;
+        bool parsed = false; // false when it's going to be stored
+        bool coded = false; // block holds the entropy coded version
+        BlockSizes sizes;
+        Bitstream block;
+    };
+    // realCompressInPlace with the entropy coding taken off the parsing thread, for threads workers (0 means one per core)
+    // the calling thread parses a batch of chunks in order, the same matches and symbol counts compressChunk would get,
+    // while a coder thread runs the batch before it over the other workers, each chunk's trees built and its block
+    // bit encoded into a bitstream of its own, the blocks then get spliced onto out in order
+    // a stored block's padding depends on where it lands, so the choice between stored and the coded block waits for the
+    // splice, coders skip encoding when stored wins wherever it lands, the output is byte for byte realCompressInPlace's
+    template <typename BitSink, typename Check = deflate_io::Crc32>
+    static size_t realCompressPipelined (const uint8_t data[], size_t size, BitSink& out, int compression_level, Strategy strategy, Check* check, size_t threads) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        size_t chunks = std::max((size_t)1, (size + KB32 - 1) / KB32);
+        // enough chunks a batch to keep the coders busy, two batches are in flight at once
+        size_t per_batch = std::max((size_t)4, threads * 4);
+        std::vector<PipelineBlock> batches[2];
+        for (auto& batch : batches) {
+            batch.resize(per_batch);
+            for (PipelineBlock& item : batch) {
+                item.symbols.resize(KB32);
+            }
+        }
+        Workspace parser(deflate_memory::defaultResource());
+        std::vector<Workspace> coders;
+        for (size_t i = 0; i < std::max((size_t)1, threads - 1); i++) {
+            coders.emplace_back(deflate_memory::defaultResource());
+        }
+        auto parse = [&](std::vector<PipelineBlock>& batch, size_t first, size_t count) {
+            for (size_t k = 0; k < count; k++) {
+                PipelineBlock& item = batch[k];
+                item.offset = (first + k) * KB32;
+                item.size = std::min((size_t)KB32, size - item.offset);
+                size_t history = std::min(item.offset, (size_t)KB32);
+                const uint8_t* chunk = data + item.offset;
+                if (check != nullptr) {
+                    check->update(chunk, item.size);
+                }
+                uint32_t* read_buffer = item.symbols.data();
+                for (size_t i = 0; i < item.size; i++) {
+                    read_buffer[i] = chunk[i];
+                }
+                item.parsed = parseChunk(parser, read_buffer, chunk - history, history, item.size, compression_level, strategy);
+                item.c_map.clear();
+                item.dist_codes.clear();
+                item.extra_bits = (item.parsed) ? countSymbols(read_buffer, item.size, item.c_map, item.dist_codes, parser.rl, parser.dl) : 0;
+            }
+        };
+        auto code = [&](std::vector<PipelineBlock>& batch, size_t first, size_t count) {
+            std::atomic<size_t> next_coder(0);
+            parallelItems(count, coders.size(), [&]() {
+                return &coders[next_coder++];
+            }, [&](Workspace* ws, size_t k) {
+                PipelineBlock& item = batch[k];
+                item.coded = false;
+                item.block.clear();
+                if (!item.parsed) {
+                    return;
+                }
+                item.sizes = planBlock(*ws, item.c_map, item.dist_codes, item.extra_bits);
+                // a stored block's padding is 0 to 7 bits, when it wins even with all 7 the coded block can't be used
+                if (storedBits(item.size, 6) <= std::min(item.sizes.fixed_bits, item.sizes.dynamic_bits)) {
+                    return;
+                }
+                bool q = first + k + 1 == chunks;
+                encodeBlock(*ws, item.block, item.symbols.data(), item.size, q, item.sizes);
+                item.coded = true;
+            });
+        };
+        size_t out_bits = 0;
+        Bitstream stored(deflate_memory::defaultResource());
+        auto splice = [&](std::vector<PipelineBlock>& batch, size_t first, size_t count) {
+            for (size_t k = 0; k < count; k++) {
+                PipelineBlock& item = batch[k];
+                bool q = first + k + 1 == chunks;
+                const Bitstream* block = &item.block;
+                if (!item.coded || storedBits(item.size, out_bits) <= std::min(item.sizes.fixed_bits, item.sizes.dynamic_bits)) {
+                    stored.clear();
+                    makeUncompressedBlock(stored, data + item.offset, item.size, q, out_bits);
+                    block = &stored;
+                }
+                out_bits += block->getBitSize();
+                out.addBitStream(*block);
+            }
+        };
+
+        size_t first = 0;
+        size_t count = std::min(per_batch, chunks);
+        parse(batches[0], first, count);
+        for (size_t b = 0; first < chunks; b ^= 1) {
+            size_t next = first + count;
+            size_t next_count = std::min(per_batch, chunks - next);
+            if (threads == 1 || next_count == 0) {
+                code(batches[b], first, count);
+                if (next_count > 0) {
+                    parse(batches[b ^ 1], next, next_count);
+                }
+            } else {
+                // the coder's exception comes back over here, the parse of the next batch is wasted then
+                std::exception_ptr error;
+                std::thread coder([&]() {
+                    try {
+                        code(batches[b], first, count);
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                });
+                try {
+                    parse(batches[b ^ 1], next, next_count);
+                } catch (...) {
+                    coder.join();
+                    throw;
+                }
+                coder.join();
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+            splice(batches[b], first, count);
+            first = next;
+            count = next_count;
+        }
+        return (out_bits + 7) / 8;
+    }
+    // one off calls get their workspace out of a per call arena
+    template <typename Source, typename BitSink>
+    static size_t realCompress (Source& source, BitSink& out, int compression_level, Strategy strategy) {
+        deflate_memory::Arena arena;
+        Workspace ws(&arena);
+        return realCompress(ws, source, out, compression_level, strategy);
+    }
+public:
+    // a preset dictionary, bytes the first block can match against as if they came right before the input (zlib's deflateSetDictionary)
+    // only the last 32kb can ever be reached so that's all that's kept, id is the adler-32 of everything given, what a zlib stream's DICTID holds
+    // it's hashed for levels 2 and 3 once up front, so each use copies the matchfinder tables instead of hashing the dictionary again
+    // nothing changes after construction, any number of threads can share one
+    class Dictionary {
+    private:
+        friend class deflate;
+        std::pmr::vector<uint8_t> bytes;
+        uint32_t adler;
+        LZ77 fast;
+        LZ77 slow;
+        const LZ77* primed (int compression_level) const {
+            return (compression_level >= 3) ? &slow : (compression_level == 2) ? &fast : nullptr;
+        }
+    public:
+        Dictionary (const void* data, size_t size, std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : bytes(mem), fast(mem), slow(mem) {
+            const uint8_t* p = (const uint8_t*)data;
+            adler = deflate_cpu::kernels().adler32(1, p, size);
+            size_t keep = (size < KB32) ? size : KB32;
+            bytes.assign(p + size - keep, p + size);
+            fast.prime(bytes.data(), keep, 2);
+            slow.prime(bytes.data(), keep, 3);
+        }
+        Dictionary (const std::vector<uint8_t>& data, std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : Dictionary(data.data(), data.size(), mem) {
+        }
+        const uint8_t* data () const {
+            return bytes.data();
+        }
+        size_t size () const {
+            return bytes.size();
+        }
+        uint32_t id () const {
+            return adler;
+        }
+    };
+private:
+    // realCompress with a preset dictionary, the first chunk starts with it as history and every chunk after carries the last 32kb along
+    template <typename Source, typename BitSink>
+    static size_t realCompress (Workspace& ws, Source& source, BitSink& out, int compression_level, Strategy strategy, const Dictionary& dictionary) {
+        size_t out_bits = 0;
+        uint8_t* window = ws.window.data();
+        uint32_t* read_buffer = ws.read_buffer.data();
+        size_t history = dictionary.size();
+        if (history > 0) {
+            std::memcpy(window, dictionary.data(), history);
+        }
+        const LZ77* primed = dictionary.primed(compression_level);
+        bool q = false;
+        while (!q) {
+            size_t n = 0;
+            {
+                Stats::Timer timer(ws.stats, Stats::IO);
+                while (n < KB32) {
+                    size_t got = source.read(window + history + n, KB32 - n);
+                    if (got == 0) {
+                        break;
+                    }
+                    n += got;
+                }
+            }
+            q = n < KB32;
+            for (size_t i = 0; i < n; i++) {
+                read_buffer[i] = window[history + i];
+            }
+            compressChunk(ws, window, history, n, q, out_bits, compression_level, strategy, primed);
+            primed = nullptr;
+            out_bits += ws.block.getBitSize();
+            {
+                Stats::Timer timer(ws.stats, Stats::IO);
+                out.addBitStream(ws.block);
+            }
+            size_t total = history + n;
+            size_t keep = (total < KB32) ? total : KB32;
+            std::memmove(window, window + total - keep, keep);
+            history = keep;
+        }
+        return countOut(ws, out_bits);
+    }
+    template <typename Source, typename BitSink>
+    static size_t realCompress (Source& source, BitSink& out, int compression_level, Strategy strategy, const Dictionary& dictionary) {
+        deflate_memory::Arena arena;
+        Workspace ws(&arena);
+        return realCompress(ws, source, out, compression_level, strategy, dictionary);
+    }
+    // compresses the file at file_path into sink, in place out of a mapping when it can be, otherwise a reader thread streams it in
+    // check, when given, gets the checksum and size of the input
+    template <typename Sink, typename Check = deflate_io::Crc32>
+    static size_t compressFile (const std::string& file_path, Sink& sink, int compression_level, Strategy strategy, Check* check = nullptr) {
+        deflate_io::MappedFile mapped(file_path);
+        if (mapped.ok()) {
+            deflate_memory::Arena arena;
+            Workspace ws(&arena);
+            BitWriter<Sink> out(sink);
+            size_t size = realCompressInPlace(ws, mapped.data(), mapped.size(), out, compression_level, strategy, check);
+            out.finish();
+            return size;
+        }
+        std::ifstream f;
+        f.open(file_path.c_str(), std::ios::binary);
+        deflate_io::IstreamSource source(f);
+        deflate_io::ReadAhead<deflate_io::IstreamSource> ahead(source);
+        if (check == nullptr) {
+            return compressSource(ahead, sink, compression_level, strategy);
+        }
+        deflate_io::ChecksumSource<Check, decltype(ahead)> checked(ahead);
+        size_t size = compressSource(checked, sink, compression_level, strategy);
+        *check = checked.check;
+        return size;
+    }
+    // rfc 1952 member header, returns its size
+    // xfl is 2 for the slowest level and 4 for the fastest, the same as gzip sets it
+    template <typename Sink>
+    static size_t writeGzipHeader (Sink& sink, const GzipHeader& header, int compression_level) {
+        std::vector<uint8_t> bytes = {0x1f, 0x8b, 8, 0};
+        bytes[3] = (header.text ? 1 : 0) | (header.header_crc ? 2 : 0) | (!header.extra.empty() ? 4 : 0) | (!header.name.empty() ? 8 : 0) | (!header.comment.empty() ? 16 : 0);
+        for (int i = 0; i < 4; i++) {
+            bytes.push_back((uint8_t)(header.mtime >> (8 * i)));
+        }
+        bytes.push_back((compression_level >= 3) ? 2 : (compression_level == 1) ? 4 : 0);
+        bytes.push_back(header.os);
+        if (!header.extra.empty()) {
+            if (header.extra.size() > 0xffff) {
+                throw std::runtime_error("Gzip extra field too long!");
+            }
+            bytes.push_back((uint8_t)header.extra.size());
+            bytes.push_back((uint8_t)(header.extra.size() >> 8));
+            bytes.insert(bytes.end(), header.extra.begin(), header.extra.end());
+        }
+        // both are zero terminated, the terminator included
+        if (!header.name.empty()) {
+            bytes.insert(bytes.end(), header.name.c_str(), header.name.c_str() + header.name.size() + 1);
+        }
+        if (!header.comment.empty()) {
+            bytes.insert(bytes.end(), header.comment.c_str(), header.comment.c_str() + header.comment.size() + 1);
+        }
+        if (header.header_crc) {
+            uint32_t crc = deflate_cpu::kernels().crc32(0, bytes.data(), bytes.size());
+            bytes.push_back((uint8_t)crc);
+            bytes.push_back((uint8_t)(crc >> 8));
+        }
+        sink.write(bytes.data(), bytes.size());
+        return bytes.size();
+    }
+    // crc-32 and then the size mod 2^32, both little endian
+    template <typename Sink>
+    static size_t writeGzipTrailer (Sink& sink, const deflate_io::Crc32& check) {
+        uint8_t trailer[8];
+        uint32_t size = (uint32_t)check.size();
+        for (int i = 0; i < 4; i++) {
+            trailer[i] = (uint8_t)(check.value() >> (8 * i));
+            trailer[4 + i] = (uint8_t)(size >> (8 * i));
+        }
+        sink.write(trailer, 8);
+        return 8;
+    }
+    // rfc 1950 header, a 32kb window and FLEVEL set the way zlib sets it for the nearest level
+    // with a dictionary FDICT is set and its id follows
+    template <typename Sink>
+    static size_t writeZlibHeader (Sink& sink, int compression_level, const Dictionary* dictionary = nullptr) {
+        uint8_t header[6];
+        header[0] = 0x78;
+        uint32_t flevel = (compression_level <= 1) ? 0 : (compression_level == 2) ? 2 : 3;
+        uint32_t check = (header[0] << 8) | (flevel << 6) | ((dictionary != nullptr) ? 0x20 : 0);
+        check += 31 - check % 31;
+        header[1] = (uint8_t)check;
+        size_t size = 2;
+        if (dictionary != nullptr) {
+            for (int i = 0; i < 4; i++) {
+                header[size++] = (uint8_t)(dictionary->id() >> (24 - 8 * i));
+            }
+        }
+        sink.write(header, size);
+        return size;
+    }
+    // the adler-32, big endian unlike everything else in deflate
+    template <typename Sink>
+    static size_t writeZlibTrailer (Sink& sink, const deflate_io::Adler32& check) {
+        uint8_t trailer[4];
+        for (int i = 0; i < 4; i++) {
+            trailer[i] = (uint8_t)(check.value() >> (24 - 8 * i));
+        }
+        sink.write(trailer, 4);
+        return 4;
+    }
+    // where each chunk ends when data is cut every chunk_size bytes
+    static std::vector<size_t> fixedCuts (size_t size, size_t chunk_size) {
+        if (chunk_size == 0 || chunk_size > ((size_t)1 << 30)) {
+            throw std::runtime_error("Seekable chunk size has to be between 1 byte and 1GB!");
+        }
+        std::vector<size_t> ends;
+        for (size_t at = chunk_size; at < size; at += chunk_size) {
+            ends.push_back(at);
+        }
+        ends.push_back(size);
+        return ends;
+    }
+    // where each chunk ends when the content decides, a gear hash rolls over the input and a chunk ends wherever its
+    // top bits are all zero, which is every average bytes or so, with chunks kept between a quarter and 4 times that
+    // the hash only sees the last 64 bytes, so after an edit the cuts fall back in the same places within a chunk or two
+    static std::vector<size_t> rsyncCuts (const uint8_t* data, size_t size, size_t average) {
+        if (average < 64 || average > ((size_t)1 << 28) || (average & (average - 1)) != 0) {
+            throw std::runtime_error("Rsyncable chunk size has to be a power of 2 between 64 bytes and 256MB!");
+        }
+        // the same fixed random table everywhere, so the same input always gets the same cuts
+        static const std::vector<uint64_t> gear = []() {
+            std::vector<uint64_t> t(256);
+            uint64_t x = 0;
+            for (uint64_t& v : t) {
+                // splitmix64
+                x += 0x9e3779b97f4a7c15ull;
+                uint64_t z = x;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                v = z ^ (z >> 31);
+            }
+            return t;
+        }();
+        uint32_t bits = 0;
+        while (((size_t)1 << bits) < average) {
+            bits++;
+        }
+        uint64_t mask = ~0ull << (64 - bits);
+        size_t min_size = average / 4;
+        size_t max_size = average * 4;
+        std::vector<size_t> ends;
+        size_t start = 0;
+        while (start < size) {
+            size_t end = std::min(size, start + max_size);
+            size_t at = std::min(end, start + min_size);
+            // the hash is warmed up over the 64 bytes before the first place a cut can go, so a cut only ever depends on
+            // the 64 bytes before it and not on where the chunk started
+            uint64_t hash = 0;
+            for (size_t i = (at > 64) ? at - 64 : 0; i < at; i++) {
+                hash = (hash << 1) + gear[data[i]];
+            }
+            for (; at < end; at++) {
+                hash = (hash << 1) + gear[data[at]];
+                if ((hash & mask) == 0) {
+                    at++;
+                    break;
+                }
+            }
+            ends.push_back(at);
+            start = at;
+        }
+        if (ends.empty()) {
+            ends.push_back(0);
+        }
+        return ends;
+    }
+    // compresses each chunk of data on its own, ends has where every chunk ends, spread over threads workers (0 means one per core)
+    // nothing in a chunk matches back past its start and all but the last end on a full flush,
+    // so in order they make one ordinary deflate stream, table gets them as if the first one went at in_offset
+    template <typename Sink>
+    static size_t compressChunks (const uint8_t* data, Sink& sink, SeekTable& table, uint64_t in_offset, const std::vector<size_t>& ends, int compression_level, Strategy strategy, size_t threads) {
+        size_t count = ends.size();
+        std::vector<std::vector<uint8_t>> pieces(count);
+        parallelItems(count, threads, [&]() {
+            return Workspace(deflate_memory::defaultResource());
+        }, [&](Workspace& ws, size_t i) {
+            size_t begin = (i == 0) ? 0 : ends[i - 1];
+            size_t n = ends[i] - begin;
+            // compressBound and the 5 bytes the empty stored block can take with its padding
+            pieces[i].resize(compressBound(n) + 5);
+            BufferWriter out(pieces[i].data(), pieces[i].size());
+            Flush flush = (i + 1 == count) ? FINISH : FULL_FLUSH;
+            pieces[i].resize(realCompressInPlace<BufferWriter, deflate_io::Crc32>(ws, data + begin, n, out, compression_level, strategy, nullptr, flush));
+        });
+        std::vector<uint8_t> entries;
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t n = ends[i] - ((i == 0) ? 0 : ends[i - 1]);
+            uint32_t sizes[2] = {(uint32_t)pieces[i].size(), (uint32_t)n};
+            for (uint32_t v : sizes) {
+                for (int b = 0; b < 4; b++) {
+                    entries.push_back((uint8_t)(v >> (8 * b)));
+                }
+            }
+            sink.write(pieces[i].data(), pieces[i].size());
+            total += pieces[i].size();
+            std::vector<uint8_t>().swap(pieces[i]);
+        }
+        table = SeekTable();
+        table.addEntries(entries.data(), entries.size(), in_offset);
+        return total;
+    }
+    // the chunk table as empty gzip members after the data, to any other reader they're members with nothing in them
+    // each carries up to 8184 entries in a "DX" FEXTRA subfield, the last one ends its extra field with "DZ" and the size
+    // of all of them, so the size sits 18 bytes before the end of the stream and a reader can go straight there
+    template <typename Sink>
+    static size_t writeSeekTable (Sink& sink, const SeekTable& table) {
+        std::vector<uint8_t> entries = table.entries();
+        const size_t per_member = 8184 * 8;
+        size_t members = std::max((size_t)1, (entries.size() + per_member - 1) / per_member);
+        // header, XLEN, the DX subfield header, the empty block and the trailer for each, and DZ once
+        uint64_t total = entries.size() + members * 26 + 12;
+        size_t size = 0;
+        for (size_t m = 0; m < members; m++) {
+            size_t begin = m * per_member;
+            size_t n = std::min(per_member, entries.size() - begin);
+            GzipHeader header;
+            header.extra = {'D', 'X', (uint8_t)n, (uint8_t)(n >> 8)};
+            header.extra.insert(header.extra.end(), entries.begin() + begin, entries.begin() + begin + n);
+            if (m + 1 == members) {
+                header.extra.insert(header.extra.end(), {'D', 'Z', 8, 0});
+                for (int i = 0; i < 8; i++) {
+                    header.extra.push_back((uint8_t)(total >> (8 * i)));
+                }
+            }
+            size += writeGzipHeader(sink, header, 0);
+            // a final fixed block that's only its end of block code
+            const uint8_t empty[2] = {0x03, 0x00};
+            sink.write(empty, 2);
+            size += 2 + writeGzipTrailer(sink, deflate_io::Crc32());
+        }
+        return size;
+    }
+    // one gzip member made of the chunks, followed by the chunk table when seekable
+    template <typename Sink>
+    static size_t writeChunkedGzip (const uint8_t* data, size_t size, Sink& sink, const std::vector<size_t>& ends, int compression_level, Strategy strategy, const GzipHeader& header, size_t threads, bool seekable) {
+        size_t out = writeGzipHeader(sink, header, compression_level);
+        SeekTable table;
+        out += compressChunks(data, sink, table, out, ends, compression_level, strategy, threads);
+        deflate_io::Crc32 check;
+        check.update(data, size);
+        out += writeGzipTrailer(sink, check);
+        return seekable ? out + writeSeekTable(sink, table) : out;
+    }
+    // write gets all of file_path at once and a sink on new_file, for the chunked calls that hand chunks out in any order
+    template <typename Write>
+    static size_t compressWholeFile (const std::string& file_path, const std::string& new_file, Write&& write) {
+        deflate_io::OutputFile out_file(new_file);
+        deflate_io::WriteBehind<deflate_io::OutputFile> sink(out_file);
+        deflate_io::MappedFile mapped(file_path);
+        size_t size = 0;
+        if (mapped.ok()) {
+            size = write(mapped.data(), mapped.size(), sink);
+        } else {
+            std::ifstream f(file_path, std::ios::binary | std::ios::ate);
+            std::vector<uint8_t> data(f ? (size_t)f.tellg() : 0);
+            f.seekg(0);
+            f.read((char*)data.data(), data.size());
+            size = write(data.data(), data.size(), sink);
+        }
+        sink.finish();
+        return size;
+    }
+public:
+
+    // incremental compressor, input can come in any sized pieces and the 32kb window carries over between calls
+    // NO_FLUSH   - input is buffered, a block only goes out once a full chunk is pending
+    // SYNC_FLUSH - everything pending goes out and the output is byte aligned with an empty stored block
+    // FULL_FLUSH - same as SYNC_FLUSH but the window is dropped too, so a decoder can start fresh from this point
+    // FINISH     - everything pending goes out in the final block, call reset before using the stream again
+    // one stream per thread, nothing in here is synchronized
+    // its working memory comes out of mem for as long as the stream lives
+    class Stream {
+    private:
+        int compression_level;
+        Strategy strategy;
+        Workspace ws; // its window is the history followed by pending input
+        size_t history = 0;
+        size_t pending = 0;
+        size_t out_bits = 0;
+        Bitstream out;
+        bool finished = false;
+        bool live = false; // ws.lz is still hashed over the window, false until the first block and again after a full flush or reset
 
-        size_t read_buffer_index = 0;
-        uint32_t read_buffer[KB32];
-        uint8_t raw_buffer[KB32];
-        std::memset(read_buffer, 0, KB32);
-        while(!q) {
-            size_t read = readFunc(read_buffer, raw_buffer, KB32, &read_buffer_index);
-            if (read < KB32) {
-                q = true;
-            }
-            LZ77 lz(KB32);
-            // finding the matches above length of 2
-            switch (compression_level) {
-                case 3:
-                    lz.getMatchesSlow(read_buffer, raw_buffer, read_buffer_index, rl, dl);
+        void addBlock (const Bitstream& bs) {
+            out_bits += bs.getBitSize();
+            out.copyBitstream(bs);
+        }
+        void compressPending (bool final) {
+            for (size_t i = 0; i < pending; i++) {
+                ws.read_buffer[i] = ws.window[history + i];
+            }
+            compressChunk(ws, ws.window.data(), history, pending, final, out_bits, compression_level, strategy, nullptr, live);
+            addBlock(ws.block);
+            // last 32kb stays around for the next block to match against, and the matchfinder slides down with it
+            size_t total = history + pending;
+            size_t keep = (total < KB32) ? total : KB32;
+            std::memmove(ws.window.data(), ws.window.data() + total - keep, keep);
+            ws.lz.slide(total - keep);
+            live = true;
+            history = keep;
+            pending = 0;
+        }
+    public:
+        Stream (int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : ws(mem), out(mem) {
+            this->compression_level = compression_level;
+            this->strategy = strategy;
+        }
+
+        // hands the compressed bytes that are complete so far to sink, after any flush that is everything written
+        // any sink from io.hpp works, returns how many bytes went to it on this call
+        template <typename Sink>
+        size_t compress (const void* in, size_t in_size, Sink& sink, Flush flush = NO_FLUSH) {
+            if (finished) {
+                throw std::runtime_error("Stream already finished, reset it before compressing more data!");
+            }
+            const uint8_t* data = (const uint8_t*)in;
+            while (in_size > 0) {
+                if (pending == KB32) {
+                    compressPending(false);
+                }
+                size_t n = (KB32 - pending < in_size) ? KB32 - pending : in_size;
+                std::memcpy(ws.window.data() + history + pending, data, n);
+                pending += n;
+                data += n;
+                in_size -= n;
+            }
+            switch (flush) {
+                case NO_FLUSH:
                 break;
-                case 2:
-                    lz.getMatches(read_buffer, raw_buffer, read_buffer_index, rl, dl);
+                case SYNC_FLUSH:
+                case FULL_FLUSH:
+                    if (pending > 0) {
+                        compressPending(false);
+                    }
+                    ws.block.clear();
+                    makeUncompressedBlock(ws.block, nullptr, 0, false, out_bits);
+                    addBlock(ws.block);
+                    if (flush == FULL_FLUSH) {
+                        history = 0;
+                        live = false;
+                    }
                 break;
-                case 1:
-                    // no matches, still huffman coded
+                case FINISH:
+                    compressPending(true);
+                    finished = true;
                 break;
-                case 0:
-                    // raw uncompressed blocks, no huffman coding
-                    {
-                        Bitstream bs = makeUncompressedBlock(raw_buffer, read_buffer_index, q);
-                        writeFunc(bs);
-                        read_buffer_index = 0;
-                    }
-                    continue;
             }
-            std::pair<FlatHuffmanTree, FlatHuffmanTree> trees;
-            bool set_fixed = false;
-            try {
-                trees = constructDynamicHuffmanTree(read_buffer, read_buffer_index, rl, dl);
-            } catch (std::runtime_error e) {
-                #ifdef DEBUG
-                std::cout << "Dynamic tree oversubscribed!\n";
-                #endif
-                set_fixed = true;
-            }
-            Bitstream bs_fixed = compressBuffer(read_buffer, read_buffer_index, fixed_huffman, fixed_dist_huffman, 0b010, q, rl, dl);
-            Bitstream bs_dynamic;
-            try {
-                bs_dynamic = compressBuffer(read_buffer, read_buffer_index, trees.first, trees.second, 0b100, q, rl, dl);
-            } catch (std::runtime_error e) {
-                #ifdef DEBUG
-                std::cout << "Dynamic tree oversubscribed!\n";
-                #endif
-                set_fixed = true;
-            }
-
-            Bitstream picked;
-            if (!set_fixed && bs_dynamic.getSize() < bs_fixed.getSize() && bs_dynamic.getSize() < read_buffer_index + 5) {
-                picked = bs_dynamic;
-            } else if(bs_fixed.getSize() < read_buffer_index + 5){
-                picked = bs_fixed;
-            } else {
-                picked = makeUncompressedBlock(raw_buffer, read_buffer_index, q);
+            size_t n = (finished) ? out.getSize() : out.getBitSize() / 8;
+            {
+                Stats::Timer timer(ws.stats, Stats::IO);
+                out.drain(sink, finished);
+            }
+            if (ws.stats) {
+                ws.stats->bytes_out += n;
             }
-            writeFunc(picked);
-            read_buffer_index = 0;
+            return n;
+        }
+
+        // the same straight into out, returns the bytes written
+        // throws if out_cap runs out, the stream has to be reset after that, a buffer of outputBound(in_size) bytes never will
+        size_t compress (const void* in, size_t in_size, void* out, size_t out_cap, Flush flush = NO_FLUSH) {
+            deflate_io::BufferSink sink(out, out_cap);
+            return compress(in, in_size, sink, flush);
+        }
+
+        std::vector<uint8_t> compress (const void* in, size_t in_size, Flush flush = NO_FLUSH) {
+            std::vector<uint8_t> bytes;
+            deflate_io::VectorSink sink(bytes);
+            compress(in, in_size, sink, flush);
+            return bytes;
+        }
+
+        template <typename Sink>
+        size_t finish (Sink& sink) {
+            return compress(nullptr, 0, sink, FINISH);
+        }
+
+        size_t finish (void* out, size_t out_cap) {
+            return compress(nullptr, 0, out, out_cap, FINISH);
+        }
+
+        std::vector<uint8_t> finish () {
+            return compress(nullptr, 0, FINISH);
+        }
+
+        // most a compress call with in_size more bytes can write, whatever its flush, the input still pending counts too
+        size_t outputBound (size_t in_size) const {
+            // an empty stored block for the flush and the partial byte left over from before
+            return compressBound(pending + in_size) + 6;
+        }
+
+        // counters for every block from here on go into stats, nullptr stops counting, see Stats
+        void setStats (Stats* stats) {
+            ws.stats = stats;
+        }
+
+        // start over as a brand new stream, buffers are kept
+        void reset () {
+            history = 0;
+            pending = 0;
+            out_bits = 0;
+            out.clear();
+            finished = false;
+            live = false;
+        }
+    };
+
+    // reusable one shot compressor, output is the same as the static compress calls
+    // the tables, trees and buffers are made once in the constructor and after the first call nothing touches the heap,
+    // apart from the vector overload growing its result
+    // it isn't synchronized, give each thread its own, and a per thread pool can go in as mem
+    class Compressor {
+    private:
+        int compression_level;
+        Strategy strategy;
+        Workspace ws;
+    public:
+        Compressor (int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : ws(mem) {
+            this->compression_level = compression_level;
+            this->strategy = strategy;
         }
 
-        return out_size;
+        // every call from here on adds its counters to stats, nullptr stops counting, see Stats
+        void setStats (Stats* stats) {
+            ws.stats = stats;
+        }
+
+        // compresses straight into out, returns the bytes written
+        // throws if out_cap runs out, a buffer of compressBound(in_size) bytes never will
+        size_t compress (const void* in, size_t in_size, void* out, size_t out_cap) {
+            deflate_io::MemorySource source(in, in_size);
+            BufferWriter out_buffer(out, out_cap);
+            realCompress(ws, source, out_buffer, compression_level, strategy);
+            return out_buffer.getSize();
+        }
+
+        std::vector<uint8_t> compress (const void* in, size_t in_size) {
+            std::vector<uint8_t> out(compressBound(in_size));
+            out.resize(compress(in, in_size, out.data(), out.size()));
+            return out;
+        }
+
+        // the same against a preset dictionary, the decompressor has to be given the same bytes
+        size_t compress (const void* in, size_t in_size, void* out, size_t out_cap, const Dictionary& dictionary) {
+            deflate_io::MemorySource source(in, in_size);
+            BufferWriter out_buffer(out, out_cap);
+            realCompress(ws, source, out_buffer, compression_level, strategy, dictionary);
+            return out_buffer.getSize();
+        }
+
+        std::vector<uint8_t> compress (const void* in, size_t in_size, const Dictionary& dictionary) {
+            std::vector<uint8_t> out(compressBound(in_size));
+            out.resize(compress(in, in_size, out.data(), out.size(), dictionary));
+            return out;
+        }
+    };
+
+    // compresses every item on its own, same output as calling compress on each, spread over threads workers (0 means one per core)
+    // each worker keeps one Compressor for all of its items, outputs sized with compressBound never fail
+    // returns how many items failed, their error says why
+    // the threads and compressors only last for the call, a BatchCompressor keeps them for batch after batch
+    static size_t compressBatch (BatchItem items[], size_t count, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, size_t threads = 0) {
+        parallelItems(count, threads, [&]() {
+            return Compressor(compression_level, strategy);
+        }, [&](Compressor& compressor, size_t i) {
+            BatchItem& item = items[i];
+            runBatchItem(item, [&]() {
+                return compressor.compress(item.in, item.in_size, item.out, item.out_cap);
+            });
+        });
+        return failedItems(items, count);
     }
-public:
+    static size_t compressBatch (std::vector<BatchItem>& items, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, size_t threads = 0) {
+        return compressBatch(items.data(), items.size(), compression_level, strategy, threads);
+    }
+
+    // compressBatch with its threads and their Compressors made once in the constructor and reused by every compress call
+    // output is the same, a steady stream of batches just stops paying for thread starts and workspace setup
+    // one batch at a time, it isn't synchronized against itself
+    class BatchCompressor {
+    private:
+        WorkerPool<Compressor> pool;
+    public:
+        BatchCompressor (int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, size_t threads = 0) : pool(threads, compression_level, strategy) {
+        }
+
+        // returns how many items failed, their error says why
+        size_t compress (BatchItem items[], size_t count) {
+            pool.run(count, [&](Compressor& compressor, size_t i) {
+                BatchItem& item = items[i];
+                runBatchItem(item, [&]() {
+                    return compressor.compress(item.in, item.in_size, item.out, item.out_cap);
+                });
+            });
+            return failedItems(items, count);
+        }
+        size_t compress (std::vector<BatchItem>& items) {
+            return compress(items.data(), items.size());
+        }
+
+        // workers with the calling thread included, fewer than asked for if a thread couldn't be started
+        size_t threads () const {
+            return pool.threads();
+        }
+    };
+
+    // any source and sink, see io.hpp, returns the compressed size in bytes
+    template <typename Source, typename Sink>
+    static size_t compressSource (Source& source, Sink& sink, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY) {
+        BitWriter<Sink> out(sink);
+        size_t size = realCompress(source, out, compression_level, strategy);
+        out.finish();
+        return size;
+    }
+    template <typename Source, typename Sink>
+    static size_t compressSource (Source& source, Sink& sink, const Dictionary& dictionary, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY) {
+        BitWriter<Sink> out(sink);
+        size_t size = realCompress(source, out, compression_level, strategy, dictionary);
+        out.finish();
+        return size;
+    }
+
+    // raw deflate against a preset dictionary, for lots of small messages that share most of their content
+    // for many of them a Compressor saves setting up the workspace every time
+    static std::vector<uint8_t> compress (const void* in, size_t in_size, const Dictionary& dictionary, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY) {
+        std::vector<uint8_t> out;
+        deflate_io::MemorySource source(in, in_size);
+        deflate_io::VectorSink sink(out);
+        compressSource(source, sink, dictionary, compression_level, strategy);
+        return out;
+    }
+
+    // picks the substrings that turn up in the most samples into a dictionary of at most max_size bytes, along the lines of zstd's cover
+    // every 8 byte string is scored by how many samples contain it, then each slice of the corpus gives up its best 64 byte segment,
+    // scored by the strings in it no segment picked before already has
+    // the segments are laid out worst first, so the most useful end up closest to the data where matching them is cheapest
+    // meant to run offline over a few hundred typical messages, the result goes to Dictionary on both ends
+    static std::vector<uint8_t> buildDictionary (const std::vector<std::vector<uint8_t>>& samples, size_t max_size = KB32) {
+        constexpr size_t d = 8;
+        constexpr size_t k = 64;
+        max_size = std::min(max_size, (size_t)KB32);
+        // every position gets the id of the d byte string starting there, none when it would run into the next sample
+        constexpr uint32_t none = UINT32_MAX;
+        std::vector<uint8_t> corpus;
+        std::vector<uint32_t> ids;
+        std::vector<uint32_t> value;
+        std::unordered_map<uint64_t, uint32_t> id_of;
+        std::vector<uint32_t> last_sample;
+        for (size_t sample = 0; sample < samples.size(); sample++) {
+            const std::vector<uint8_t>& bytes = samples[sample];
+            for (size_t i = 0; i < bytes.size(); i++) {
+                if (i + d > bytes.size()) {
+                    ids.push_back(none);
+                    continue;
+                }
+                uint64_t key;
+                std::memcpy(&key, bytes.data() + i, d);
+                auto found = id_of.emplace(key, (uint32_t)value.size());
+                uint32_t id = found.first->second;
+                if (found.second) {
+                    value.push_back(0);
+                    last_sample.push_back(UINT32_MAX);
+                }
+                // counted once per sample
+                if (last_sample[id] != sample) {
+                    last_sample[id] = (uint32_t)sample;
+                    value[id]++;
+                }
+                ids.push_back(id);
+            }
+            corpus.insert(corpus.end(), bytes.begin(), bytes.end());
+        }
+        // a string only one sample has is no help, that message can match it by itself
+        for (uint32_t& v : value) {
+            v = (v >= 2) ? v : 0;
+        }
+        size_t segments = max_size / k;
+        if (segments == 0 || corpus.size() < k) {
+            return {};
+        }
+        size_t epoch = std::max(corpus.size() / segments, k);
+        struct Segment {
+            size_t start;
+            size_t length;
+            uint64_t score;
+        };
+        std::vector<Segment> chosen;
+        std::vector<uint32_t> active(value.size(), 0);
+        size_t total = 0;
+        for (size_t begin = 0; begin + k <= corpus.size() && total < max_size; begin += epoch) {
+            size_t end = std::min(begin + epoch, corpus.size());
+            if (end - begin < k) {
+                end = begin + k;
+            }
+            // slides a k byte window over the epoch, a string counts once however often it's in the window
+            uint64_t score = 0;
+            auto add = [&](size_t p) {
+                uint32_t id = ids[p];
+                if (id != none && active[id]++ == 0) {
+                    score += value[id];
+                }
+            };
+            auto remove = [&](size_t p) {
+                uint32_t id = ids[p];
+                if (id != none && --active[id] == 0) {
+                    score -= value[id];
+                }
+            };
+            for (size_t p = begin; p + d <= begin + k; p++) {
+                add(p);
+            }
+            Segment best = {begin, k, score};
+            for (size_t start = begin + 1; start + k <= end; start++) {
+                remove(start - 1);
+                add(start + k - d);
+                if (score > best.score) {
+                    best = {start, k, score};
+                }
+            }
+            size_t last = end - k;
+            for (size_t p = last; p + d <= last + k; p++) {
+                remove(p);
+            }
+            if (best.score == 0) {
+                continue;
+            }
+            best.length = std::min(k, max_size - total);
+            // whatever this segment has is worth nothing to the ones after it
+            for (size_t p = best.start; p + d <= best.start + best.length; p++) {
+                if (ids[p] != none) {
+                    value[ids[p]] = 0;
+                }
+            }
+            chosen.push_back(best);
+            total += best.length;
+        }
+        std::stable_sort(chosen.begin(), chosen.end(), [](const Segment& a, const Segment& b) {
+            return a.score < b.score;
+        });
+        std::vector<uint8_t> dictionary;
+        for (const Segment& segment : chosen) {
+            dictionary.insert(dictionary.end(), corpus.begin() + segment.start, corpus.begin() + segment.start + segment.length);
+        }
+        return dictionary;
+    }
+
     // done
-    static size_t compress (std::string file_path, std::string new_file, int compression_level) {
-        std::ifstream f;
-        f.open(file_path.c_str(), std::ios::binary);
+    // the input gets mapped and compressed in place when it can be, otherwise a reader thread streams it in
+    // output goes out in 1mb writes from a writer thread, so the disk and the compressor overlap, returns the compressed size
+    static size_t compress (std::string file_path, std::string new_file, int compression_level, Strategy strategy = DEFAULT_STRATEGY) {
+        deflate_io::OutputFile out_file(new_file);
+        deflate_io::WriteBehind<deflate_io::OutputFile> sink(out_file);
+        size_t size = compressFile(file_path, sink, compression_level, strategy);
+        sink.finish();
+        return size;
+    }
+
+    // a single gzip member (rfc 1952), header, deflate data and the crc-32 + size trailer
+    // the crc is taken as the input goes into the compressor, so it costs one extra look at data that's already in cache
+    // all of them return or hold the whole member, header and trailer included
+    template <typename Source, typename Sink>
+    static size_t compressGzipSource (Source& source, Sink& sink, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, const GzipHeader& header = GzipHeader()) {
+        size_t size = writeGzipHeader(sink, header, compression_level);
+        deflate_io::ChecksumSource<deflate_io::Crc32, Source> checked(source);
+        size += compressSource(checked, sink, compression_level, strategy);
+        return size + writeGzipTrailer(sink, checked.check);
+    }
+    static std::vector<uint8_t> compressGzip (const void* data, size_t data_size, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, const GzipHeader& header = GzipHeader()) {
+        std::vector<uint8_t> out;
+        deflate_io::MemorySource source(data, data_size);
+        deflate_io::VectorSink sink(out);
+        compressGzipSource(source, sink, compression_level, strategy, header);
+        return out;
+    }
+    static size_t compressGzip (std::string file_path, std::string new_file, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, const GzipHeader& header = GzipHeader()) {
+        deflate_io::OutputFile out_file(new_file);
+        deflate_io::WriteBehind<deflate_io::OutputFile> sink(out_file);
+        deflate_io::Crc32 check;
+        size_t size = writeGzipHeader(sink, header, compression_level);
+        size += compressFile(file_path, sink, compression_level, strategy, &check);
+        size += writeGzipTrailer(sink, check);
+        sink.finish();
+        return size;
+    }
+
+    // zlib (rfc 1950), the two byte header, deflate data and the adler-32 of the input, taken as it goes into the compressor
+    // both return or hold the whole stream, header and trailer included
+    template <typename Source, typename Sink>
+    static size_t compressZlibSource (Source& source, Sink& sink, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY) {
+        size_t size = writeZlibHeader(sink, compression_level);
+        deflate_io::ChecksumSource<deflate_io::Adler32, Source> checked(source);
+        size += compressSource(checked, sink, compression_level, strategy);
+        return size + writeZlibTrailer(sink, checked.check);
+    }
+    static std::vector<uint8_t> compressZlib (const void* data, size_t data_size, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY) {
+        std::vector<uint8_t> out;
+        deflate_io::MemorySource source(data, data_size);
+        deflate_io::VectorSink sink(out);
+        compressZlibSource(source, sink, compression_level, strategy);
+        return out;
+    }
+    // with a preset dictionary, FDICT is set and the header carries the dictionary's id so a decoder can tell it has the right one
+    template <typename Source, typename Sink>
+    static size_t compressZlibSource (Source& source, Sink& sink, const Dictionary& dictionary, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY) {
+        size_t size = writeZlibHeader(sink, compression_level, &dictionary);
+        deflate_io::ChecksumSource<deflate_io::Adler32, Source> checked(source);
+        size += compressSource(checked, sink, dictionary, compression_level, strategy);
+        return size + writeZlibTrailer(sink, checked.check);
+    }
+    static std::vector<uint8_t> compressZlib (const void* data, size_t data_size, const Dictionary& dictionary, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY) {
+        std::vector<uint8_t> out;
+        deflate_io::MemorySource source(data, data_size);
+        deflate_io::VectorSink sink(out);
+        compressZlibSource(source, sink, dictionary, compression_level, strategy);
+        return out;
+    }
+
+    // seekable deflate, data is cut into chunk_size pieces that are compressed on their own, spread over threads workers (0 means one per core)
+    // the result is still one ordinary deflate stream any inflater reads, table gets where every chunk is,
+    // inflate::decompressChunk can start at any of them and inflate::decompressSeekable does them all at once
+    // a chunk can't match back into the one before it, so small chunks cost some ratio, 64KB and up barely shows
+    static std::vector<uint8_t> compressSeekable (const void* data, size_t data_size, SeekTable& table, size_t chunk_size = 1 << 20, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, size_t threads = 0) {
+        std::vector<uint8_t> out;
+        deflate_io::VectorSink sink(out);
+        compressChunks((const uint8_t*)data, sink, table, 0, fixedCuts(data_size, chunk_size), compression_level, strategy, threads);
+        return out;
+    }
+    // the same chunks as one gzip member, with the table after it in empty members so the file carries its own
+    // gzip and every other reader decode it as the one member, inflate::readSeekTable gets the table back out
+    static std::vector<uint8_t> compressGzipSeekable (const void* data, size_t data_size, size_t chunk_size = 1 << 20, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, const GzipHeader& header = GzipHeader(), size_t threads = 0) {
+        std::vector<uint8_t> out;
+        deflate_io::VectorSink sink(out);
+        writeChunkedGzip((const uint8_t*)data, data_size, sink, fixedCuts(data_size, chunk_size), compression_level, strategy, header, threads, true);
+        return out;
+    }
+    static size_t compressGzipSeekable (std::string file_path, std::string new_file, size_t chunk_size = 1 << 20, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, const GzipHeader& header = GzipHeader(), size_t threads = 0) {
+        return compressWholeFile(file_path, new_file, [&](const uint8_t* data, size_t size, auto& sink) {
+            return writeChunkedGzip(data, size, sink, fixedCuts(size, chunk_size), compression_level, strategy, header, threads, true);
+        });
+    }
 
-        BitFile out_file(new_file);
-        size_t out_size = 0;
-        size_t size = realCompress(
-            [&](uint32_t read_buffer[], uint8_t raw_buffer[], size_t n, size_t* read_buffer_index) -> size_t {
-                f.read((char*)(raw_buffer), n);
-                std::streamsize read = f.gcount();
-                for(size_t i = 0; i < read; i++, (*read_buffer_index)++) {
-                    read_buffer[*read_buffer_index] = ((uint32_t)raw_buffer[i] & 0xff);
-                }
-                return (read > 0) ? static_cast<size_t>(read) : 0;
-            },
-            [&](Bitstream& bs) -> void {
-                out_file.addBitStream(bs);
-            }, compression_level
-        );
-        out_file.writeFile();
-        f.close();
-        return out_size;
-    }
-
-    static std::vector<uint8_t> compress (char* data, size_t data_size, int compression_level) {
-        Bitstream out_stream;
-        size_t index = 0;
-        realCompress(
-            [&](uint32_t read_buffer[], uint8_t raw_buffer[], size_t n, size_t* read_buffer_index) -> size_t {
-                size_t count = 0;
-                for (; index < data_size && count < n; index++, (*read_buffer_index)++, count++) {
-                    read_buffer[*read_buffer_index] = ((uint32_t)data[index]) & 0xff;
-                    raw_buffer[*read_buffer_index] = data[index];
-                }
-                return count;
-            },
-            [&](Bitstream& bs) -> void {
-                out_stream.copyBitstream(bs);
-            }, compression_level
-        );
-        return out_stream.getData();
+    // rsyncable deflate, like gzip --rsyncable, the chunks end where a rolling hash of the input says and not every so many bytes
+    // every chunk starts with an empty window and ends on a full flush, so an edit only changes the output of the chunk or two
+    // around it and the rest comes out byte for byte the same, which is what rsync and dedup stores need to find it
+    // average_chunk is a power of 2, smaller resyncs sooner but costs ratio, 8KB can cost 10% on text and from 64KB up it's a few percent
+    // the chunks are compressed on threads workers (0 means one per core) and inflate::decompressParallel splits on the flushes
+    static std::vector<uint8_t> compressRsyncable (const void* data, size_t data_size, size_t average_chunk = 1 << 16, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, size_t threads = 0) {
+        std::vector<uint8_t> out;
+        deflate_io::VectorSink sink(out);
+        SeekTable table;
+        compressChunks((const uint8_t*)data, sink, table, 0, rsyncCuts((const uint8_t*)data, data_size, average_chunk), compression_level, strategy, threads);
+        return out;
+    }
+    static std::vector<uint8_t> compressGzipRsyncable (const void* data, size_t data_size, size_t average_chunk = 1 << 16, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, const GzipHeader& header = GzipHeader(), size_t threads = 0) {
+        std::vector<uint8_t> out;
+        deflate_io::VectorSink sink(out);
+        writeChunkedGzip((const uint8_t*)data, data_size, sink, rsyncCuts((const uint8_t*)data, data_size, average_chunk), compression_level, strategy, header, threads, false);
+        return out;
+    }
+    static size_t compressGzipRsyncable (std::string file_path, std::string new_file, size_t average_chunk = 1 << 16, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, const GzipHeader& header = GzipHeader(), size_t threads = 0) {
+        return compressWholeFile(file_path, new_file, [&](const uint8_t* data, size_t size, auto& sink) {
+            return writeChunkedGzip(data, size, sink, rsyncCuts(data, size, average_chunk), compression_level, strategy, header, threads, false);
+        });
+    }
+
+    static std::vector<uint8_t> compress (char* data, size_t data_size, int compression_level, Strategy strategy = DEFAULT_STRATEGY) {
+        std::vector<uint8_t> out;
+        deflate_io::MemorySource source(data, data_size);
+        deflate_io::VectorSink sink(out);
+        compressSource(source, sink, compression_level, strategy);
+        return out;
     }
     
-    static std::vector<uint8_t> compress (std::vector<uint8_t>& data, int compression_level) {
-        Bitstream out_stream;
-        size_t index = 0;
-        realCompress(
-            [&](uint32_t read_buffer[], uint8_t raw_buffer[], size_t n, size_t* read_buffer_index) -> size_t {
-                size_t count = 0;
-                for (; index < data.size() && count < n; index++, (*read_buffer_index)++, count++) {
-                    read_buffer[*read_buffer_index] = ((uint32_t)data[index]) & 0xff;
-                    raw_buffer[*read_buffer_index] = data[index];
-                }
-                return count;
-            },
-            [&](Bitstream& bs) -> void {
-                out_stream.copyBitstream(bs);
-            }, compression_level
-        );
-        return out_stream.getData();
+    static std::vector<uint8_t> compress (std::vector<uint8_t>& data, int compression_level, Strategy strategy = DEFAULT_STRATEGY) {
+        return compress((char*)data.data(), data.size(), compression_level, strategy);
+    }
+
+    // compress for input that's all in memory, with the huffman trees and bit encoding of each block moved off the thread
+    // that finds the matches and spread over threads workers (0 means one per core), the output is the same as compressing
+    // the file with compress(file_path, new_file), matches still reach back into the chunk before
+    // parsing stays serial, so the speedup is capped by how much of the time was entropy coding, most at levels 1 and 2
+    static std::vector<uint8_t> compressParallel (const void* data, size_t data_size, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, size_t threads = 0) {
+        std::vector<uint8_t> out;
+        deflate_io::VectorSink sink(out);
+        BitWriter<deflate_io::VectorSink> writer(sink);
+        realCompressPipelined<BitWriter<deflate_io::VectorSink>, deflate_io::Crc32>((const uint8_t*)data, data_size, writer, compression_level, strategy, nullptr, threads);
+        writer.finish();
+        return out;
+    }
+    static std::vector<uint8_t> compressGzipParallel (const void* data, size_t data_size, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY, const GzipHeader& header = GzipHeader(), size_t threads = 0) {
+        std::vector<uint8_t> out;
+        deflate_io::VectorSink sink(out);
+        writeGzipHeader(sink, header, compression_level);
+        deflate_io::Crc32 check;
+        BitWriter<deflate_io::VectorSink> writer(sink);
+        realCompressPipelined((const uint8_t*)data, data_size, writer, compression_level, strategy, &check, threads);
+        writer.finish();
+        writeGzipTrailer(sink, check);
+        return out;
+    }
+
+    // worst case output size of compress for in_size bytes, every 32kb chunk can end up as a stored block (3 bit header, padding, len and nlen)
+    static size_t compressBound (size_t in_size) {
+        return in_size + (in_size / KB32 + 1) * 6;
+    }
+
+    // compresses into out, returns the bytes written
+    // throws if out_cap runs out, a buffer of compressBound(in_size) bytes never will
+    // not allocation free, every call sets up a 512kb arena and a fresh Workspace in it, and each block is built there before it is copied into out
+    // for lots of calls use a Compressor, its compress(in, in_size, out, out_cap) keeps the workspace and doesn't touch the heap after the first call
+    static size_t compress (const void* in, size_t in_size, void* out, size_t out_cap, int compression_level = 2, Strategy strategy = DEFAULT_STRATEGY) {
+        deflate_io::MemorySource source(in, in_size);
+        BufferWriter out_buffer(out, out_cap);
+        realCompress(source, out_buffer, compression_level, strategy);
+        return out_buffer.getSize();
     }
 };
\ No newline at end of file
@@ -24,386 +24,2215 @@ relative LSB position).
 
 
 class inflate : deflate_compressor {
+    public:
+    // what's around the deflate data, for the calls that take more than one kind
+    enum Format {
+        RAW,
+        ZLIB,
+        GZIP
+    };
+    struct Index;
+    // how decompressSpeculative got through a stream, the pieces decoded ahead with their window unknown that were kept,
+    // and the stretches that had to be decoded serially instead
+    struct SpeculationReport {
+        size_t first = 0;    // the piece at the start of the stream, its window is known so it can't be wrong
+        size_t accepted = 0; // pieces past the first kept as they were speculatively decoded
+        size_t redone = 0;   // stretches decoded serially after a miss
+    };
+
     private:
 
-    class Bitwrapper {
-        private:
-        size_t size = 0;
-        size_t offset = 0;
-        uint8_t bit_offset = 0;
-        uint8_t* data;
-        std::vector<uint8_t> data_clone;
-        public:
-        Bitwrapper (void* data, size_t size) {
-            this->size = size;
-            this->data = (uint8_t*)data;
-            for (size_t i = 0; i < size; i++) {
-                data_clone.push_back(this->data[i]);
-            }
+    // for readers that only ever see the one buffer they were made with
+    struct NoSource {
+        size_t read (uint8_t*, size_t) {
+            return 0;
         }
-        //copy constructor
-        Bitwrapper (const Bitwrapper& wrap) {
-            size = wrap.size;
-            offset = wrap.offset;
-            bit_offset = wrap.bit_offset;
-            data = wrap.data;
-            data_clone = wrap.data_clone;
+    };
+
+    // reads bits lsb first out of a 64 bit buffer, topped up 8 bytes at once while there's room and a byte at a time near the end
+    // with a source the next piece gets read into piece once the current one runs out, so a block can span reads
+    // past the real end zero bytes get fed in and counted, checkOverrun throws if any of them were actually used
+    // the fields are public since the block decoder keeps them in locals and writes them back
+    template <typename Source>
+    class Bitreader {
+        public:
+        const uint8_t* start = nullptr;
+        const uint8_t* next = nullptr;
+        const uint8_t* end = nullptr;
+        uint64_t bitbuf = 0;
+        uint32_t bitcount = 0;
+        uint32_t overrun = 0;
+        size_t fetched = 0;
+        Source* source = nullptr;
+        uint8_t* piece = nullptr;
+        size_t piece_size = 0;
+
+        Bitreader (const void* data, size_t size, Source* source = nullptr, uint8_t* piece = nullptr, size_t piece_size = 0) {
+            start = (const uint8_t*)data;
+            next = start;
+            end = start + size;
+            this->source = source;
+            this->piece = piece;
+            this->piece_size = piece_size;
         }
 
-        Bitwrapper& operator=(const Bitwrapper& wrap) {
-            return *this = Bitwrapper(wrap);
+        inline void refill () {
+            #if defined(DEFLATE_LITTLE_ENDIAN)
+            if (end - next >= 8) {
+                uint64_t word;
+                std::memcpy(&word, next, 8);
+                bitbuf |= word << bitcount;
+                next += (63 - bitcount) >> 3;
+                bitcount |= 56;
+                return;
+            }
+            #endif
+            refillSlow();
         }
 
+        void refillSlow () {
+            while (bitcount < 56) {
+                if (next == end && !nextPiece()) {
+                    overrun++;
+                    if (overrun > 16) {
+                        throw std::runtime_error("Reading bits beyond the alloted buffer size!");
+                    }
+                    bitcount += 8;
+                    continue;
+                }
+                bitbuf |= (uint64_t)(*next++) << bitcount;
+                bitcount += 8;
+            }
+        }
 
-        //move constructor
-        Bitwrapper (Bitwrapper&& wrap) noexcept {
-            size = wrap.size;
-            offset = wrap.offset;
-            bit_offset = wrap.bit_offset;
-            data = wrap.data;
-            data_clone = wrap.data_clone;
+        bool nextPiece () {
+            if (source == nullptr) {
+                return false;
+            }
+            fetched += (size_t)(end - start);
+            start = end;
+            next = end;
+            size_t got = source->read(piece, piece_size);
+            if (got == 0) {
+                return false;
+            }
+            start = piece;
+            next = piece;
+            end = piece + got;
+            return true;
         }
 
-        Bitwrapper& operator=(Bitwrapper&& wrap) {
-            if (this != &wrap) {
-                size = wrap.size;
-                offset = wrap.offset;
-                bit_offset = wrap.bit_offset;
-                data = wrap.data;
-                data_clone = wrap.data_clone;
+        inline uint64_t peek () const {
+            return bitbuf;
+        }
+        inline void consume (uint32_t n) {
+            bitbuf >>= n;
+            bitcount -= n;
+        }
+        // up to 32 bits, refills first if it has to
+        inline uint32_t readBits (uint32_t n) {
+            if (bitcount < n) {
+                refill();
             }
-            return *this;
+            uint32_t v = (uint32_t)(bitbuf & ((1ull << n) - 1));
+            consume(n);
+            return v;
         }
 
-        uint32_t readBits (uint8_t bits) {
-            uint32_t val = 0;
-            uint32_t total_bits = 0;
-            if (offset > size) {
+        void alignToByte () {
+            consume(bitcount & 7);
+        }
+
+        // n whole bytes after alignToByte, the ones still sitting in the bit buffer come first
+        void readBytes (uint8_t* dst, size_t n) {
+            while (n > 0 && bitcount >= 8 && bitcount / 8 > overrun) {
+                *dst++ = (uint8_t)bitbuf;
+                consume(8);
+                n--;
+            }
+            if (n == 0) {
+                return;
+            }
+            if (overrun > 0) {
                 throw std::runtime_error("Reading bits beyond the alloted buffer size!");
             }
-            for (int32_t i = bits; i > 0;) {
-                uint32_t remaining = 8 - bit_offset;
-                uint32_t to_read  = ((i) < (int32_t)remaining) ? i : remaining;
-                uint32_t mask = ((1u << to_read) - 1);
-                uint32_t chunk = (data[offset] >> bit_offset) & mask; // mask created here and grab data same line
-                val |= (chunk << total_bits); // move captured data to correct spot in val
-                bit_offset += to_read ;
-                total_bits += to_read ;
-                i -= to_read ;
-                if (bit_offset > 7) {
-                    offset++;
-                    bit_offset = 0;
-                }
-                if (offset > size) {
+            // the buffer may still hold bits past bitcount that are really the bytes at next
+            bitbuf = 0;
+            bitcount = 0;
+            while (n > 0) {
+                if (next == end && !nextPiece()) {
                     throw std::runtime_error("Reading bits beyond the alloted buffer size!");
                 }
+                size_t take = std::min(n, (size_t)(end - next));
+                std::memcpy(dst, next, take);
+                dst += take;
+                next += take;
+                n -= take;
+            }
+        }
+
+        // after alignToByte, true when there's no input left at all, not even in the bit buffer
+        bool exhausted () {
+            if (bitcount / 8 > overrun) {
+                return false;
             }
-            return val;
+            // anything still buffered is padding from past the end
+            bitbuf = 0;
+            bitcount = 0;
+            overrun = 0;
+            return next == end && !nextPiece();
         }
 
-        uint8_t readByte () {
-            bit_offset = 0;
-            if (offset > size) {
+        // bits used up so far, counted from the first byte this reader was given
+        uint64_t position () const {
+            return ((uint64_t)fetched + (uint64_t)(next - start) + overrun) * 8 - bitcount;
+        }
+
+        void checkOverrun () const {
+            if ((size_t)overrun * 8 > bitcount) {
                 throw std::runtime_error("Reading bits beyond the alloted buffer size!");
             }
-            return data[offset++];
         }
+    };
+
+    // two level decode table, the low root_bits of the bit buffer index the root directly
+    // codes longer than that land on a subtable entry and the bits after the root index into it
+    // entries hold the symbol in the low 16 bits and the full code length in bits 16-23
+    // subtable entries set bit 31 and hold the subtable offset and its index width in those same spots
+    class DecodeTable {
+        private:
+        std::pmr::vector<uint32_t> entries;
+        uint32_t root_bits = 0;
+
+        static uint32_t reverseBits (uint32_t code, uint32_t len) {
+            uint32_t r = 0;
+            for (uint32_t i = 0; i < len; i++) {
+                r = (r << 1) | ((code >> i) & 1);
+            }
+            return r;
+        }
+
+        public:
+        static constexpr uint32_t subtable = 1u << 31;
+        static constexpr uint32_t invalid = 1u << 30;
+
+        DecodeTable (std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : entries(mem) {
+        }
+
+        // lens is the code length of every symbol, 0 when unused
+        // an incomplete set of lengths is only allowed with a single code, like zlib does
+        void build (const uint8_t lens[], uint32_t count, uint32_t root_bits) {
+            this->root_bits = root_bits;
+            uint32_t len_count[16] = {0};
+            for (uint32_t i = 0; i < count; i++) {
+                if (lens[i] > 15) {
+                    throw std::runtime_error("Invalid code length!");
+                }
+                len_count[lens[i]]++;
+            }
+            len_count[0] = 0;
+            int32_t left = 1;
+            uint32_t used = 0;
+            for (uint32_t len = 1; len < 16; len++) {
+                left <<= 1;
+                left -= (int32_t)len_count[len];
+                if (left < 0) {
+                    throw std::runtime_error("Code tree is over or under subscribed!");
+                }
+                used += len_count[len];
+            }
+            if (left > 0 && used > 1) {
+                throw std::runtime_error("Code tree is over or under subscribed!");
+            }
+            uint32_t next_code[16] = {0};
+            uint32_t code = 0;
+            for (uint32_t len = 1; len < 16; len++) {
+                code = (code + len_count[len - 1]) << 1;
+                next_code[len] = code;
+            }
 
-        void moveByte (bool off = false) {
-            if (off) {
-                if (bit_offset != 0) {
-                    offset++;
-                    bit_offset = 0;
+            uint32_t root_size = 1u << root_bits;
+            uint32_t root_mask = root_size - 1;
+            entries.assign(root_size, invalid);
+            uint16_t reversed[288];
+            uint8_t sub_bits[1u << 10] = {0};
+            bool long_codes = false;
+            for (uint32_t sym = 0; sym < count; sym++) {
+                uint32_t len = lens[sym];
+                if (len == 0) {
+                    continue;
                 }
+                uint32_t r = reverseBits(next_code[len]++, len);
+                reversed[sym] = (uint16_t)r;
+                if (len <= root_bits) {
+                    for (uint32_t i = r; i < root_size; i += 1u << len) {
+                        entries[i] = sym | (len << 16);
+                    }
+                } else {
+                    uint32_t slot = r & root_mask;
+                    sub_bits[slot] = std::max<uint8_t>(sub_bits[slot], (uint8_t)(len - root_bits));
+                    long_codes = true;
+                }
+            }
+            if (!long_codes) {
                 return;
             }
-            offset++;
-            bit_offset = 0;
+            // codes sharing the same root bits get one subtable, wide enough for the longest of them
+            uint32_t offset = root_size;
+            for (uint32_t slot = 0; slot < root_size; slot++) {
+                if (sub_bits[slot] > 0) {
+                    entries[slot] = subtable | offset | ((uint32_t)sub_bits[slot] << 16);
+                    offset += 1u << sub_bits[slot];
+                }
+            }
+            entries.resize(offset, invalid);
+            for (uint32_t sym = 0; sym < count; sym++) {
+                uint32_t len = lens[sym];
+                if (len <= root_bits) {
+                    continue;
+                }
+                uint32_t r = reversed[sym];
+                uint32_t e = entries[r & root_mask];
+                uint32_t base = e & 0xffff;
+                uint32_t size = 1u << ((e >> 16) & 0xff);
+                for (uint32_t i = r >> root_bits; i < size; i += 1u << (len - root_bits)) {
+                    entries[base + i] = sym | (len << 16);
+                }
+            }
+        }
+
+        DEFLATE_FORCE_INLINE uint32_t lookup (uint64_t bits) const {
+            uint32_t e = entries[bits & ((1u << root_bits) - 1)];
+            if (e & subtable) {
+                e = entries[(e & 0xffff) + ((bits >> root_bits) & ((1u << ((e >> 16) & 0xff)) - 1))];
+            }
+            return e;
+        }
+    };
+
+    // decoded output, matches copy out of it so the last 32K always has to stay around
+    // everything older than that gets handed to sink.write whenever the buffer fills up, and the rest on flush
+    // there's slack past the end so the match copy kernels can overshoot
+    template <typename Sink>
+    class Window {
+        public:
+        static constexpr size_t slack = 32;
+        static constexpr size_t max_match = 258;
+        std::pmr::vector<uint8_t> buf;
+        size_t pos = 0;
+        size_t delivered = 0;
+        size_t total = 0;
+        Sink* sink;
+        Stats* stats = nullptr; // sink writes are timed as io when set
+
+        Window (Sink* sink, size_t capacity = 4 * KB32, std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : buf(mem) {
+            this->sink = sink;
+            buf.resize(std::max(capacity, (size_t)2 * KB32) + slack);
         }
 
-        size_t getOffset() {
-            if (offset > 0 && bit_offset == 0) {
-                return offset - 1;
+        inline void ensure (size_t n) {
+            if (pos + n + slack > buf.size()) {
+                make(n);
+            }
+        }
+        void make (size_t n) {
+            if (pos > KB32) {
+                flush();
+                std::memmove(buf.data(), buf.data() + pos - KB32, KB32);
+                pos = KB32;
+                delivered = pos;
+            }
+            if (pos + n + slack > buf.size()) {
+                buf.resize(std::max(buf.size() * 2, pos + n + slack));
             }
-            return offset;
+        }
+        // the last spot a whole match can start at without calling ensure
+        inline uint8_t* limit () {
+            return buf.data() + buf.size() - slack - max_match;
+        }
+        inline uint8_t* cursor () {
+            return buf.data() + pos;
+        }
+        inline void advance (size_t n) {
+            pos += n;
         }
 
-        size_t getSize() {
-            return size;
+        void flush () {
+            if (pos > delivered) {
+                Stats::Timer timer(stats, Stats::IO);
+                sink->write(buf.data() + delivered, pos - delivered);
+                total += pos - delivered;
+                delivered = pos;
+            }
+        }
+        size_t size () const {
+            return total + (pos - delivered);
+        }
+        // empty again for the next stream, the buffer is kept
+        void reset () {
+            pos = 0;
+            delivered = 0;
+            total = 0;
+        }
+        // starts the stream with a preset dictionary as history, matches can reach back into it but it never gets written out
+        void preset (const uint8_t* dictionary, size_t n) {
+            if (n > KB32) {
+                dictionary += n - KB32;
+                n = KB32;
+            }
+            if (n > 0) {
+                std::memcpy(buf.data(), dictionary, n);
+            }
+            pos = n;
+            delivered = n;
         }
     };
 
-    static FlatHuffmanTree readCodeLengthTree (Bitwrapper& data, uint32_t hclen) {
-         std::vector<Code> codes = {
-                {0, 0, 2, 16},
-                {0, 0, 3, 17},
-                {0, 0, 7, 18},
-                {0, 0, 0, 0},
-                {0, 0, 0, 8},
-                {0, 0, 0, 7},
-                {0, 0, 0, 9},
-                {0, 0, 0, 6},
-                {0, 0, 0, 10},
-                {0, 0, 0, 5},
-                {0, 0, 0, 11},
-                {0, 0, 0, 4},
-                {0, 0, 0, 12},
-                {0, 0, 0, 3},
-                {0, 0, 0, 13},
-                {0, 0, 0, 2},
-                {0, 0, 0, 14},
-                {0, 0, 0, 1},
-                {0, 0, 0, 15},
-        };
-        for (uint32_t i = 0; i < hclen + 4; i++) {
-                uint32_t val = data.readBits(3);
-                codes[i].len = val;
+    static constexpr uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static constexpr uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static constexpr uint16_t dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static constexpr uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    static constexpr uint8_t precode_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    static constexpr uint32_t lit_root_bits = 10;
+    static constexpr uint32_t dist_root_bits = 8;
+
+    static const DecodeTable& fixedLiteralTable () {
+        static DecodeTable table = []() {
+            uint8_t lens[288];
+            std::fill(lens, lens + 144, 8);
+            std::fill(lens + 144, lens + 256, 9);
+            std::fill(lens + 256, lens + 280, 7);
+            std::fill(lens + 280, lens + 288, 8);
+            DecodeTable t(std::pmr::new_delete_resource());
+            t.build(lens, 288, lit_root_bits);
+            return t;
+        }();
+        return table;
+    }
+    static const DecodeTable& fixedDistanceTable () {
+        static DecodeTable table = []() {
+            // 30 and 31 have codes but are never valid, the decoder rejects them
+            uint8_t lens[32];
+            std::fill(lens, lens + 32, 5);
+            DecodeTable t(std::pmr::new_delete_resource());
+            t.build(lens, 32, dist_root_bits);
+            return t;
+        }();
+        return table;
+    }
+
+    // decode tables for dynamic blocks, kept across blocks so they only get allocated once
+    struct Tables {
+        DecodeTable lit;
+        DecodeTable dist;
+        DecodeTable precode;
+        Stats* stats = nullptr; // decodeBlocks counts and times blocks into it when set
+        Tables (std::pmr::memory_resource* mem) : lit(mem), dist(mem), precode(mem) {
         }
-       
-        return FlatHuffmanTree(codes);
+    };
+
+    // literal/length and distance code lengths are one sequence, repeats can run from one into the other
+    template <typename In>
+    static void readDynamicTables (In& data, Tables& tables) {
+        DecodeTable& lit = tables.lit;
+        DecodeTable& dist = tables.dist;
+        DecodeTable& precode = tables.precode;
+        uint32_t hlit = data.readBits(5) + 257;
+        uint32_t hdist = data.readBits(5) + 1;
+        uint32_t hclen = data.readBits(4) + 4;
+        uint8_t precode_lens[19] = {0};
+        for (uint32_t i = 0; i < hclen; i++) {
+            precode_lens[precode_order[i]] = (uint8_t)data.readBits(3);
+        }
+        precode.build(precode_lens, 19, 7);
+
+        uint8_t lens[288 + 32] = {0};
+        uint32_t total = hlit + hdist;
+        for (uint32_t i = 0; i < total;) {
+            data.refill();
+            uint32_t e = precode.lookup(data.peek());
+            if (e & DecodeTable::invalid) {
+                throw std::runtime_error("Invalid code length code!");
+            }
+            data.consume((e >> 16) & 0xff);
+            uint32_t sym = e & 0xffff;
+            if (sym < 16) {
+                lens[i++] = (uint8_t)sym;
+                continue;
+            }
+            uint8_t value = 0;
+            uint32_t repeat;
+            switch (sym) {
+                case 16:
+                    if (i == 0) {
+                        throw std::runtime_error("Repeat with no previous code length!");
+                    }
+                    value = lens[i - 1];
+                    repeat = 3 + data.readBits(2);
+                break;
+                case 17:
+                    repeat = 3 + data.readBits(3);
+                break;
+                default:
+                    repeat = 11 + data.readBits(7);
+            }
+            if (i + repeat > total) {
+                throw std::runtime_error("Code length repeat runs past the end of the tree!");
+            }
+            std::fill(lens + i, lens + i + repeat, value);
+            i += repeat;
+        }
+        if (lens[256] == 0) {
+            throw std::runtime_error("Tree has no end of block code!");
+        }
+        lit.build(lens, hlit, lit_root_bits);
+        dist.build(lens + hlit, hdist, dist_root_bits);
     }
 
-    static std::vector<Code> readDynamicTreeCodes (Bitwrapper& data, FlatHuffmanTree code_len, size_t iterations) {
-        std::vector<Code> codes;
-        uint32_t code = 0;
-        int32_t cur_bit = 0;
-        Code last_code = {0, 0, 0, 0};
-        for (uint32_t i = 0; i < iterations;) {
-            code = (code << 1) | data.readBits(1);
-            cur_bit++;
-            Code cc = code_len.getCodeEncoded(code, cur_bit);
-            if (cc.code == code && cc.len == cur_bit && cc.len > 0) {
-                uint32_t repeat;
-                switch (cc.value) {
-                    case 16:
-                        repeat = data.readBits(2);
-                        for (size_t j = 0; j < (repeat + 3); j++, i++) {
-                            codes.push_back({0, last_code.value, 0, (uint16_t)i});
-                        }
-                    break;
-                    case 17:
-                        repeat = data.readBits(3);
-                        for (size_t j = 0; j < (repeat + 3); j++, i++) {
-                            codes.push_back({0, 0, 0, (uint16_t)i});
-                        }
-                    break;
-                    case 18:
-                        repeat = data.readBits(7);
-                        for (size_t j = 0; j < (repeat + 11); j++, i++) {
-                            codes.push_back({0, 0, 0, (uint16_t)i});
-                        }
-                    break;
-                    default:
-                        codes.push_back({0, cc.value, 0, (uint16_t)i});
-                        last_code = cc;
-                        i++;
-                }
-                code = 0;
-                cur_bit = 0;
-            }
-        }
-        return codes;
-    }
-
-    static std::pair<FlatHuffmanTree, FlatHuffmanTree> decodeTree (Bitwrapper& data) {
-        uint32_t hlit = (data.readBits(5));
-        uint32_t hdist = data.readBits(5);
-        uint32_t hclen = data.readBits(4);
-        FlatHuffmanTree code_len = readCodeLengthTree(data, hclen);
-        std::vector<Code> cod = code_len.decode();
-
-        // literal/length
-        std::vector<Code> litlength = readDynamicTreeCodes(data, code_len, 257 + hlit);
-        FlatHuffmanTree littree = FlatHuffmanTree(litlength);
-        std::vector<Code> lit_codes = littree.decode();
-        // distance
-        std::vector<Code> distcodes = readDynamicTreeCodes(data, code_len, 1 + hdist);
-
-        FlatHuffmanTree disttree = FlatHuffmanTree(distcodes);
-        return std::pair<FlatHuffmanTree, FlatHuffmanTree>(littree, disttree);
-    }
-    // https://stackoverflow.com/questions/62827971/can-deflate-only-compress-duplicate-strings-up-to-32-kib-apart
-    static void decompressHuffmanBlock (Bitwrapper& data, std::vector<uint8_t>& buffer, FlatHuffmanTree tree, FlatHuffmanTree dist_tree) {
-        uint32_t code = 0;
-        uint8_t cur_bit = 0;
-        RangeLookup rl = generateLengthLookup();
-        RangeLookup dl = generateDistanceLookup();
+    // the literal/length and distance loop, with the bit buffer and output cursor kept in locals
+    // one refill covers a whole symbol, 15 bits of length code + 5 extra + 15 of distance code + 13 extra is 48 and a refill leaves at least 56
+    // it's inlined into a plain and a bmi2 build so the variable shifts and masks can turn into shrx and bzhi
+    template <typename In, typename Out>
+    static DEFLATE_FORCE_INLINE void decodeSymbols (In& in, Out& out, const DecodeTable& lit, const DecodeTable& dist) {
+        const deflate_cpu::MatchCopyFunc copy = deflate_cpu::kernels().matchCopy;
+        uint64_t bitbuf = in.bitbuf;
+        uint32_t bitcount = in.bitcount;
+        const uint8_t* next = in.next;
+        const uint8_t* end = in.end;
+        uint8_t* base = out.buf.data();
+        uint8_t* op = out.cursor();
+        uint8_t* limit = out.limit();
         while (true) {
-            code = (code << 1) | data.readBits(1);
-            cur_bit++;
-            Code c = tree.getCodeEncoded(code, cur_bit);
-            if (c.value < 256 && cur_bit == c.len) {
-                buffer.push_back((uint8_t)c.value);
-                code = 0;
-                cur_bit = 0;
-            }
-            else if (c.value == 256) {
+            if (op > limit) {
+                out.pos = op - base;
+                out.make(Out::max_match);
+                base = out.buf.data();
+                op = out.cursor();
+                limit = out.limit();
+            }
+            #if defined(DEFLATE_LITTLE_ENDIAN)
+            if (end - next >= 8) {
+                uint64_t word;
+                std::memcpy(&word, next, 8);
+                bitbuf |= word << bitcount;
+                next += (63 - bitcount) >> 3;
+                bitcount |= 56;
+            } else
+            #endif
+            {
+                in.bitbuf = bitbuf;
+                in.bitcount = bitcount;
+                in.next = next;
+                in.refillSlow();
+                bitbuf = in.bitbuf;
+                bitcount = in.bitcount;
+                next = in.next;
+                end = in.end;
+            }
+            uint32_t e = lit.lookup(bitbuf);
+            if (e & DecodeTable::invalid) {
+                throw std::runtime_error("Invalid literal/length code!");
+            }
+            uint32_t len = (e >> 16) & 0xff;
+            bitbuf >>= len;
+            bitcount -= len;
+            uint32_t sym = e & 0xffff;
+            if (sym < 256) {
+                *op++ = (uint8_t)sym;
+                continue;
+            }
+            if (sym == 256) {
                 break;
-            } else if (c.value > 256 && cur_bit == c.len) {
-                Range r = rl.findCode(c.value);
-                uint32_t length = r.start;
-                if (r.extra_bits > 0) {
-                    uint32_t extra = data.readBits(r.extra_bits);
-                    length += extra;
-                }
-                // decode dist code
-                uint32_t dist_code = 0;
-                Code dss;
-                for (size_t bits = 0; bits < 16; bits++) {
-                    dist_code = (dist_code << 1) | data.readBits(1);
-                    Code ds = dist_tree.getCodeEncoded(dist_code, bits+1);
-                    if (ds.len == (bits+1)) {
-                        dss = ds;
-                        break;
+            }
+            sym -= 257;
+            if (sym >= 29) {
+                throw std::runtime_error("Invalid length code!");
+            }
+            uint32_t extra = length_extra[sym];
+            uint32_t length = length_base[sym] + (uint32_t)(bitbuf & ((1ull << extra) - 1));
+            bitbuf >>= extra;
+            bitcount -= extra;
+
+            e = dist.lookup(bitbuf);
+            if (e & DecodeTable::invalid) {
+                throw std::runtime_error("Invalid distance code!");
+            }
+            len = (e >> 16) & 0xff;
+            bitbuf >>= len;
+            bitcount -= len;
+            sym = e & 0xffff;
+            if (sym >= 30) {
+                throw std::runtime_error("Invalid distance code!");
+            }
+            extra = dist_extra[sym];
+            uint32_t distance = dist_base[sym] + (uint32_t)(bitbuf & ((1ull << extra) - 1));
+            bitbuf >>= extra;
+            bitcount -= extra;
+            if (distance > (size_t)(op - base)) {
+                throw std::runtime_error("Match distance reaches back before the start of the data!");
+            }
+            copy(op, distance, length);
+            op += length;
+        }
+        in.bitbuf = bitbuf;
+        in.bitcount = bitcount;
+        in.next = next;
+        out.pos = op - base;
+    }
+
+    template <typename In, typename Out>
+    static void decodeSymbolsPlain (In& in, Out& out, const DecodeTable& lit, const DecodeTable& dist) {
+        decodeSymbols(in, out, lit, dist);
+    }
+    #if defined(DEFLATE_HAS_TARGETS)
+    template <typename In, typename Out>
+    DEFLATE_TARGET("bmi2") static void decodeSymbolsBmi2 (In& in, Out& out, const DecodeTable& lit, const DecodeTable& dist) {
+        decodeSymbols(in, out, lit, dist);
+    }
+    #endif
+
+    // decodes blocks up to and including the final one, visit gets called before every block header and can stop it there
+    // In is a Bitreader and Out a Window, so every source and sink pairing gets its own decode loop
+    // returns whether the final block was reached
+    template <typename In, typename Out, typename Visit>
+    static bool decodeBlocks (In& data, Out& out, Tables& tables, Visit&& visit) {
+        void (*decode)(In&, Out&, const DecodeTable&, const DecodeTable&) = decodeSymbolsPlain<In, Out>;
+        #if defined(DEFLATE_HAS_TARGETS)
+        if (deflate_cpu::kernels().bmi2_decode) {
+            decode = decodeSymbolsBmi2<In, Out>;
+        }
+        #endif
+        while (true) {
+            if (!visit()) {
+                return false;
+            }
+            uint32_t final = data.readBits(1);
+            uint32_t type = data.readBits(2);
+            Stats* stats = tables.stats;
+            switch (type) {
+                case 0:
+                {
+                    Stats::Timer timer(stats, Stats::ENTROPY_CODING);
+                    data.alignToByte();
+                    uint32_t len = data.readBits(16);
+                    uint32_t nlen = data.readBits(16);
+                    if ((len ^ 0xffff) != nlen) {
+                        throw std::runtime_error("Stored block length doesn't match its complement!");
                     }
+                    out.ensure(len);
+                    data.readBytes(out.cursor(), len);
+                    out.advance(len);
+                }
+                break;
+                case 1:
+                {
+                    Stats::Timer timer(stats, Stats::ENTROPY_CODING);
+                    decode(data, out, fixedLiteralTable(), fixedDistanceTable());
                 }
-                // read full distance code
-                Range d = dl.findCode(dss.value);
-                uint32_t distance = d.start;
-                if (d.extra_bits > 0) {
-                    uint32_t extra = data.readBits(d.extra_bits);
-                    distance += extra;
+                break;
+                case 2:
+                {
+                    {
+                        Stats::Timer timer(stats, Stats::TREE_BUILDING);
+                        readDynamicTables(data, tables);
+                    }
+                    Stats::Timer timer(stats, Stats::ENTROPY_CODING);
+                    decode(data, out, tables.lit, tables.dist);
                 }
-                // copy the uncompressed data here using the distance length pair
-                for (size_t i = buffer.size() - distance, j = 0; j < length && i < buffer.size(); j++, i++) {
-                    buffer.push_back(buffer[i]);
+                break;
+                default:
+                    throw std::runtime_error("Invalid block type!");
+            }
+            if (stats) {
+                (type == 0 ? stats->stored_blocks : type == 1 ? stats->fixed_blocks : stats->dynamic_blocks)++;
+            }
+            data.checkOverrun();
+            if (final) {
+                return true;
+            }
+        }
+    }
+
+    // returns how many bytes the blocks decoded to
+    template <typename In, typename Out>
+    static size_t realDecompress (In& data, Out& out, Tables& tables) {
+        decodeBlocks(data, out, tables, []() {
+            return true;
+        });
+        out.flush();
+        return out.size();
+    }
+
+    // a gzip member header up to where the deflate data starts, header gets the fields when it's given
+    template <typename In>
+    static void readGzipHeader (In& data, GzipHeader* header) {
+        // every byte goes into the crc in case FHCRC is set
+        uint32_t crc = 0;
+        auto byte = [&]() -> uint8_t {
+            uint8_t b = (uint8_t)data.readBits(8);
+            crc = deflate_cpu::kernels().crc32(crc, &b, 1);
+            return b;
+        };
+        if (byte() != 0x1f || byte() != 0x8b) {
+            throw std::runtime_error("Not gzip data!");
+        }
+        if (byte() != 8) {
+            throw std::runtime_error("Unsupported gzip compression method!");
+        }
+        uint8_t flags = byte();
+        if (flags & 0xe0) {
+            throw std::runtime_error("Reserved gzip flags set!");
+        }
+        GzipHeader fields;
+        for (int i = 0; i < 4; i++) {
+            fields.mtime |= (uint32_t)byte() << (8 * i);
+        }
+        byte();
+        fields.os = byte();
+        fields.text = flags & 1;
+        fields.header_crc = flags & 2;
+        if (flags & 4) {
+            uint32_t len = byte();
+            len |= (uint32_t)byte() << 8;
+            for (uint32_t i = 0; i < len; i++) {
+                fields.extra.push_back(byte());
+            }
+        }
+        // running past the end reads zeros, so these stop there and checkOverrun catches it
+        if (flags & 8) {
+            while (uint8_t c = byte()) {
+                fields.name += (char)c;
+            }
+        }
+        if (flags & 16) {
+            while (uint8_t c = byte()) {
+                fields.comment += (char)c;
+            }
+        }
+        if (flags & 2) {
+            uint32_t expected = crc & 0xffff;
+            if (data.readBits(16) != expected) {
+                throw std::runtime_error("Gzip header checksum doesn't match!");
+            }
+        }
+        data.checkOverrun();
+        if (header != nullptr) {
+            *header = fields;
+        }
+    }
+
+    // gzip members one after another until the input runs out, concatenated members decode to their outputs back to back
+    // the crc-32 is taken on the output as the window hands it to sink, while it's still in cache from being written
+    template <typename In, typename Sink>
+    static size_t realDecompressGzip (In& data, Sink& sink, std::pmr::memory_resource* mem, GzipHeader* header) {
+        deflate_io::ChecksumSink<deflate_io::Crc32, Sink> checked(sink);
+        Window<decltype(checked)> window(&checked, 4 * KB32, mem);
+        Tables tables(mem);
+        do {
+            readGzipHeader(data, header);
+            header = nullptr;
+            realDecompress(data, window, tables);
+            data.alignToByte();
+            uint32_t crc = data.readBits(32);
+            uint32_t size = data.readBits(32);
+            data.checkOverrun();
+            if (crc != checked.check.value()) {
+                throw std::runtime_error("Gzip crc doesn't match the data!");
+            }
+            if (size != (uint32_t)checked.check.size()) {
+                throw std::runtime_error("Gzip size doesn't match the data!");
+            }
+            checked.check.reset();
+        } while (!data.exhausted());
+        return window.size();
+    }
+
+    // rfc 1950 header, checks the method, the window size and FCHECK
+    // when FDICT is set the dictionary has to be there and match the id, returns whether it's used
+    template <typename In>
+    static bool readZlibHeader (In& data, const uint8_t* dictionary, size_t dictionary_size) {
+        uint32_t cmf = data.readBits(8);
+        uint32_t flg = data.readBits(8);
+        data.checkOverrun();
+        if ((cmf & 0x0f) != 8) {
+            throw std::runtime_error("Unsupported zlib compression method!");
+        }
+        if ((cmf >> 4) > 7) {
+            throw std::runtime_error("Invalid zlib window size!");
+        }
+        if (((cmf << 8) | flg) % 31 != 0) {
+            throw std::runtime_error("Zlib header check failed!");
+        }
+        if (!(flg & 0x20)) {
+            return false;
+        }
+        uint32_t id = 0;
+        for (int i = 0; i < 4; i++) {
+            id = (id << 8) | data.readBits(8);
+        }
+        data.checkOverrun();
+        if (dictionary == nullptr) {
+            throw std::runtime_error("Zlib stream needs a preset dictionary!");
+        }
+        if (deflate_cpu::kernels().adler32(1, dictionary, dictionary_size) != id) {
+            throw std::runtime_error("Preset dictionary doesn't match the zlib stream!");
+        }
+        return true;
+    }
+
+    // one zlib stream, anything after its trailer is left alone
+    // the adler-32 is taken on the output as the window hands it to sink, while it's still in cache from being written
+    template <typename In, typename Sink>
+    static size_t realDecompressZlib (In& data, Sink& sink, std::pmr::memory_resource* mem, const uint8_t* dictionary = nullptr, size_t dictionary_size = 0) {
+        bool use_dictionary = readZlibHeader(data, dictionary, dictionary_size);
+        deflate_io::ChecksumSink<deflate_io::Adler32, Sink> checked(sink);
+        Window<decltype(checked)> window(&checked, 4 * KB32, mem);
+        if (use_dictionary) {
+            window.preset(dictionary, dictionary_size);
+        }
+        Tables tables(mem);
+        size_t size = realDecompress(data, window, tables);
+        data.alignToByte();
+        uint32_t adler = 0;
+        for (int i = 0; i < 4; i++) {
+            adler = (adler << 8) | data.readBits(8);
+        }
+        data.checkOverrun();
+        if (adler != checked.check.value()) {
+            throw std::runtime_error("Zlib adler-32 doesn't match the data!");
+        }
+        return size;
+    }
+
+    // the output of an index pass only gets counted and checked, nothing keeps it
+    struct Tally {
+        Format format = RAW;
+        deflate_io::Crc32 crc;
+        deflate_io::Adler32 adler;
+        void write (const uint8_t* data, size_t n) {
+            if (format == GZIP) {
+                crc.update(data, n);
+            } else if (format == ZLIB) {
+                adler.update(data, n);
+            }
+        }
+    };
+
+    // after a final block, reads the trailer and for gzip the header of the member after it, returns whether there is one
+    // the trailer is checked against tally when it's given, a decode that started partway in has nothing to check it with
+    template <typename In>
+    static bool nextMember (In& data, Format format, Tally* tally) {
+        if (format == RAW) {
+            return false;
+        }
+        data.alignToByte();
+        if (format == ZLIB) {
+            uint32_t adler = 0;
+            for (int i = 0; i < 4; i++) {
+                adler = (adler << 8) | data.readBits(8);
+            }
+            data.checkOverrun();
+            if (tally != nullptr && adler != tally->adler.value()) {
+                throw std::runtime_error("Zlib adler-32 doesn't match the data!");
+            }
+            return false;
+        }
+        uint32_t crc = data.readBits(32);
+        uint32_t size = data.readBits(32);
+        data.checkOverrun();
+        if (tally != nullptr) {
+            if (crc != tally->crc.value()) {
+                throw std::runtime_error("Gzip crc doesn't match the data!");
+            }
+            if (size != (uint32_t)tally->crc.size()) {
+                throw std::runtime_error("Gzip size doesn't match the data!");
+            }
+            tally->crc.reset();
+        }
+        if (data.exhausted()) {
+            return false;
+        }
+        readGzipHeader(data, nullptr);
+        return true;
+    }
+
+    // one pass over the whole stream, a checkpoint goes down at the first block boundary after every span bytes of output
+    // the output can't be checked against a zlib or gzip trailer until it's all been seen, so a corrupt stream throws here
+    template <typename In>
+    static Index realBuildIndex (In& data, Format format, size_t span, std::pmr::memory_resource* mem) {
+        Tally tally;
+        tally.format = format;
+        Window<Tally> window(&tally, 4 * KB32, mem);
+        Tables tables(mem);
+        Index index;
+        index.format = format;
+        if (format == GZIP) {
+            readGzipHeader(data, nullptr);
+        } else if (format == ZLIB) {
+            readZlibHeader(data, nullptr, 0);
+        }
+        auto visit = [&]() {
+            uint64_t out = window.size();
+            if (index.points.empty() || out - index.points.back().out >= span) {
+                Index::Point point;
+                point.in_bits = data.position();
+                point.out = out;
+                // the window always keeps the 32K before pos, or everything when there isn't that much yet
+                size_t keep = std::min(window.pos, (size_t)KB32);
+                point.window.assign(window.cursor() - keep, window.cursor());
+                index.points.push_back(std::move(point));
+            }
+            return true;
+        };
+        do {
+            decodeBlocks(data, window, tables, visit);
+            window.flush();
+        } while (nextMember(data, format, &tally));
+        index.out_size = window.size();
+        return index;
+    }
+
+    // only keeps the len bytes after the first skip, the rest of the output just goes by
+    struct Range {
+        uint64_t skip = 0;
+        uint8_t* out = nullptr;
+        size_t len = 0;
+        size_t got = 0;
+        void write (const uint8_t* data, size_t n) {
+            if (skip >= n) {
+                skip -= n;
+                return;
+            }
+            data += skip;
+            n -= (size_t)skip;
+            skip = 0;
+            size_t take = std::min(n, len - got);
+            std::memcpy(out + got, data, take);
+            got += take;
+        }
+    };
+
+    // data has to be sitting on the block a checkpoint was taken at, with history as the window from then
+    // decoding stops at the first block boundary past the range, returns how much of it there was
+    template <typename In>
+    static size_t realExtract (In& data, Format format, const std::vector<uint8_t>& history, uint64_t skip, uint8_t* out, size_t len, std::pmr::memory_resource* mem) {
+        Range range;
+        range.skip = skip;
+        range.out = out;
+        range.len = len;
+        Window<Range> window(&range, 4 * KB32, mem);
+        window.preset(history.data(), history.size());
+        Tables tables(mem);
+        uint64_t want = skip + len;
+        auto visit = [&]() {
+            return window.size() < want;
+        };
+        while (decodeBlocks(data, window, tables, visit) && nextMember(data, format, nullptr)) {
+        }
+        window.flush();
+        return range.got;
+    }
+
+    // somewhere a piece of a parallel decode can start, a gzip member header or the block after a full flush
+    struct Boundary {
+        size_t offset = 0;
+        bool member = false;
+    };
+    // a gzip trailer a piece went past, end is how far into the piece's output its member ended
+    struct MemberEnd {
+        size_t end = 0;
+        uint32_t crc = 0;
+        uint32_t size = 0;
+    };
+    // one piece decoded on its own, next is the boundary it ended on or boundaries.size() at the end of the stream
+    struct Segment {
+        std::vector<uint8_t> out;
+        std::vector<MemberEnd> members;
+        size_t next = 0;
+        bool ok = false;
+    };
+
+    // every member of a BGZF file, each one's FEXTRA has a "BC" subfield holding the member's size less one
+    // empty when it isn't one, or any member doesn't say, and the boundaries have to be searched for instead
+    static std::vector<Boundary> bgzfBoundaries (const uint8_t* in, size_t in_size) {
+        std::vector<Boundary> boundaries;
+        size_t at = 0;
+        while (at < in_size) {
+            GzipHeader header;
+            try {
+                Bitreader<NoSource> dat(in + at, in_size - at);
+                readGzipHeader(dat, &header);
+            } catch (const std::runtime_error&) {
+                return {};
+            }
+            const std::vector<uint8_t>& extra = header.extra;
+            size_t block_size = 0;
+            for (size_t i = 0; i + 4 <= extra.size(); i += 4 + (extra[i + 2] | (size_t)extra[i + 3] << 8)) {
+                if (extra[i] == 'B' && extra[i + 1] == 'C' && extra[i + 2] == 2 && extra[i + 3] == 0 && i + 6 <= extra.size()) {
+                    block_size = (extra[i + 4] | (size_t)extra[i + 5] << 8) + 1;
                 }
-                cur_bit = 0;
             }
+            if (block_size == 0 || block_size > in_size - at) {
+                return {};
+            }
+            boundaries.push_back({at, true});
+            at += block_size;
+        }
+        return boundaries;
+    }
 
+    // everything that looks like a boundary, gzip magic with the deflate method and no reserved flags, or an empty stored block
+    // a false one only costs a wasted piece, stitching never trusts a boundary a checked piece didn't land on exactly
+    static std::vector<Boundary> scanBoundaries (const uint8_t* in, size_t in_size, bool gzip) {
+        std::vector<Boundary> found;
+        const uint8_t* end = in + in_size;
+        if (gzip) {
+            for (const uint8_t* p = in; (p = (const uint8_t*)std::memchr(p, 0x1f, end - p)) != nullptr; p++) {
+                if (end - p >= 18 && p[1] == 0x8b && p[2] == 8 && !(p[3] & 0xe0)) {
+                    found.push_back({(size_t)(p - in), true});
+                }
+            }
         }
+        // 00 00 ff ff is the len and nlen of an empty stored block, the next block starts right after it
+        for (const uint8_t* p = in + std::min(in_size, (size_t)2); (p = (const uint8_t*)std::memchr(p, 0xff, end - p)) != nullptr; p++) {
+            if (end - p >= 2 && p[1] == 0xff && p[-1] == 0 && p[-2] == 0) {
+                found.push_back({(size_t)(p + 2 - in), false});
+            }
+        }
+        std::sort(found.begin(), found.end(), [](const Boundary& a, const Boundary& b) {
+            return a.offset < b.offset;
+        });
+        return found;
     }
 
-    static size_t realDecompress (std::function<Bitwrapper&()> getData, std::function<void(std::vector<uint8_t>&, size_t)> writeData) {
-        size_t out_size = 0;
-        //creating default huffman tree
-        std::vector <Code> fixed_codes = generateFixedCodes();
-        std::vector <Code> fixed_dist_codes = generateFixedDistanceCodes();
-        FlatHuffmanTree fixed_huffman(fixed_codes);
-        FlatHuffmanTree fixed_dist_huffman(fixed_dist_codes);
-        std::vector<uint8_t> buffer;
-        size_t it = 0;
+    // decodes from boundaries[i] until a block or a member starts exactly on a later boundary, or the stream ends
+    // speculative pieces start with an empty window, so a match reaching back before them throws, and give up at the first
+    // boundary they go past without landing on it, the serial redo gets the real history and carries on past false ones
+    static void decodeSegment (const uint8_t* in, size_t in_size, Format format, const std::vector<Boundary>& boundaries, size_t i, const std::vector<uint8_t>& history, bool speculative, Segment& segment, Tables& tables) {
+        const Boundary& start = boundaries[i];
+        size_t count = boundaries.size();
+        segment = Segment();
+        segment.out.reserve(std::min((i + 1 < count ? boundaries[i + 1].offset : in_size) - start.offset, (size_t)1 << 26) * 4);
+        Bitreader<NoSource> dat(in + start.offset, in_size - start.offset);
+        deflate_io::VectorSink sink(segment.out);
+        Window<deflate_io::VectorSink> window(&sink, 4 * KB32, deflate_memory::defaultResource());
+        window.preset(history.data(), history.size());
+        size_t next = i + 1;
+        bool passed = false;
+        auto landed = [&](bool member) {
+            uint64_t bits = (uint64_t)start.offset * 8 + dat.position();
+            while (next < count && (uint64_t)boundaries[next].offset * 8 < bits) {
+                next++;
+                passed = passed || speculative;
+            }
+            return next < count && (uint64_t)boundaries[next].offset * 8 == bits && boundaries[next].member == member;
+        };
+        bool header = start.member;
         while (true) {
-            Bitwrapper& dat = getData();
-            uint8_t final = dat.readBits(1);
-            uint8_t type = dat.readBits(2);
-            FlatHuffmanTree used_tree = fixed_huffman;
-            FlatHuffmanTree used_dist = fixed_dist_huffman;
+            if (header) {
+                readGzipHeader(dat, nullptr);
+            }
+            bool final = decodeBlocks(dat, window, tables, [&]() {
+                return !landed(false) && !passed;
+            });
+            if (!final) {
+                break;
+            }
+            if (format == RAW) {
+                next = count;
+                break;
+            }
+            dat.alignToByte();
+            uint32_t crc = dat.readBits(32);
+            uint32_t size = dat.readBits(32);
+            dat.checkOverrun();
+            window.flush();
+            segment.members.push_back({segment.out.size(), crc, size});
+            if (dat.exhausted()) {
+                next = count;
+                break;
+            }
+            if (landed(true) || passed) {
+                break;
+            }
+            header = true;
+        }
+        window.flush();
+        segment.next = next;
+        segment.ok = !passed;
+    }
+
+    // the last 32K of output the chain of pieces has so far, for a piece that has to be redone with its history
+    static void chainWindow (const std::vector<Segment>& segments, const std::vector<size_t>& chain, std::vector<uint8_t>& window) {
+        window.clear();
+        for (size_t c = chain.size(); c-- > 0 && window.size() < KB32;) {
+            const std::vector<uint8_t>& out = segments[chain[c]].out;
+            size_t take = std::min(out.size(), KB32 - window.size());
+            window.insert(window.begin(), out.end() - take, out.end());
+        }
+    }
+
+    // splits at boundaries, decodes the pieces speculatively in parallel and then walks them from the start,
+    // each piece counts only once the checked one before it ended exactly where it starts, any other gets redone serially
+    // gzip members are checked against their crc and size once everything is in place, also in parallel
+    static std::vector<uint8_t> realDecompressParallel (const uint8_t* in, size_t in_size, Format format, size_t threads) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        std::vector<Boundary> found;
+        if (format == GZIP) {
+            found = bgzfBoundaries(in, in_size);
+        }
+        if (found.empty()) {
+            found = scanBoundaries(in, in_size, format == GZIP);
+        }
+        // a few pieces a thread so they even out, but not so small that starting one costs more than it decodes
+        size_t spacing = std::max(in_size / (threads * 4), (size_t)64 * 1024);
+        std::vector<Boundary> boundaries = {{0, format == GZIP}};
+        for (const Boundary& b : found) {
+            if (b.offset >= boundaries.back().offset + spacing && b.offset < in_size) {
+                boundaries.push_back(b);
+            }
+        }
+        std::vector<Segment> segments(boundaries.size());
+        const std::vector<uint8_t> none;
+        parallelItems(boundaries.size(), threads, [&]() {
+            return Tables(deflate_memory::defaultResource());
+        }, [&](Tables& tables, size_t i) {
+            try {
+                decodeSegment(in, in_size, format, boundaries, i, none, true, segments[i], tables);
+            } catch (const std::exception&) {
+                segments[i].ok = false;
+            }
+        });
+
+        Tables tables(deflate_memory::defaultResource());
+        std::vector<size_t> chain;
+        std::vector<uint8_t> history;
+        for (size_t i = 0; i < boundaries.size(); i = segments[i].next) {
+            if (!segments[i].ok) {
+                chainWindow(segments, chain, history);
+                decodeSegment(in, in_size, format, boundaries, i, history, false, segments[i], tables);
+            }
+            chain.push_back(i);
+        }
+
+        std::vector<size_t> offsets(chain.size() + 1, 0);
+        std::vector<MemberEnd> members;
+        for (size_t c = 0; c < chain.size(); c++) {
+            for (const MemberEnd& member : segments[chain[c]].members) {
+                members.push_back({offsets[c] + member.end, member.crc, member.size});
+            }
+            offsets[c + 1] = offsets[c] + segments[chain[c]].out.size();
+        }
+        std::vector<uint8_t> out(offsets.back());
+        parallelItems(chain.size(), threads, []() {
+            return 0;
+        }, [&](int&, size_t c) {
+            std::vector<uint8_t>& piece = segments[chain[c]].out;
+            std::memcpy(out.data() + offsets[c], piece.data(), piece.size());
+            std::vector<uint8_t>().swap(piece);
+        });
+        std::atomic<bool> bad_crc(false);
+        std::atomic<bool> bad_size(false);
+        parallelItems(members.size(), threads, []() {
+            return 0;
+        }, [&](int&, size_t m) {
+            size_t begin = (m == 0) ? 0 : members[m - 1].end;
+            if (deflate_cpu::kernels().crc32(0, out.data() + begin, members[m].end - begin) != members[m].crc) {
+                bad_crc = true;
+            }
+            if ((uint32_t)(members[m].end - begin) != members[m].size) {
+                bad_size = true;
+            }
+        });
+        if (bad_crc) {
+            throw std::runtime_error("Gzip crc doesn't match the data!");
+        }
+        if (bad_size) {
+            throw std::runtime_error("Gzip size doesn't match the data!");
+        }
+        return out;
+    }
+
+    // a piece of one stream decoded from a block start that was searched for, before the 32K ahead of it is known
+    // marked is its output up to where that window stopped mattering, values under 256 are bytes and 256 + i is byte i
+    // of the unknown window, bytes is everything after that, decoded the normal way
+    struct Speculation {
+        uint64_t start = 0; // bit offsets, start is a block header and so is end unless it's past the final block
+        uint64_t end = 0;
+        std::vector<uint16_t> marked;
+        std::vector<uint8_t> bytes;
+        bool final = false;
+        bool ok = false;
+    };
+
+    // 57 bits or more from any bit of in, zeros past the end
+    static uint64_t peekBits (const uint8_t* in, size_t in_size, uint64_t bit) {
+        size_t at = (size_t)(bit / 8);
+        uint64_t v = 0;
+        if (at + 8 <= in_size) {
+            std::memcpy(&v, in + at, 8);
+            return v >> (bit % 8);
+        }
+        for (size_t i = 0; at + i < in_size; i++) {
+            v |= (uint64_t)in[at + i] << (8 * i);
+        }
+        return v >> (bit % 8);
+    }
+
+    // the literal/length loop for when the window isn't known yet, a match reaching back before the start copies markers
+    // last_marker is kept one past the last marker written, so the caller can tell when the window stopped mattering
+    template <typename In>
+    static void decodeSymbolsMarked (In& in, std::vector<uint16_t>& out, size_t& last_marker, const DecodeTable& lit, const DecodeTable& dist) {
+        while (true) {
+            in.refill();
+            uint32_t e = lit.lookup(in.peek());
+            if (e & DecodeTable::invalid) {
+                throw std::runtime_error("Invalid literal/length code!");
+            }
+            in.consume((e >> 16) & 0xff);
+            uint32_t sym = e & 0xffff;
+            if (sym < 256) {
+                out.push_back((uint16_t)sym);
+                continue;
+            }
+            if (sym == 256) {
+                break;
+            }
+            sym -= 257;
+            if (sym >= 29) {
+                throw std::runtime_error("Invalid length code!");
+            }
+            uint32_t length = length_base[sym] + in.readBits(length_extra[sym]);
+            e = dist.lookup(in.peek());
+            if (e & DecodeTable::invalid) {
+                throw std::runtime_error("Invalid distance code!");
+            }
+            in.consume((e >> 16) & 0xff);
+            sym = e & 0xffff;
+            if (sym >= 30) {
+                throw std::runtime_error("Invalid distance code!");
+            }
+            uint32_t distance = dist_base[sym] + in.readBits(dist_extra[sym]);
+            size_t pos = out.size();
+            if (distance > pos + KB32) {
+                throw std::runtime_error("Match distance reaches back before the start of the data!");
+            }
+            for (uint32_t i = 0; i < length; i++, pos++) {
+                uint16_t v = (distance <= pos) ? out[pos - distance] : (uint16_t)(256 + KB32 - (distance - pos));
+                if (v >= 256) {
+                    last_marker = pos + 1;
+                }
+                out.push_back(v);
+            }
+        }
+    }
+
+    // decodeBlocks for when the window isn't known yet, see decodeSymbolsMarked
+    template <typename In, typename Visit>
+    static bool decodeBlocksMarked (In& data, std::vector<uint16_t>& out, size_t& last_marker, Tables& tables, Visit&& visit) {
+        std::vector<uint8_t> stored;
+        while (true) {
+            if (!visit()) {
+                return false;
+            }
+            uint32_t final = data.readBits(1);
+            uint32_t type = data.readBits(2);
             switch (type) {
                 case 0:
                 {
-                    dat.moveByte(true);
-                    uint16_t len = dat.readBits(16);
-                    uint16_t nlen = dat.readBits(16);
-                    for (size_t i = 0; i < len; i++) {
-                        buffer.push_back(dat.readByte());
-                        out_size++;
+                    data.alignToByte();
+                    uint32_t len = data.readBits(16);
+                    uint32_t nlen = data.readBits(16);
+                    if ((len ^ 0xffff) != nlen) {
+                        throw std::runtime_error("Stored block length doesn't match its complement!");
                     }
+                    stored.resize(len);
+                    data.readBytes(stored.data(), len);
+                    out.insert(out.end(), stored.begin(), stored.end());
                 }
                 break;
-                case 2:
-                    {
-                        std::pair<FlatHuffmanTree, FlatHuffmanTree> trees = decodeTree(dat);
-                        used_tree = trees.first;
-                        used_dist = trees.second;
-                    }
                 case 1:
-                    decompressHuffmanBlock(dat, buffer, used_tree, used_dist);
+                    decodeSymbolsMarked(data, out, last_marker, fixedLiteralTable(), fixedDistanceTable());
+                break;
+                case 2:
+                    readDynamicTables(data, tables);
+                    decodeSymbolsMarked(data, out, last_marker, tables.lit, tables.dist);
                 break;
+                default:
+                    throw std::runtime_error("Invalid block type!");
             }
-            out_size += buffer.size();
-            writeData(buffer, it);
-            it = buffer.size();
+            data.checkOverrun();
             if (final) {
+                return true;
+            }
+        }
+    }
+
+    // whether a dynamic block header could start at bit, without building tables or throwing
+    // the fixed fields, the precode's kraft sum and then the code lengths it gives, both codes have to be complete
+    // or a single code, the same as DecodeTable::build accepts
+    static bool plausibleHeader (const uint8_t* in, size_t in_size, uint64_t bit) {
+        uint64_t v = peekBits(in, in_size, bit);
+        if ((v & 6) != 4 || ((v >> 3) & 31) > 29 || ((v >> 8) & 31) > 29) {
+            return false;
+        }
+        uint32_t hlit = (uint32_t)((v >> 3) & 31) + 257;
+        uint32_t hdist = (uint32_t)((v >> 8) & 31) + 1;
+        uint32_t hclen = (uint32_t)((v >> 13) & 15) + 4;
+        uint64_t precode = peekBits(in, in_size, bit + 17);
+        // the kraft sum goes first, four lengths a lookup, most bits that get this far fail it
+        static const std::vector<uint16_t> sums = []() {
+            std::vector<uint16_t> t(4096);
+            for (uint32_t x = 0; x < 4096; x++) {
+                uint32_t kraft = 0;
+                uint32_t used = 0;
+                for (uint32_t i = 0; i < 4; i++) {
+                    uint32_t len = (x >> (3 * i)) & 7;
+                    if (len > 0) {
+                        kraft += 128 >> len;
+                        used++;
+                    }
+                }
+                t[x] = (uint16_t)(kraft | (used << 10));
+            }
+            return t;
+        }();
+        if (hclen < 19) {
+            precode &= (1ull << (3 * hclen)) - 1;
+        }
+        uint32_t sum = 0;
+        for (uint32_t i = 0; i < 5; i++) {
+            sum += sums[(precode >> (12 * i)) & 4095];
+        }
+        uint32_t kraft = sum & 1023;
+        uint32_t used = sum >> 10;
+        if (kraft != 128 && (used != 1 || kraft > 128)) {
+            return false;
+        }
+        uint8_t precode_lens[19] = {0};
+        for (uint32_t i = 0; i < hclen; i++) {
+            precode_lens[precode_order[i]] = (uint8_t)((precode >> (3 * i)) & 7);
+        }
+        // canonical codes for the precode, looked up by the next 7 bits reversed
+        uint8_t table_sym[128];
+        uint8_t table_len[128] = {0};
+        uint32_t code = 0;
+        for (uint32_t len = 1; len <= 7; len++) {
+            for (uint32_t sym = 0; sym < 19; sym++) {
+                if (precode_lens[sym] != len) {
+                    continue;
+                }
+                uint32_t reversed = 0;
+                for (uint32_t b = 0; b < len; b++) {
+                    reversed |= ((code >> b) & 1) << (len - 1 - b);
+                }
+                for (uint32_t index = reversed; index < 128; index += 1u << len) {
+                    table_sym[index] = (uint8_t)sym;
+                    table_len[index] = (uint8_t)len;
+                }
+                code++;
+            }
+            code <<= 1;
+        }
+        uint8_t lens[288 + 32] = {0};
+        uint64_t at = bit + 17 + 3 * hclen;
+        uint32_t total = hlit + hdist;
+        for (uint32_t i = 0; i < total;) {
+            uint64_t w = peekBits(in, in_size, at);
+            uint32_t len = table_len[w & 127];
+            if (len == 0) {
+                return false;
+            }
+            uint32_t sym = table_sym[w & 127];
+            w >>= len;
+            at += len;
+            if (sym < 16) {
+                lens[i++] = (uint8_t)sym;
+                continue;
+            }
+            uint8_t value = 0;
+            uint32_t repeat;
+            if (sym == 16) {
+                if (i == 0) {
+                    return false;
+                }
+                value = lens[i - 1];
+                repeat = 3 + (uint32_t)(w & 3);
+                at += 2;
+            } else if (sym == 17) {
+                repeat = 3 + (uint32_t)(w & 7);
+                at += 3;
+            } else {
+                repeat = 11 + (uint32_t)(w & 127);
+                at += 7;
+            }
+            if (i + repeat > total) {
+                return false;
+            }
+            std::fill(lens + i, lens + i + repeat, value);
+            i += repeat;
+        }
+        if (at > (uint64_t)in_size * 8 || lens[256] == 0) {
+            return false;
+        }
+        auto complete = [&](uint32_t first, uint32_t count) {
+            uint32_t sum = 0;
+            uint32_t codes = 0;
+            for (uint32_t i = first; i < first + count; i++) {
+                if (lens[i] > 0) {
+                    sum += (1u << 15) >> lens[i];
+                    codes++;
+                }
+            }
+            return sum == (1u << 15) || (sum < (1u << 15) && codes <= 1);
+        };
+        return complete(0, hlit) && complete(hlit, hdist);
+    }
+
+    // the first bit in [from, to) where a dynamic block header is valid and complete and its whole block decodes
+    // with the window unknown, UINT64_MAX when there isn't one
+    // stored and fixed blocks are never looked for, there's too little in their headers to tell them from noise
+    static uint64_t findBlock (const uint8_t* in, size_t in_size, uint64_t from, uint64_t to, Tables& tables) {
+        std::vector<uint16_t> scratch;
+        for (uint64_t bit = from; bit < to; bit++) {
+            if (!plausibleHeader(in, in_size, bit)) {
+                continue;
+            }
+            try {
+                Bitreader<NoSource> dat(in + bit / 8, in_size - (size_t)(bit / 8));
+                dat.readBits(bit % 8 + 3);
+                readDynamicTables(dat, tables);
+                size_t last_marker = 0;
+                scratch.clear();
+                decodeSymbolsMarked(dat, scratch, last_marker, tables.lit, tables.dist);
+                dat.checkOverrun();
+                return bit;
+            } catch (const std::runtime_error&) {
+            }
+        }
+        return UINT64_MAX;
+    }
+
+    // decodes blocks from piece.start until stop says so at a block start, or through the final block
+    // with history it's a normal decode, without it the output stays marked until the last 32K of it has no markers
+    // and then it carries on as bytes
+    template <typename Stop>
+    static void decodePiece (const uint8_t* in, size_t in_size, Speculation& piece, const std::vector<uint8_t>* history, Stop&& stop, Tables& tables) {
+        size_t first = (size_t)(piece.start / 8);
+        Bitreader<NoSource> dat(in + first, in_size - first);
+        dat.readBits(piece.start % 8);
+        auto going = [&]() {
+            return !stop((uint64_t)first * 8 + dat.position());
+        };
+        bool final = false;
+        std::vector<uint8_t> recent;
+        if (history == nullptr) {
+            size_t last_marker = 0;
+            final = decodeBlocksMarked(dat, piece.marked, last_marker, tables, [&]() {
+                return going() && piece.marked.size() - last_marker < KB32;
+            });
+            size_t keep = std::min(piece.marked.size(), (size_t)KB32);
+            for (size_t i = piece.marked.size() - keep; i < piece.marked.size(); i++) {
+                recent.push_back((uint8_t)piece.marked[i]);
+            }
+            history = &recent;
+        }
+        if (!final && going()) {
+            deflate_io::VectorSink sink(piece.bytes);
+            Window<deflate_io::VectorSink> window(&sink, 4 * KB32, deflate_memory::defaultResource());
+            window.preset(history->data(), history->size());
+            final = decodeBlocks(dat, window, tables, going);
+            window.flush();
+        }
+        piece.end = (uint64_t)first * 8 + dat.position();
+        piece.final = final;
+    }
+
+    // markers point into the 32K before the piece, window is the end of that, shorter when the stream started less than 32K back
+    static void resolveMarkers (const uint16_t* marked, size_t n, const std::vector<uint8_t>& window, uint8_t* out) {
+        size_t missing = KB32 - window.size();
+        for (size_t i = 0; i < n; i++) {
+            uint32_t v = marked[i];
+            if (v < 256) {
+                out[i] = (uint8_t)v;
+                continue;
+            }
+            if (v - 256 < missing) {
+                throw std::runtime_error("Match distance reaches back before the start of the data!");
+            }
+            out[i] = window[v - 256 - missing];
+        }
+    }
+
+    // window becomes the last 32K of itself followed by the piece's output, only the markers that end up in it get resolved
+    static void advanceWindow (std::vector<uint8_t>& window, const Speculation& piece) {
+        size_t keep = std::min(window.size() + piece.marked.size() + piece.bytes.size(), (size_t)KB32);
+        std::vector<uint8_t> next(keep);
+        size_t at = keep;
+        size_t n = std::min(at, piece.bytes.size());
+        if (n > 0) {
+            std::memcpy(next.data() + at - n, piece.bytes.data() + piece.bytes.size() - n, n);
+        }
+        at -= n;
+        n = std::min(at, piece.marked.size());
+        resolveMarkers(piece.marked.data() + piece.marked.size() - n, n, window, next.data() + at - n);
+        at -= n;
+        if (at > 0) {
+            std::memcpy(next.data(), window.data() + window.size() - at, at);
+        }
+        window.swap(next);
+    }
+
+    // pugz/rapidgzip style, the input is cut into pieces and each one past the first searches for a block start and decodes
+    // from there with the window unknown, all in parallel
+    // a serial walk then keeps a piece only when the checked one before it stopped exactly where it starts,
+    // rolling the 32K window forward, anything else gets decoded serially from where the walk is with the real window
+    // the markers are filled in from each piece's window at the end, in parallel again, end_bit is where the final block ended
+    static std::vector<uint8_t> realDecompressSpeculative (const uint8_t* in, size_t in_size, uint64_t start_bit, size_t threads, uint64_t& end_bit, SpeculationReport* report) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        size_t first = (size_t)(start_bit / 8);
+        // a couple of pieces a thread, but big enough that the marked stretch at the start of each stays a small part of it
+        size_t chunk = std::max((in_size - first) / (threads * 2), (size_t)128 * 1024);
+        size_t count = std::max((size_t)1, (in_size - first + chunk - 1) / chunk);
+        std::vector<uint64_t> found(count, UINT64_MAX);
+        found[0] = start_bit;
+        parallelItems(count - 1, threads, [&]() {
+            return Tables(deflate_memory::defaultResource());
+        }, [&](Tables& tables, size_t i) {
+            size_t k = i + 1;
+            found[k] = findBlock(in, in_size, (uint64_t)(first + k * chunk) * 8, (uint64_t)std::min(in_size, first + (k + 1) * chunk) * 8, tables);
+        });
+        std::vector<Speculation> pieces;
+        for (uint64_t bit : found) {
+            if (bit != UINT64_MAX) {
+                pieces.emplace_back();
+                pieces.back().start = bit;
+            }
+        }
+        const std::vector<uint8_t> none;
+        parallelItems(pieces.size(), threads, [&]() {
+            return Tables(deflate_memory::defaultResource());
+        }, [&](Tables& tables, size_t i) {
+            Speculation& piece = pieces[i];
+            uint64_t target = (i + 1 < pieces.size()) ? pieces[i + 1].start : UINT64_MAX;
+            try {
+                decodePiece(in, in_size, piece, (i == 0) ? &none : nullptr, [&](uint64_t bits) {
+                    return bits >= target;
+                }, tables);
+                piece.ok = piece.final || piece.end == target;
+            } catch (const std::exception&) {
+                piece.ok = false;
+            }
+        });
+
+        // every redo lands on a later piece or finishes the stream, so there can't be more of them than pieces
+        std::vector<Speculation> redone;
+        redone.reserve(pieces.size() + 1);
+        std::vector<const Speculation*> chain;
+        std::vector<std::vector<uint8_t>> windows;
+        std::vector<uint8_t> window;
+        Tables tables(deflate_memory::defaultResource());
+        uint64_t pos = start_bit;
+        size_t k = 0;
+        while (true) {
+            while (k < pieces.size() && pieces[k].start < pos) {
+                k++;
+            }
+            const Speculation* piece = nullptr;
+            if (k < pieces.size() && pieces[k].ok && pieces[k].start == pos) {
+                piece = &pieces[k];
+                if (report) {
+                    (k == 0 ? report->first : report->accepted)++;
+                }
+            } else {
+                if (report) {
+                    report->redone++;
+                }
+                redone.emplace_back();
+                Speculation& redo = redone.back();
+                redo.start = pos;
+                size_t j = k;
+                decodePiece(in, in_size, redo, &window, [&](uint64_t bits) {
+                    while (j < pieces.size() && pieces[j].start < bits) {
+                        j++;
+                    }
+                    return bits > pos && j < pieces.size() && pieces[j].ok && pieces[j].start == bits;
+                }, tables);
+                piece = &redo;
+            }
+            chain.push_back(piece);
+            windows.push_back(window);
+            advanceWindow(window, *piece);
+            if (piece->final) {
+                end_bit = piece->end;
                 break;
             }
+            pos = piece->end;
+        }
+
+        std::vector<size_t> offsets(chain.size() + 1, 0);
+        for (size_t c = 0; c < chain.size(); c++) {
+            offsets[c + 1] = offsets[c] + chain[c]->marked.size() + chain[c]->bytes.size();
         }
-        return out_size;
+        std::vector<uint8_t> out(offsets.back());
+        parallelItems(chain.size(), threads, []() {
+            return 0;
+        }, [&](int&, size_t c) {
+            const Speculation& piece = *chain[c];
+            resolveMarkers(piece.marked.data(), piece.marked.size(), windows[c], out.data() + offsets[c]);
+            if (!piece.bytes.empty()) {
+                std::memcpy(out.data() + offsets[c] + piece.marked.size(), piece.bytes.data(), piece.bytes.size());
+            }
+        });
+        return out;
     }
 
     public:
+    using deflate_compressor::BatchItem;
+    using deflate_compressor::GzipHeader;
+    using deflate_compressor::SeekTable;
+    using deflate_compressor::Stats;
+
+    // checkpoints into a compressed stream, so a range of its output can be decoded without starting from the top, like zlib's zran
+    // each one sits on a block boundary and keeps the 32K of output before it, which is everything the decoder needs to pick up there
+    // the windows are stored as they are, 32K a checkpoint, so a 1mb span makes an index about 3% the size of the output
+    struct Index {
+        struct Point {
+            uint64_t in_bits = 0; // where the block starts, in bits from the start of the compressed data
+            uint64_t out = 0; // how much output comes before it
+            std::vector<uint8_t> window;
+        };
+        Format format = RAW;
+        uint64_t in_size = 0;
+        uint64_t out_size = 0;
+        std::vector<Point> points;
+
+        // little endian, "DFIX" and a version byte, then the format, sizes and each point with its window
+        std::vector<uint8_t> serialize () const {
+            std::vector<uint8_t> bytes = {'D', 'F', 'I', 'X', 1, (uint8_t)format};
+            auto put = [&](uint64_t v, int n) {
+                for (int i = 0; i < n; i++) {
+                    bytes.push_back((uint8_t)(v >> (8 * i)));
+                }
+            };
+            put(in_size, 8);
+            put(out_size, 8);
+            put(points.size(), 8);
+            for (const Point& point : points) {
+                put(point.in_bits, 8);
+                put(point.out, 8);
+                put(point.window.size(), 4);
+                bytes.insert(bytes.end(), point.window.begin(), point.window.end());
+            }
+            return bytes;
+        }
 
-    static size_t decompressZlib (void* in, size_t in_size, void* out, size_t out_size) {
-        // idc about zlib data :)
-        uint32_t change = 2;
-        uint8_t v = extract1BitLeft(*(uint8_t*)in + 1, 5);
-        // fdict set, skip the other four bytes with the checksum
-        if (v) {
-            change = 6;
+        static Index deserialize (const void* data, size_t size) {
+            const uint8_t* bytes = (const uint8_t*)data;
+            if (size < 6 || std::memcmp(bytes, "DFIX", 4) != 0 || bytes[4] != 1 || bytes[5] > GZIP) {
+                throw std::runtime_error("Not a deflate index!");
+            }
+            size_t at = 6;
+            auto get = [&](size_t n) -> uint64_t {
+                if (size - at < n) {
+                    throw std::runtime_error("Truncated deflate index!");
+                }
+                uint64_t v = 0;
+                for (size_t i = 0; i < n; i++) {
+                    v |= (uint64_t)bytes[at + i] << (8 * i);
+                }
+                at += n;
+                return v;
+            };
+            Index index;
+            index.format = (Format)bytes[5];
+            index.in_size = get(8);
+            index.out_size = get(8);
+            uint64_t count = get(8);
+            // every point is at least 20 bytes, so a bad count can't reserve more than the data could hold
+            if (count > (size - at) / 20) {
+                throw std::runtime_error("Truncated deflate index!");
+            }
+            index.points.resize(count);
+            for (uint64_t i = 0; i < count; i++) {
+                Point& point = index.points[i];
+                point.in_bits = get(8);
+                point.out = get(8);
+                size_t n = get(4);
+                if (n > KB32 || n > point.out || size - at < n || point.in_bits > index.in_size * 8 || point.out > index.out_size) {
+                    throw std::runtime_error("Corrupt deflate index!");
+                }
+                if (i > 0 && (point.out < index.points[i - 1].out || point.in_bits <= index.points[i - 1].in_bits)) {
+                    throw std::runtime_error("Corrupt deflate index!");
+                }
+                point.window.assign(bytes + at, bytes + at + n);
+                at += n;
+            }
+            return index;
+        }
+
+        // the sidecar file is just the serialized index
+        void save (std::string file_path) const {
+            std::vector<uint8_t> bytes = serialize();
+            std::ofstream f(file_path, std::ios::binary);
+            f.write((const char*)bytes.data(), bytes.size());
+            if (!f) {
+                throw std::runtime_error("Couldn't write the index file!");
+            }
         }
-        return decompress((char*)in + change, in_size - change, out, out_size);
+
+        static Index load (std::string file_path) {
+            std::ifstream f(file_path, std::ios::binary);
+            if (!f) {
+                throw std::runtime_error("Couldn't open the index file!");
+            }
+            f.seekg(0, std::ios::end);
+            std::vector<uint8_t> bytes((size_t)f.tellg());
+            f.seekg(0);
+            f.read((char*)bytes.data(), bytes.size());
+            return deserialize(bytes.data(), bytes.size());
+        }
+    };
+
+    // reusable decompressor, the window and decode tables are made once and after the first call nothing touches the heap,
+    // apart from the vector overload growing its result
+    // it isn't synchronized, give each thread its own, and a per thread pool can go in as mem
+    class Decompressor {
+        private:
+        // either the caller's buffer or their vector, whichever the last call was given
+        struct Output {
+            uint8_t* data = nullptr;
+            size_t cap = 0;
+            size_t size = 0;
+            std::vector<uint8_t>* vector = nullptr;
+            void write (const uint8_t* bytes, size_t n) {
+                if (vector) {
+                    vector->insert(vector->end(), bytes, bytes + n);
+                    return;
+                }
+                if (n > cap - size) {
+                    throw std::runtime_error("Output buffer too small for decompressed data!");
+                }
+                std::memcpy(data + size, bytes, n);
+                size += n;
+            }
+        };
+        Tables tables;
+        Output output;
+        Window<Output> window;
+
+        void count (const Bitreader<NoSource>& dat) {
+            if (tables.stats) {
+                tables.stats->bytes_in += (dat.position() + 7) / 8;
+                tables.stats->bytes_out += window.size();
+            }
+        }
+        public:
+        Decompressor (std::pmr::memory_resource* mem = deflate_memory::defaultResource()) : tables(mem), window(&output, 4 * KB32, mem) {
+        }
+        // the window points back at this one's output
+        Decompressor (const Decompressor&) = delete;
+        Decompressor& operator= (const Decompressor&) = delete;
+
+        // every call from here on adds its counters to stats, nullptr stops counting, see Stats
+        void setStats (Stats* stats) {
+            tables.stats = stats;
+            window.stats = stats;
+        }
+
+        // decompresses straight into out, returns the bytes written
+        // throws if the data doesn't fit in out_cap
+        size_t decompress (const void* in, size_t in_size, void* out, size_t out_cap) {
+            Bitreader<NoSource> dat(in, in_size);
+            output = Output();
+            output.data = (uint8_t*)out;
+            output.cap = out_cap;
+            window.reset();
+            realDecompress(dat, window, tables);
+            count(dat);
+            return output.size;
+        }
+
+        // replaces the contents of out, passing the same vector in every time reuses its capacity
+        void decompress (const void* in, size_t in_size, std::vector<uint8_t>& out) {
+            Bitreader<NoSource> dat(in, in_size);
+            out.clear();
+            output = Output();
+            output.vector = &out;
+            window.reset();
+            realDecompress(dat, window, tables);
+            count(dat);
+            output.vector = nullptr;
+        }
+
+        // raw deflate that was compressed against a preset dictionary, it has to be the exact same bytes
+        size_t decompress (const void* in, size_t in_size, void* out, size_t out_cap, const void* dictionary, size_t dictionary_size) {
+            Bitreader<NoSource> dat(in, in_size);
+            output = Output();
+            output.data = (uint8_t*)out;
+            output.cap = out_cap;
+            window.reset();
+            window.preset((const uint8_t*)dictionary, dictionary_size);
+            realDecompress(dat, window, tables);
+            count(dat);
+            return output.size;
+        }
+
+        // one chunk of a seekable stream into out, in is the whole stream, see deflate::compressSeekable
+        // the chunk starts with an empty window and decoding stops at the block boundary where its bytes are all out
+        size_t decompressChunk (const void* in, size_t in_size, const SeekTable::Chunk& chunk, void* out, size_t out_cap) {
+            if (chunk.in_offset > in_size || chunk.in_size > in_size - chunk.in_offset) {
+                throw std::runtime_error("Seek table doesn't fit the data!");
+            }
+            Bitreader<NoSource> dat((const uint8_t*)in + chunk.in_offset, chunk.in_size);
+            output = Output();
+            output.data = (uint8_t*)out;
+            output.cap = out_cap;
+            window.reset();
+            decodeBlocks(dat, window, tables, [&]() {
+                return window.size() < chunk.out_size;
+            });
+            window.flush();
+            if (output.size != chunk.out_size) {
+                throw std::runtime_error("Seek table doesn't fit the data!");
+            }
+            count(dat);
+            return output.size;
+        }
+    };
+
+    // decompresses every item on its own into its out buffer, spread over threads workers (0 means one per core)
+    // each worker keeps one Decompressor for all of its items, an item whose data doesn't fit in out_cap fails
+    // returns how many items failed, their error says why
+    // the threads and decompressors only last for the call, a BatchDecompressor keeps them for batch after batch
+    static size_t decompressBatch (BatchItem items[], size_t count, size_t threads = 0) {
+        parallelItems(count, threads, [&]() {
+            return Decompressor();
+        }, [&](Decompressor& decompressor, size_t i) {
+            BatchItem& item = items[i];
+            runBatchItem(item, [&]() {
+                return decompressor.decompress(item.in, item.in_size, item.out, item.out_cap);
+            });
+        });
+        return failedItems(items, count);
+    }
+    static size_t decompressBatch (std::vector<BatchItem>& items, size_t threads = 0) {
+        return decompressBatch(items.data(), items.size(), threads);
+    }
+
+    // decompressBatch with its threads and their Decompressors made once in the constructor and reused by every decompress call
+    // one batch at a time, it isn't synchronized against itself
+    class BatchDecompressor {
+    private:
+        WorkerPool<Decompressor> pool;
+    public:
+        BatchDecompressor (size_t threads = 0) : pool(threads) {
+        }
+
+        // returns how many items failed, their error says why
+        size_t decompress (BatchItem items[], size_t count) {
+            pool.run(count, [&](Decompressor& decompressor, size_t i) {
+                BatchItem& item = items[i];
+                runBatchItem(item, [&]() {
+                    return decompressor.decompress(item.in, item.in_size, item.out, item.out_cap);
+                });
+            });
+            return failedItems(items, count);
+        }
+        size_t decompress (std::vector<BatchItem>& items) {
+            return decompress(items.data(), items.size());
+        }
+
+        // workers with the calling thread included, fewer than asked for if a thread couldn't be started
+        size_t threads () const {
+            return pool.threads();
+        }
+    };
+
+    // zlib (rfc 1950), the header is validated and the adler-32 checked against the whole output
+    // anything past out_size is dropped, the same as decompress, returns the bytes written
+    static size_t decompressZlib (const void* in, size_t in_size, void* out, size_t out_size) {
+        Bitreader<NoSource> dat(in, in_size);
+        uint8_t* out_data = (uint8_t*)out;
+        size_t it = 0;
+        deflate_memory::Arena arena;
+        deflate_io::CallbackSink sink([&](const uint8_t* data, size_t n) -> void {
+            size_t take = std::min(n, out_size - it);
+            std::memcpy(out_data + it, data, take);
+            it += take;
+        });
+        realDecompressZlib(dat, sink, &arena);
+        return it;
+    }
+
+    template <typename Source, typename Sink>
+    static size_t decompressZlibSource (Source& source, Sink& sink) {
+        deflate_memory::Arena arena;
+        std::pmr::vector<uint8_t> piece(KB32, &arena);
+        Bitreader<Source> dat(nullptr, 0, &source, piece.data(), piece.size());
+        return realDecompressZlib(dat, sink, &arena);
+    }
+
+    // any source and sink, see io.hpp, returns the decompressed size
+    template <typename Source, typename Sink>
+    static size_t decompressSource (Source& source, Sink& sink) {
+        deflate_memory::Arena arena;
+        std::pmr::vector<uint8_t> piece(KB32, &arena);
+        Bitreader<Source> dat(nullptr, 0, &source, piece.data(), piece.size());
+        Window<Sink> window(&sink, 4 * KB32, &arena);
+        Tables tables(&arena);
+        return realDecompress(dat, window, tables);
+    }
+
+    // gzip (rfc 1952), every member is decoded and checked against its crc-32 and size, returns the total decompressed size
+    // header, when given, gets the fields of the first member
+    template <typename Source, typename Sink>
+    static size_t decompressGzipSource (Source& source, Sink& sink, GzipHeader* header = nullptr) {
+        deflate_memory::Arena arena;
+        std::pmr::vector<uint8_t> piece(KB32, &arena);
+        Bitreader<Source> dat(nullptr, 0, &source, piece.data(), piece.size());
+        return realDecompressGzip(dat, sink, &arena, header);
+    }
+
+    static std::vector<uint8_t> decompressGzip (const void* in, size_t in_size, GzipHeader* header = nullptr) {
+        Bitreader<NoSource> dat(in, in_size);
+        std::vector<uint8_t> out;
+        // the last member ends with its size, which is the whole output when there's only one
+        // deflate can't do better than about 1032:1, so a bogus size can't make this reserve too much
+        if (in_size >= 18) {
+            const uint8_t* tail = (const uint8_t*)in + in_size - 4;
+            size_t expected = tail[0] | (uint32_t)tail[1] << 8 | (uint32_t)tail[2] << 16 | (uint32_t)tail[3] << 24;
+            out.reserve(std::min(expected, in_size * 1032));
+        }
+        deflate_io::VectorSink sink(out);
+        deflate_memory::Arena arena;
+        realDecompressGzip(dat, sink, &arena, header);
+        return out;
+    }
+
+    // same as the plain file decompress, mapped when it can be and with the writes on their own thread
+    static size_t decompressGzip (std::string file_path, std::string new_file, GzipHeader* header = nullptr) {
+        deflate_io::OutputFile out_file(new_file);
+        deflate_io::WriteBehind<deflate_io::OutputFile> sink(out_file);
+        deflate_io::MappedFile mapped(file_path);
+        size_t size = 0;
+        if (mapped.ok()) {
+            Bitreader<NoSource> dat(mapped.data(), mapped.size());
+            deflate_memory::Arena arena;
+            size = realDecompressGzip(dat, sink, &arena, header);
+        } else {
+            std::ifstream f;
+            f.open(file_path, std::ios::binary);
+            deflate_io::IstreamSource source(f);
+            deflate_io::ReadAhead<deflate_io::IstreamSource> ahead(source);
+            size = decompressGzipSource(ahead, sink, header);
+        }
+        sink.finish();
+        return size;
     }
 
     // done
+    // anything past out_size is dropped
     static size_t decompress (void* in, size_t in_size, void* out, size_t out_size) {
-        Bitwrapper dat = Bitwrapper(in, in_size);
+        Bitreader<NoSource> dat(in, in_size);
         uint8_t* out_data = (uint8_t*)out;
         size_t it = 0;
-        realDecompress([&]() -> Bitwrapper& {
-            return dat;
-        }, [&](std::vector<uint8_t>& buffer, size_t buffer_offset) -> void {
-            for (size_t i = buffer_offset; i < buffer.size() && it < out_size; i++, it++) {
-                out_data[it] = buffer[i];
-            }
+        deflate_memory::Arena arena;
+        deflate_io::CallbackSink sink([&](const uint8_t* data, size_t n) -> void {
+            size_t take = std::min(n, out_size - it);
+            std::memcpy(out_data + it, data, take);
+            it += take;
         });
+        Window<decltype(sink)> window(&sink, 4 * KB32, &arena);
+        Tables tables(&arena);
+        realDecompress(dat, window, tables);
         return it;
     }
 
-    static std::vector<uint8_t> decompressZlib (void* in, size_t in_size) {
-        // idc about zlib data :)
-        uint32_t change = 2;
-        uint8_t v = extract1BitLeft(*(uint8_t*)in + 1, 5);
-        // fdict set, skip the other four bytes with the checksum
-        if (v) {
-            change = 6;
-        }
-        return decompress(((char*)in) + change, in_size - change);
+    static std::vector<uint8_t> decompressZlib (const void* in, size_t in_size) {
+        Bitreader<NoSource> dat(in, in_size);
+        std::vector<uint8_t> out;
+        out.reserve(in_size * 4);
+        deflate_io::VectorSink sink(out);
+        deflate_memory::Arena arena;
+        realDecompressZlib(dat, sink, &arena);
+        return out;
+    }
+
+    // zlib with a preset dictionary, only used when the stream's FDICT says so and checked against its id
+    static std::vector<uint8_t> decompressZlibWithDictionary (const void* in, size_t in_size, const void* dictionary, size_t dictionary_size) {
+        Bitreader<NoSource> dat(in, in_size);
+        std::vector<uint8_t> out;
+        out.reserve(in_size * 4);
+        deflate_io::VectorSink sink(out);
+        deflate_memory::Arena arena;
+        realDecompressZlib(dat, sink, &arena, (const uint8_t*)dictionary, dictionary_size);
+        return out;
+    }
+
+    // raw deflate that was compressed against a preset dictionary, it has to be the exact same bytes
+    static std::vector<uint8_t> decompressWithDictionary (const void* in, size_t in_size, const void* dictionary, size_t dictionary_size) {
+        Bitreader<NoSource> dat(in, in_size);
+        std::vector<uint8_t> out;
+        out.reserve(in_size * 4);
+        deflate_io::VectorSink sink(out);
+        deflate_memory::Arena arena;
+        Window<deflate_io::VectorSink> window(&sink, 4 * KB32, &arena);
+        window.preset((const uint8_t*)dictionary, dictionary_size);
+        Tables tables(&arena);
+        realDecompress(dat, window, tables);
+        return out;
     }
 
     static std::vector<uint8_t> decompress (void* in, size_t in_size) {
-        Bitwrapper dat = Bitwrapper(in, in_size);
-        std::vector<uint8_t> real_buffer;
-        size_t out_size = realDecompress([&]() -> Bitwrapper& {
-            return dat;
-        }, [&](std::vector<uint8_t>& buffer, size_t buffer_offset) -> void {
-            for (size_t i = buffer_offset; i < buffer.size(); i++) {
-                real_buffer.push_back(buffer[i]);
-            }
-        });
-        return real_buffer;
+        Bitreader<NoSource> dat(in, in_size);
+        std::vector<uint8_t> out;
+        out.reserve(in_size * 4);
+        deflate_io::VectorSink sink(out);
+        deflate_memory::Arena arena;
+        Window<deflate_io::VectorSink> window(&sink, 4 * KB32, &arena);
+        Tables tables(&arena);
+        realDecompress(dat, window, tables);
+        return out;
     }
 
     static std::vector<uint8_t> decompress (std::vector<uint8_t> in ) {
-        std::vector<uint8_t> real_buffer;
-        Bitwrapper dat = Bitwrapper(in.data(), in.size());
-        size_t out_size = realDecompress([&]() -> Bitwrapper& {
-            return dat;
-        }, [&](std::vector<uint8_t>& buffer, size_t buffer_offset) -> void {
-            for (size_t i = buffer_offset; i < buffer.size(); i++) {
-                real_buffer.push_back(buffer[i]);
-            }
-        });
-        return real_buffer;
+        return decompress(in.data(), in.size());
     }
 
     // done
+    // the input gets mapped and decoded in place when it can be, otherwise a reader thread streams it in
+    // output goes out in 1mb writes from a writer thread, so the disk and the decoder overlap
     static size_t decompress (std::string file_path, std::string new_file) {
-        uint8_t read_buffer[KB32];
+        deflate_io::OutputFile out_file(new_file);
+        deflate_io::WriteBehind<deflate_io::OutputFile> sink(out_file);
+        deflate_io::MappedFile mapped(file_path);
+        size_t size = 0;
+        if (mapped.ok()) {
+            Bitreader<NoSource> dat(mapped.data(), mapped.size());
+            deflate_memory::Arena arena;
+            Window<decltype(sink)> window(&sink, 4 * KB32, &arena);
+            Tables tables(&arena);
+            size = realDecompress(dat, window, tables);
+        } else {
+            std::ifstream f;
+            f.open(file_path, std::ios::binary);
+            deflate_io::IstreamSource source(f);
+            deflate_io::ReadAhead<deflate_io::IstreamSource> ahead(source);
+            size = decompressSource(ahead, sink);
+        }
+        sink.finish();
+        return size;
+    }
+
+    // one pass over the whole stream that puts a checkpoint down every span bytes of output, see Index
+    // zlib and gzip trailers get checked on the way, gzip can have any number of members
+    static Index buildIndex (const void* in, size_t in_size, Format format = RAW, size_t span = 1 << 20) {
+        Bitreader<NoSource> dat(in, in_size);
+        deflate_memory::Arena arena;
+        Index index = realBuildIndex(dat, format, span, &arena);
+        index.in_size = in_size;
+        return index;
+    }
+
+    static Index buildIndex (std::string file_path, Format format = RAW, size_t span = 1 << 20) {
+        deflate_io::MappedFile mapped(file_path);
+        if (mapped.ok()) {
+            return buildIndex(mapped.data(), mapped.size(), format, span);
+        }
         std::ifstream f;
         f.open(file_path, std::ios::binary);
-        std::ofstream out_file;
-        out_file.open(new_file.c_str(), std::ios::binary);
-        Bitwrapper dat = Bitwrapper(read_buffer, 0);
-        size_t size = realDecompress([&]() -> Bitwrapper& {
-            f.read((char*)read_buffer, KB32);
-            std::streamsize read = f.gcount();
-            dat = Bitwrapper(read_buffer, (size_t)read);
-            return dat;
-        }, [&](std::vector<uint8_t>& buffer, size_t buffer_offset) -> void {
-            out_file.write((char*)buffer.data() + buffer_offset, buffer.size() - buffer_offset);
+        deflate_io::IstreamSource source(f);
+        deflate_io::ReadAhead<deflate_io::IstreamSource> ahead(source);
+        deflate_memory::Arena arena;
+        std::pmr::vector<uint8_t> piece(KB32, &arena);
+        Bitreader<decltype(ahead)> dat(nullptr, 0, &ahead, piece.data(), piece.size());
+        Index index = realBuildIndex(dat, format, span, &arena);
+        // the reader can stop short of the end when there's junk after the stream, the size has to be the file's
+        f.clear();
+        f.seekg(0, std::ios::end);
+        index.in_size = (uint64_t)f.tellg();
+        return index;
+    }
+
+    // the len bytes of output starting at offset, decoded from the last checkpoint at or before it
+    // in has to be the data the index was built from, returns how many bytes there were, less than len past the end
+    static size_t extract (const Index& index, const void* in, size_t in_size, uint64_t offset, void* out, size_t len) {
+        if (in_size != index.in_size) {
+            throw std::runtime_error("Index wasn't built from this data!");
+        }
+        if (len == 0 || offset >= index.out_size || index.points.empty()) {
+            return 0;
+        }
+        const Index::Point& point = checkpoint(index, offset);
+        size_t byte = (size_t)(point.in_bits / 8);
+        Bitreader<NoSource> dat((const uint8_t*)in + byte, in_size - byte);
+        dat.readBits(point.in_bits % 8);
+        deflate_memory::Arena arena;
+        return realExtract(dat, index.format, point.window, offset - point.out, (uint8_t*)out, len, &arena);
+    }
+
+    // only reads from the checkpoint on, so a range near the end of a big file costs no more than one near the start
+    static size_t extract (const Index& index, std::string file_path, uint64_t offset, void* out, size_t len) {
+        deflate_io::MappedFile mapped(file_path);
+        if (mapped.ok()) {
+            return extract(index, mapped.data(), mapped.size(), offset, out, len);
+        }
+        std::ifstream f;
+        f.open(file_path, std::ios::binary);
+        f.seekg(0, std::ios::end);
+        if (!f || (uint64_t)f.tellg() != index.in_size) {
+            throw std::runtime_error("Index wasn't built from this data!");
+        }
+        if (len == 0 || offset >= index.out_size || index.points.empty()) {
+            return 0;
+        }
+        const Index::Point& point = checkpoint(index, offset);
+        f.seekg((std::streamoff)(point.in_bits / 8));
+        deflate_io::IstreamSource source(f);
+        deflate_memory::Arena arena;
+        std::pmr::vector<uint8_t> piece(KB32, &arena);
+        Bitreader<deflate_io::IstreamSource> dat(nullptr, 0, &source, piece.data(), piece.size());
+        dat.readBits(point.in_bits % 8);
+        return realExtract(dat, index.format, point.window, offset - point.out, (uint8_t*)out, len, &arena);
+    }
+
+    // the chunk table deflate::compressGzipSeekable leaves after the data, see its writeSeekTable
+    // throws when there isn't one, the stream can still be read start to finish with decompressGzip
+    static SeekTable readSeekTable (const void* in, size_t in_size) {
+        const uint8_t* bytes = (const uint8_t*)in;
+        if (in_size < 22 || std::memcmp(bytes + in_size - 22, "DZ\x08\x00", 4) != 0) {
+            throw std::runtime_error("No seek table at the end of this gzip stream!");
+        }
+        uint64_t total = 0;
+        for (int i = 0; i < 8; i++) {
+            total |= (uint64_t)bytes[in_size - 18 + i] << (8 * i);
+        }
+        if (total > in_size) {
+            throw std::runtime_error("Corrupt seek table!");
+        }
+        // where the first chunk starts is wherever the first member's header ends
+        Bitreader<NoSource> head(in, in_size);
+        readGzipHeader(head, nullptr);
+        SeekTable table;
+        size_t at = in_size - (size_t)total;
+        while (at < in_size) {
+            GzipHeader header;
+            Bitreader<NoSource> dat(bytes + at, in_size - at);
+            readGzipHeader(dat, &header);
+            at += (size_t)(dat.position() / 8) + 10;
+            if (at > in_size || bytes[at - 10] != 0x03 || bytes[at - 9] != 0x00) {
+                throw std::runtime_error("Corrupt seek table!");
+            }
+            // subfields are two id bytes and a little endian length, only DX matters here
+            const std::vector<uint8_t>& extra = header.extra;
+            for (size_t i = 0; i + 4 <= extra.size();) {
+                size_t n = extra[i + 2] | (size_t)extra[i + 3] << 8;
+                if (n > extra.size() - i - 4) {
+                    throw std::runtime_error("Corrupt seek table!");
+                }
+                if (extra[i] == 'D' && extra[i + 1] == 'X') {
+                    table.addEntries(extra.data() + i + 4, n, head.position() / 8);
+                }
+                i += 4 + n;
+            }
+        }
+        if (table.chunks.empty() || table.chunks.back().in_offset + table.chunks.back().in_size > in_size - (size_t)total) {
+            throw std::runtime_error("Corrupt seek table!");
+        }
+        return table;
+    }
+
+    // chunk i of a seekable stream into out, in is the whole stream, raw or gzip, returns the chunk's size
+    static size_t decompressChunk (const void* in, size_t in_size, const SeekTable& table, size_t i, void* out, size_t out_cap) {
+        Decompressor decompressor;
+        return decompressor.decompressChunk(in, in_size, table.chunks.at(i), out, out_cap);
+    }
+
+    // every chunk at once, spread over threads workers (0 means one per core) that each decode straight into their part of the output
+    static std::vector<uint8_t> decompressSeekable (const void* in, size_t in_size, const SeekTable& table, size_t threads = 0) {
+        std::vector<uint8_t> out(table.outSize());
+        parallelItems(table.chunks.size(), threads, [&]() {
+            return Decompressor();
+        }, [&](Decompressor& decompressor, size_t i) {
+            const SeekTable::Chunk& chunk = table.chunks[i];
+            decompressor.decompressChunk(in, in_size, chunk, out.data() + chunk.out_offset, chunk.out_size);
         });
-        out_file.close();
-        f.close();
-        return size;
+        return out;
+    }
+
+    // multi-member gzip (concatenated files, pigz -i), BGZF (bgzip) and gzip written with full flushes, on threads workers (0 means one per core)
+    // BGZF says where its members are, otherwise members and flush points get searched for and each piece is decoded speculatively,
+    // pieces that needed the history before them (sync flushes) or started on a false match are redone serially
+    // the output is always what decompressGzip gives, a stream with nothing to split on just doesn't get any faster
+    static std::vector<uint8_t> decompressGzipParallel (const void* in, size_t in_size, size_t threads = 0) {
+        return realDecompressParallel((const uint8_t*)in, in_size, GZIP, threads);
+    }
+    // raw deflate written with full flushes, deflate::compressSeekable or Stream with FULL_FLUSH, the same way
+    static std::vector<uint8_t> decompressParallel (const void* in, size_t in_size, size_t threads = 0) {
+        return realDecompressParallel((const uint8_t*)in, in_size, RAW, threads);
+    }
+    static size_t decompressGzipParallel (std::string file_path, std::string new_file, size_t threads = 0) {
+        deflate_io::MappedFile mapped(file_path);
+        std::vector<uint8_t> out;
+        if (mapped.ok()) {
+            out = decompressGzipParallel(mapped.data(), mapped.size(), threads);
+        } else {
+            std::ifstream f(file_path, std::ios::binary | std::ios::ate);
+            std::vector<uint8_t> data(f ? (size_t)f.tellg() : 0);
+            f.seekg(0);
+            f.read((char*)data.data(), data.size());
+            out = decompressGzipParallel(data.data(), data.size(), threads);
+        }
+        deflate_io::OutputFile out_file(new_file);
+        out_file.write(out.data(), out.size());
+        return out.size();
+    }
+
+    // experimental, a single deflate stream with no flush points decoded on threads workers (0 means one per core)
+    // each worker finds a dynamic block in its share of the input and decodes from there before the data ahead of it is known,
+    // matches reaching back past the start are kept as markers and filled in once the piece before is done
+    // a guess that was wrong, or a share with no dynamic block in it, falls back to decoding that stretch serially,
+    // so the output is always byte for byte what decompress gives
+    static std::vector<uint8_t> decompressSpeculative (const void* in, size_t in_size, size_t threads = 0, SpeculationReport* report = nullptr) {
+        uint64_t end_bit = 0;
+        return realDecompressSpeculative((const uint8_t*)in, in_size, 0, threads, end_bit, report);
+    }
+    // the same for the first gzip member, which gets its crc and size checked, any members after it go to decompressGzipParallel
+    static std::vector<uint8_t> decompressGzipSpeculative (const void* in, size_t in_size, size_t threads = 0, SpeculationReport* report = nullptr) {
+        const uint8_t* bytes = (const uint8_t*)in;
+        Bitreader<NoSource> head(in, in_size);
+        readGzipHeader(head, nullptr);
+        uint64_t end_bit = 0;
+        std::vector<uint8_t> out = realDecompressSpeculative(bytes, in_size, head.position(), threads, end_bit, report);
+        Bitreader<NoSource> dat(bytes + (end_bit + 7) / 8, in_size - (size_t)((end_bit + 7) / 8));
+        uint32_t crc = dat.readBits(32);
+        uint32_t size = dat.readBits(32);
+        dat.checkOverrun();
+        if (crc != deflate_cpu::kernels().crc32(0, out.data(), out.size())) {
+            throw std::runtime_error("Gzip crc doesn't match the data!");
+        }
+        if (size != (uint32_t)out.size()) {
+            throw std::runtime_error("Gzip size doesn't match the data!");
+        }
+        size_t rest = (size_t)((end_bit + 7) / 8) + 8;
+        if (!dat.exhausted()) {
+            std::vector<uint8_t> more = decompressGzipParallel(bytes + rest, in_size - rest, threads);
+            out.insert(out.end(), more.begin(), more.end());
+        }
+        return out;
+    }
+
+    private:
+    // the last checkpoint at or before offset
+    static const Index::Point& checkpoint (const Index& index, uint64_t offset) {
+        auto it = std::upper_bound(index.points.begin(), index.points.end(), offset, [](uint64_t o, const Index::Point& point) {
+            return o < point.out;
+        });
+        return *(it - 1);
     }
 };
\ No newline at end of file
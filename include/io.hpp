@@ -0,0 +1,561 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cpu.hpp"
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define DEFLATE_HAS_MMAP
+#endif
+
+// where input comes from and output goes for compressSource and decompressSource
+// a source is anything with size_t read(uint8_t* dst, size_t n) that returns 0 at the end, short reads are fine
+// a sink is anything with void write(const uint8_t* data, size_t n)
+// they're template parameters all the way down, so every pipeline gets its own inlined copy with no indirect calls
+// these cover the usual cases, any type with the same members works just as well
+class deflate_io {
+public:
+    class MemorySource {
+    private:
+        const uint8_t* data;
+        size_t size;
+        size_t offset = 0;
+    public:
+        MemorySource (const void* data, size_t size) {
+            this->data = (const uint8_t*)data;
+            this->size = size;
+        }
+        size_t read (uint8_t* dst, size_t n) {
+            size_t take = (size - offset < n) ? size - offset : n;
+            std::memcpy(dst, data + offset, take);
+            offset += take;
+            return take;
+        }
+    };
+
+    class IstreamSource {
+    private:
+        std::istream& in;
+    public:
+        IstreamSource (std::istream& in) : in(in) {
+        }
+        size_t read (uint8_t* dst, size_t n) {
+            in.read((char*)dst, n);
+            std::streamsize got = in.gcount();
+            return (got > 0) ? (size_t)got : 0;
+        }
+    };
+
+    class FileSource {
+    private:
+        FILE* f;
+    public:
+        FileSource (FILE* f) {
+            this->f = f;
+        }
+        size_t read (uint8_t* dst, size_t n) {
+            return std::fread(dst, 1, n, f);
+        }
+    };
+
+    // wraps a callable taking (uint8_t* dst, size_t n) and returning the bytes it wrote
+    template <typename F>
+    class CallbackSource {
+    private:
+        F f;
+    public:
+        CallbackSource (F f) : f(f) {
+        }
+        size_t read (uint8_t* dst, size_t n) {
+            return f(dst, n);
+        }
+    };
+
+    // appends to the vector, so the same one can be reused after a clear
+    class VectorSink {
+    private:
+        std::vector<uint8_t>& out;
+    public:
+        VectorSink (std::vector<uint8_t>& out) : out(out) {
+        }
+        void write (const uint8_t* data, size_t n) {
+            out.insert(out.end(), data, data + n);
+        }
+    };
+
+    // caller owned buffer, throws once it runs out
+    class BufferSink {
+    private:
+        uint8_t* out;
+        size_t cap;
+        size_t written = 0;
+    public:
+        BufferSink (void* out, size_t cap) {
+            this->out = (uint8_t*)out;
+            this->cap = cap;
+        }
+        void write (const uint8_t* data, size_t n) {
+            if (n > cap - written) {
+                throw std::runtime_error("Output buffer too small!");
+            }
+            std::memcpy(out + written, data, n);
+            written += n;
+        }
+        size_t size () const {
+            return written;
+        }
+    };
+
+    class OstreamSink {
+    private:
+        std::ostream& out;
+    public:
+        OstreamSink (std::ostream& out) : out(out) {
+        }
+        void write (const uint8_t* data, size_t n) {
+            out.write((const char*)data, n);
+        }
+    };
+
+    class FileSink {
+    private:
+        FILE* f;
+    public:
+        FileSink (FILE* f) {
+            this->f = f;
+        }
+        void write (const uint8_t* data, size_t n) {
+            if (std::fwrite(data, 1, n, f) != n) {
+                throw std::runtime_error("Failed writing to file!");
+            }
+        }
+    };
+
+    // opens path for writing and closes it when done, stdio's own buffering is off since writes come in big already
+    class OutputFile {
+    private:
+        FILE* f;
+    public:
+        OutputFile (const std::string& path) {
+            f = std::fopen(path.c_str(), "wb");
+            if (f == nullptr) {
+                throw std::runtime_error("Couldn't open " + path + " for writing!");
+            }
+            std::setvbuf(f, nullptr, _IONBF, 0);
+        }
+        ~OutputFile () {
+            std::fclose(f);
+        }
+        OutputFile (const OutputFile&) = delete;
+        OutputFile& operator= (const OutputFile&) = delete;
+        void write (const uint8_t* data, size_t n) {
+            if (std::fwrite(data, 1, n, f) != n) {
+                throw std::runtime_error("Failed writing to file!");
+            }
+        }
+    };
+
+    // wraps a callable taking (const uint8_t* data, size_t n)
+    template <typename F>
+    class CallbackSink {
+    private:
+        F f;
+    public:
+        CallbackSink (F f) : f(f) {
+        }
+        void write (const uint8_t* data, size_t n) {
+            f(data, n);
+        }
+    };
+
+    // gathers small writes into one big buffer so the sink under it sees a few large writes
+    // anything already bigger than the buffer goes straight through, call flush at the end to push out the rest
+    template <typename Sink>
+    class BufferedSink {
+    private:
+        Sink& sink;
+        std::vector<uint8_t> buffer;
+        size_t used = 0;
+    public:
+        static constexpr size_t default_size = 1 << 20;
+        BufferedSink (Sink& sink, size_t size = default_size) : sink(sink), buffer(size) {
+        }
+        void write (const uint8_t* data, size_t n) {
+            if (used + n > buffer.size()) {
+                flush();
+                if (n >= buffer.size()) {
+                    sink.write(data, n);
+                    return;
+                }
+            }
+            std::memcpy(buffer.data() + used, data, n);
+            used += n;
+        }
+        void flush () {
+            if (used > 0) {
+                sink.write(buffer.data(), used);
+                used = 0;
+            }
+        }
+    };
+
+    // running checksums of everything passed to update, plus the byte count, what the gzip and zlib trailers hold
+    class Crc32 {
+    private:
+        uint32_t crc = 0;
+        uint64_t count = 0;
+    public:
+        void update (const uint8_t* data, size_t n) {
+            crc = deflate_cpu::kernels().crc32(crc, data, n);
+            count += n;
+        }
+        uint32_t value () const {
+            return crc;
+        }
+        uint64_t size () const {
+            return count;
+        }
+        void reset () {
+            crc = 0;
+            count = 0;
+        }
+    };
+
+    class Adler32 {
+    private:
+        uint32_t adler = 1;
+        uint64_t count = 0;
+    public:
+        void update (const uint8_t* data, size_t n) {
+            adler = deflate_cpu::kernels().adler32(adler, data, n);
+            count += n;
+        }
+        uint32_t value () const {
+            return adler;
+        }
+        uint64_t size () const {
+            return count;
+        }
+        void reset () {
+            adler = 1;
+            count = 0;
+        }
+    };
+
+    // checksums what comes out of source as it's read, so the data is only touched once
+    template <typename Check, typename Source>
+    class ChecksumSource {
+    private:
+        Source& source;
+    public:
+        Check check;
+        ChecksumSource (Source& source) : source(source) {
+        }
+        size_t read (uint8_t* dst, size_t n) {
+            size_t got = source.read(dst, n);
+            check.update(dst, got);
+            return got;
+        }
+    };
+
+    // checksums what goes into sink on the way through, while it's still in cache from being written
+    template <typename Check, typename Sink>
+    class ChecksumSink {
+    private:
+        Sink& sink;
+    public:
+        Check check;
+        ChecksumSink (Sink& sink) : sink(sink) {
+        }
+        void write (const uint8_t* data, size_t n) {
+            check.update(data, n);
+            sink.write(data, n);
+        }
+    };
+
+    // a fixed ring of reusable buffers passed from one thread to another, for overlapping i/o with the codec
+    // the producer fills them in order and the consumer drains them in the same order, nothing is allocated after construction
+    // when the producer is ahead by a full ring it waits, so memory stays at count * size however fast either side is
+    // either side can stop the other with an exception, it gets rethrown on the other side's next call
+    class BufferRing {
+    private:
+        std::vector<std::vector<uint8_t>> buffers;
+        std::vector<size_t> sizes;
+        size_t head = 0;
+        size_t tail = 0;
+        size_t filled = 0;
+        bool closed = false;
+        bool cancelled = false;
+        std::exception_ptr error;
+        std::mutex m;
+        std::condition_variable cv;
+    public:
+        BufferRing (size_t count, size_t size) : buffers(count, std::vector<uint8_t>(size)), sizes(count) {
+        }
+        size_t bufferSize () const {
+            return buffers[0].size();
+        }
+        // producer side
+        // waits for an empty buffer, nullptr once the consumer has stopped
+        uint8_t* acquire () {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&] { return filled < buffers.size() || cancelled; });
+            if (cancelled) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                return nullptr;
+            }
+            return buffers[head].data();
+        }
+        void publish (size_t n) {
+            std::lock_guard<std::mutex> lock(m);
+            sizes[head] = n;
+            head = (head + 1) % buffers.size();
+            filled++;
+            cv.notify_all();
+        }
+        void close (std::exception_ptr e = nullptr) {
+            std::lock_guard<std::mutex> lock(m);
+            closed = true;
+            error = e;
+            cv.notify_all();
+        }
+        // consumer side
+        // waits for a filled buffer, false once the producer is closed and everything's been drained
+        bool next (const uint8_t*& data, size_t& n) {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&] { return filled > 0 || closed; });
+            if (filled == 0) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                return false;
+            }
+            data = buffers[tail].data();
+            n = sizes[tail];
+            return true;
+        }
+        void release () {
+            std::lock_guard<std::mutex> lock(m);
+            tail = (tail + 1) % buffers.size();
+            filled--;
+            cv.notify_all();
+        }
+        void cancel (std::exception_ptr e = nullptr) {
+            std::lock_guard<std::mutex> lock(m);
+            cancelled = true;
+            error = e;
+            cv.notify_all();
+        }
+        // whatever either side stopped with, if anything
+        void rethrow () {
+            std::lock_guard<std::mutex> lock(m);
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    };
+
+    // reads source on its own thread into a BufferRing so the codec never waits on the disk unless it's caught up
+    // each buffer holds whatever one read of the source returned, errors from the source come out of read here
+    template <typename Source>
+    class ReadAhead {
+    private:
+        Source& source;
+        BufferRing ring;
+        const uint8_t* data = nullptr;
+        size_t left = 0;
+        bool holding = false;
+        bool done = false;
+        std::thread reader;
+    public:
+        static constexpr size_t default_size = 1 << 20;
+        static constexpr size_t default_count = 4;
+        ReadAhead (Source& source, size_t size = default_size, size_t count = default_count) : source(source), ring(count, size) {
+            reader = std::thread([this] { run(); });
+        }
+        ~ReadAhead () {
+            ring.cancel();
+            reader.join();
+        }
+        ReadAhead (const ReadAhead&) = delete;
+        ReadAhead& operator= (const ReadAhead&) = delete;
+        size_t read (uint8_t* dst, size_t n) {
+            size_t total = 0;
+            while (total < n && !done) {
+                if (left == 0) {
+                    if (holding) {
+                        ring.release();
+                        holding = false;
+                    }
+                    if (!ring.next(data, left)) {
+                        done = true;
+                        break;
+                    }
+                    holding = true;
+                }
+                size_t take = (left < n - total) ? left : n - total;
+                std::memcpy(dst + total, data, take);
+                data += take;
+                left -= take;
+                total += take;
+            }
+            return total;
+        }
+    private:
+        void run () {
+            try {
+                while (uint8_t* buffer = ring.acquire()) {
+                    size_t got = source.read(buffer, ring.bufferSize());
+                    if (got == 0) {
+                        break;
+                    }
+                    ring.publish(got);
+                }
+                ring.close();
+            } catch (...) {
+                ring.close(std::current_exception());
+            }
+        }
+    };
+
+    // gathers writes into big buffers and hands them to sink on its own thread, so the codec never waits on the disk
+    // call finish at the end, it pushes out the rest, waits for the writer and rethrows anything the sink threw
+    // a failed write also shows up on the next write here, dropping it without finish just stops after what's queued
+    template <typename Sink>
+    class WriteBehind {
+    private:
+        Sink& sink;
+        BufferRing ring;
+        uint8_t* current = nullptr;
+        size_t used = 0;
+        std::thread writer;
+    public:
+        static constexpr size_t default_size = 1 << 20;
+        static constexpr size_t default_count = 4;
+        WriteBehind (Sink& sink, size_t size = default_size, size_t count = default_count) : sink(sink), ring(count, size) {
+            writer = std::thread([this] { run(); });
+        }
+        ~WriteBehind () {
+            if (writer.joinable()) {
+                ring.close();
+                writer.join();
+            }
+        }
+        WriteBehind (const WriteBehind&) = delete;
+        WriteBehind& operator= (const WriteBehind&) = delete;
+        void write (const uint8_t* data, size_t n) {
+            size_t size = ring.bufferSize();
+            while (n > 0) {
+                if (current == nullptr) {
+                    current = ring.acquire();
+                    used = 0;
+                    if (current == nullptr) {
+                        throw std::runtime_error("Writer already stopped!");
+                    }
+                }
+                size_t take = (size - used < n) ? size - used : n;
+                std::memcpy(current + used, data, take);
+                used += take;
+                data += take;
+                n -= take;
+                if (used == size) {
+                    ring.publish(used);
+                    current = nullptr;
+                }
+            }
+        }
+        void finish () {
+            if (current != nullptr && used > 0) {
+                ring.publish(used);
+            }
+            current = nullptr;
+            ring.close();
+            writer.join();
+            ring.rethrow();
+        }
+    private:
+        void run () {
+            try {
+                const uint8_t* data;
+                size_t n;
+                while (ring.next(data, n)) {
+                    sink.write(data, n);
+                    ring.release();
+                }
+            } catch (...) {
+                ring.cancel(std::current_exception());
+            }
+        }
+    };
+
+    // a whole file mapped read only, so it can be compressed or decoded in place without being read in
+    // the kernel is told the access is sequential so it reads ahead and drops pages behind
+    // only on posix, anywhere else (or for things like pipes that can't be mapped) ok is false and callers stream instead
+    class MappedFile {
+    private:
+        const uint8_t* bytes = nullptr;
+        size_t length = 0;
+        bool mapped = false;
+    public:
+        MappedFile (const std::string& path) {
+            #if defined(DEFLATE_HAS_MMAP)
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                length = (size_t)st.st_size;
+                if (length == 0) {
+                    mapped = true;
+                } else {
+                    void* p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (p != MAP_FAILED) {
+                        ::madvise(p, length, MADV_SEQUENTIAL);
+                        bytes = (const uint8_t*)p;
+                        mapped = true;
+                    }
+                }
+            }
+            // the mapping holds its own reference to the file
+            ::close(fd);
+            #else
+            (void)path;
+            #endif
+        }
+        ~MappedFile () {
+            #if defined(DEFLATE_HAS_MMAP)
+            if (bytes != nullptr) {
+                ::munmap((void*)bytes, length);
+            }
+            #endif
+        }
+        MappedFile (const MappedFile&) = delete;
+        MappedFile& operator= (const MappedFile&) = delete;
+
+        bool ok () const {
+            return mapped;
+        }
+        const uint8_t* data () const {
+            return bytes;
+        }
+        size_t size () const {
+            return length;
+        }
+    };
+};
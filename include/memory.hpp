@@ -0,0 +1,99 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <memory_resource>
+
+// where the working memory comes from, every table, tree and buffer the library keeps is a std::pmr container
+// contexts (Compressor, Decompressor, Stream) take a memory_resource and hold on to it for their lifetime
+// the static calls make a per call arena on top of defaultResource, so a call is a handful of upstream allocations
+// that all go away together when it returns
+// results handed back as std::vector<uint8_t> belong to the caller and use the normal allocator
+class deflate_memory {
+public:
+    // c style hooks for plugging in a pool, opaque is passed through untouched
+    // alloc has to return memory aligned to at least alignment or nullptr
+    struct Callbacks {
+        void* (*alloc)(void* opaque, size_t size, size_t alignment) = nullptr;
+        void (*free)(void* opaque, void* p, size_t size, size_t alignment) = nullptr;
+        void* opaque = nullptr;
+    };
+
+    // adapts Callbacks to a memory_resource
+    class CallbackResource : public std::pmr::memory_resource {
+    private:
+        Callbacks callbacks;
+    public:
+        CallbackResource (const Callbacks& callbacks) {
+            this->callbacks = callbacks;
+        }
+    protected:
+        void* do_allocate (size_t bytes, size_t alignment) override {
+            void* p = callbacks.alloc(callbacks.opaque, bytes, alignment);
+            if (p == nullptr) {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+        void do_deallocate (void* p, size_t bytes, size_t alignment) override {
+            callbacks.free(callbacks.opaque, p, bytes, alignment);
+        }
+        bool do_is_equal (const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    // passes everything on to upstream and keeps count, for measuring what a context or call really needs
+    // not synchronized, same as the contexts it sits under
+    class TrackingResource : public std::pmr::memory_resource {
+    private:
+        std::pmr::memory_resource* upstream;
+        size_t current_bytes = 0;
+        size_t peak_bytes = 0;
+        size_t allocation_count = 0;
+    public:
+        TrackingResource (std::pmr::memory_resource* upstream = std::pmr::new_delete_resource()) {
+            this->upstream = upstream;
+        }
+        size_t current () const {
+            return current_bytes;
+        }
+        size_t peak () const {
+            return peak_bytes;
+        }
+        size_t allocations () const {
+            return allocation_count;
+        }
+    protected:
+        void* do_allocate (size_t bytes, size_t alignment) override {
+            void* p = upstream->allocate(bytes, alignment);
+            current_bytes += bytes;
+            allocation_count++;
+            if (current_bytes > peak_bytes) {
+                peak_bytes = current_bytes;
+            }
+            return p;
+        }
+        void do_deallocate (void* p, size_t bytes, size_t alignment) override {
+            upstream->deallocate(p, bytes, alignment);
+            current_bytes -= bytes;
+        }
+        bool do_is_equal (const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    // whatever std::pmr::set_default_resource was last given, new and delete out of the box
+    static std::pmr::memory_resource* defaultResource () {
+        return std::pmr::get_default_resource();
+    }
+
+    // bump allocator for one call, sized so a compress or decompress call rarely needs a second upstream block
+    // freeing is a no op, everything goes back when the arena does
+    class Arena : public std::pmr::monotonic_buffer_resource {
+    public:
+        static constexpr size_t initial_size = 512 * 1024;
+        Arena (std::pmr::memory_resource* upstream = defaultResource()) : std::pmr::monotonic_buffer_resource(initial_size, upstream) {
+        }
+    };
+};
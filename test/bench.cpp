@@ -0,0 +1,379 @@
+#include "../include/deflate.hpp"
+#include "../include/inflate.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef DEFLATE_BENCH_ZLIB
+#include <zlib.h>
+#endif
+
+// deflate_bench, compress and decompress speed, ratio and percentiles over corpora generated here with a fixed seed
+// so every run on every machine measures the same bytes, nothing is read from disk or fetched
+// deflate_bench [--size MB] [--reps N] [--warmup N] [--levels 0,1,2,3] [--corpus name,...] [--no-zlib] [--csv]
+
+// xorshift64*, the std distributions aren't the same across standard libraries so they'd give different corpora
+struct Random {
+    uint64_t state;
+    Random (uint64_t seed) {
+        state = seed * 0x9e3779b97f4a7c15ull + 1;
+    }
+    uint64_t next () {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dull;
+    }
+    uint32_t below (uint32_t n) {
+        return (uint32_t)((next() >> 32) * n >> 32);
+    }
+    // skewed towards 0 like word frequencies are, roughly zipfian
+    uint32_t skewed (uint32_t n) {
+        uint32_t a = below(n);
+        uint32_t b = below(n);
+        return (a < b) ? below(a + 1) : below(b + 1);
+    }
+};
+
+static const char* words[] = {
+    "the", "of", "and", "to", "a", "in", "is", "it", "that", "for", "was", "on", "are", "with", "as", "be", "this", "by",
+    "stream", "block", "window", "match", "length", "distance", "huffman", "table", "symbol", "literal", "header",
+    "buffer", "output", "input", "chunk", "thread", "worker", "memory", "speed", "ratio", "level", "code", "tree",
+    "compression", "decompression", "performance", "benchmark", "measurement", "throughput", "latency", "percentile",
+    "whenever", "although", "particularly", "independently", "approximately", "consequently", "significantly"
+};
+static const size_t word_count = sizeof(words) / sizeof(words[0]);
+
+static void append (std::vector<uint8_t>& out, const std::string& s) {
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+static std::vector<uint8_t> makeText (size_t size, uint64_t seed) {
+    Random r(seed);
+    std::vector<uint8_t> out;
+    out.reserve(size + 256);
+    while (out.size() < size) {
+        uint32_t sentence = 4 + r.below(16);
+        for (uint32_t w = 0; w < sentence; w++) {
+            std::string word = words[r.skewed(word_count)];
+            if (w == 0) {
+                word[0] = (char)(word[0] - 'a' + 'A');
+            }
+            append(out, word);
+            out.push_back((w + 1 == sentence) ? '.' : ' ');
+        }
+        out.push_back((r.below(5) == 0) ? '\n' : ' ');
+    }
+    out.resize(size);
+    return out;
+}
+
+static std::vector<uint8_t> makeJson (size_t size, uint64_t seed) {
+    Random r(seed);
+    static const char* names[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel"};
+    static const char* states[] = {"active", "pending", "closed", "failed"};
+    std::vector<uint8_t> out;
+    out.reserve(size + 512);
+    append(out, "[\n");
+    for (uint64_t id = 1; out.size() < size; id++) {
+        char line[384];
+        std::snprintf(line, sizeof(line),
+            "  {\"id\": %llu, \"name\": \"%s-%u\", \"state\": \"%s\", \"score\": %u.%02u, \"tags\": [\"%s\", \"%s\"], \"owner\": {\"user\": \"%s\", \"uid\": %u}},\n",
+            (unsigned long long)id, names[r.below(8)], r.below(1000), states[r.skewed(4)], r.below(100), r.below(100),
+            words[r.skewed(word_count)], words[r.skewed(word_count)], names[r.skewed(8)], 1000 + r.below(64));
+        append(out, line);
+    }
+    out.resize(size);
+    return out;
+}
+
+static std::vector<uint8_t> makeLogs (size_t size, uint64_t seed) {
+    Random r(seed);
+    static const char* levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+    static const char* paths[] = {"/api/v1/items", "/api/v1/users", "/static/app.js", "/health", "/login", "/api/v2/search"};
+    static const char* methods[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+    static const uint32_t statuses[] = {200, 200, 200, 200, 304, 404, 500};
+    std::vector<uint8_t> out;
+    out.reserve(size + 512);
+    uint64_t ms = 1700000000000ull;
+    while (out.size() < size) {
+        ms += r.below(2000);
+        char line[256];
+        std::snprintf(line, sizeof(line), "%llu.%03u %s [worker-%u] %u.%u.%u.%u %s %s %u %uB %ums\n",
+            (unsigned long long)(ms / 1000), (unsigned)(ms % 1000), levels[r.below(6)], r.below(16),
+            10, r.below(4), r.below(256), r.below(256), methods[r.below(6)], paths[r.skewed(6)],
+            statuses[r.below(7)], r.below(65536), r.skewed(1000));
+        append(out, line);
+    }
+    out.resize(size);
+    return out;
+}
+
+// a 24 bit BMP of gradients with shapes and a little noise, about how a screenshot or a scanned page behaves
+static std::vector<uint8_t> makeBmp (size_t size, uint64_t seed) {
+    Random r(seed);
+    uint32_t width = 1024;
+    uint32_t height = (uint32_t)std::max((size_t)1, (size > 54) ? (size - 54) / (width * 3) : 0);
+    uint32_t pixels = width * height * 3;
+    std::vector<uint8_t> out(54, 0);
+    uint32_t fields[] = {54 + pixels, 0, 54, 40, width, height};
+    out[0] = 'B';
+    out[1] = 'M';
+    for (size_t f = 0; f < 6; f++) {
+        for (int b = 0; b < 4; b++) {
+            out[2 + f * 4 + b] = (uint8_t)(fields[f] >> (8 * b));
+        }
+    }
+    out[26] = 1;
+    out[28] = 24;
+    out.reserve(size);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            bool inside = ((x / 128) + (y / 96)) % 3 == 0;
+            uint32_t noise = (r.below(8) == 0) ? r.below(6) : 0;
+            out.push_back((uint8_t)(inside ? 40 : (x / 4 + noise)));
+            out.push_back((uint8_t)(inside ? 200 : (y / 4 + noise)));
+            out.push_back((uint8_t)(inside ? 90 : ((x + y) / 8 + noise)));
+        }
+    }
+    out.resize(size, 0);
+    return out;
+}
+
+static std::vector<uint8_t> makeRandom (size_t size, uint64_t seed) {
+    Random r(seed);
+    std::vector<uint8_t> out(size);
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t v = r.next();
+        std::memcpy(out.data() + i, &v, std::min((size_t)8, size - i));
+    }
+    return out;
+}
+
+static std::vector<uint8_t> makeZeros (size_t size, uint64_t) {
+    return std::vector<uint8_t>(size, 0);
+}
+
+// 256KB stretches of each of the others in turn, so blocks change character partway through
+static std::vector<uint8_t> makeMixed (size_t size, uint64_t seed) {
+    std::vector<std::vector<uint8_t>> parts = {makeText(size, seed + 1), makeJson(size, seed + 2), makeLogs(size, seed + 3),
+        makeBmp(size, seed + 4), makeRandom(size, seed + 5), makeZeros(size, 0)};
+    std::vector<uint8_t> out;
+    out.reserve(size);
+    size_t stretch = 256 * 1024;
+    for (size_t k = 0; out.size() < size; k++) {
+        const std::vector<uint8_t>& part = parts[k % parts.size()];
+        size_t at = out.size();
+        size_t n = std::min(stretch, size - at);
+        out.insert(out.end(), part.begin() + at, part.begin() + at + n);
+    }
+    return out;
+}
+
+struct Corpus {
+    const char* name;
+    std::vector<uint8_t> (*make)(size_t, uint64_t);
+};
+
+static const Corpus corpora[] = {
+    {"text", makeText}, {"json", makeJson}, {"logs", makeLogs}, {"bmp", makeBmp},
+    {"random", makeRandom}, {"zeros", makeZeros}, {"mixed", makeMixed}
+};
+
+struct Options {
+    size_t size = 8 << 20;
+    size_t reps = 10;
+    size_t warmup = 2;
+    std::vector<int> levels = {0, 1, 2, 3};
+    std::vector<std::string> corpora;
+    bool zlib = true;
+    bool csv = false;
+};
+
+struct Timings {
+    std::vector<double> seconds;
+    double percentile (double p) {
+        std::sort(seconds.begin(), seconds.end());
+        size_t i = (size_t)(p * (seconds.size() - 1) + 0.5);
+        return seconds[i];
+    }
+};
+
+// times fn warmup + reps times and keeps the reps
+template <typename Fn>
+static Timings timeRuns (const Options& options, Fn fn) {
+    Timings t;
+    for (size_t i = 0; i < options.warmup + options.reps; i++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        if (i >= options.warmup) {
+            t.seconds.push_back(std::chrono::duration<double>(end - start).count());
+        }
+    }
+    return t;
+}
+
+static void report (const Options& options, const std::string& corpus, const std::string& codec, size_t in_size, size_t out_size, Timings& comp, Timings& decomp, bool ok) {
+    double mb = in_size / 1e6;
+    // a rep that takes longer is the lower speed, so the speed percentiles come from the opposite time percentiles
+    double c50 = mb / comp.percentile(0.5);
+    double c10 = mb / comp.percentile(0.9);
+    double c90 = mb / comp.percentile(0.1);
+    double d50 = mb / decomp.percentile(0.5);
+    double d10 = mb / decomp.percentile(0.9);
+    double d90 = mb / decomp.percentile(0.1);
+    double ratio = (double)in_size / std::max((size_t)1, out_size);
+    if (options.csv) {
+        std::printf("%s,%s,%zu,%zu,%.4f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%d\n", corpus.c_str(), codec.c_str(), in_size, out_size, ratio,
+            c50, c10, c90, d50, d10, d90, ok ? 1 : 0);
+    } else {
+        std::printf("%-7s %-9s %8.3f  %8.1f %8.1f %8.1f  %8.1f %8.1f %8.1f%s\n", corpus.c_str(), codec.c_str(), ratio,
+            c50, c10, c90, d50, d10, d90, ok ? "" : "  ROUND TRIP FAILED");
+    }
+    std::fflush(stdout);
+}
+
+static bool benchDeflate (const Options& options, const std::string& corpus, const std::vector<uint8_t>& data, int level) {
+    std::vector<uint8_t> compressed(deflate::compressBound(data.size()));
+    std::vector<uint8_t> restored(data.size());
+    size_t out_size = 0;
+    deflate::Compressor compressor(level);
+    inflate::Decompressor decompressor;
+    Timings comp = timeRuns(options, [&]() {
+        out_size = compressor.compress(data.data(), data.size(), compressed.data(), compressed.size());
+    });
+    size_t got = 0;
+    Timings decomp = timeRuns(options, [&]() {
+        got = decompressor.decompress(compressed.data(), out_size, restored.data(), restored.size());
+    });
+    bool ok = got == data.size() && restored == data;
+    report(options, corpus, "deflate-" + std::to_string(level), data.size(), out_size, comp, decomp, ok);
+    return ok;
+}
+
+#ifdef DEFLATE_BENCH_ZLIB
+// raw deflate through deflateInit2 / inflateInit2 so both sides do the same format, streams are reused like the Compressor is
+static bool benchZlib (const Options& options, const std::string& corpus, const std::vector<uint8_t>& data, int level) {
+    std::vector<uint8_t> compressed(deflateBound(nullptr, data.size()) + 64);
+    std::vector<uint8_t> restored(data.size());
+    z_stream c = {};
+    z_stream d = {};
+    deflateInit2(&c, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    inflateInit2(&d, -15);
+    size_t out_size = 0;
+    Timings comp = timeRuns(options, [&]() {
+        deflateReset(&c);
+        c.next_in = (Bytef*)data.data();
+        c.avail_in = (uInt)data.size();
+        c.next_out = compressed.data();
+        c.avail_out = (uInt)compressed.size();
+        deflate(&c, Z_FINISH);
+        out_size = c.total_out;
+    });
+    Timings decomp = timeRuns(options, [&]() {
+        inflateReset(&d);
+        d.next_in = compressed.data();
+        d.avail_in = (uInt)out_size;
+        d.next_out = restored.data();
+        d.avail_out = (uInt)restored.size();
+        inflate(&d, Z_FINISH);
+    });
+    bool ok = d.total_out == data.size() && restored == data;
+    deflateEnd(&c);
+    inflateEnd(&d);
+    report(options, corpus, "zlib-" + std::to_string(level), data.size(), out_size, comp, decomp, ok);
+    return ok;
+}
+#endif
+
+static std::vector<std::string> splitList (const std::string& s) {
+    std::vector<std::string> out;
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+        if (end > start) {
+            out.push_back(s.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return out;
+}
+
+static void usage () {
+    std::cerr << "usage: deflate_bench [--size MB] [--reps N] [--warmup N] [--levels 0,1,2,3] [--corpus text,json,logs,bmp,random,zeros,mixed] [--no-zlib] [--csv]\n";
+}
+
+int main (int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--size" && has_value) {
+            options.size = (size_t)(std::atof(argv[++i]) * (1 << 20));
+        } else if (arg == "--reps" && has_value) {
+            options.reps = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--warmup" && has_value) {
+            options.warmup = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--levels" && has_value) {
+            options.levels.clear();
+            for (const std::string& l : splitList(argv[++i])) {
+                options.levels.push_back(std::atoi(l.c_str()));
+            }
+        } else if (arg == "--corpus" && has_value) {
+            options.corpora = splitList(argv[++i]);
+        } else if (arg == "--no-zlib") {
+            options.zlib = false;
+        } else if (arg == "--csv") {
+            options.csv = true;
+        } else {
+            usage();
+            return (arg == "--help" || arg == "-h") ? 0 : 1;
+        }
+    }
+    if (options.size == 0) {
+        usage();
+        return 1;
+    }
+
+    if (options.csv) {
+        std::printf("corpus,codec,in_bytes,out_bytes,ratio,comp_p50_mbs,comp_p10_mbs,comp_p90_mbs,decomp_p50_mbs,decomp_p10_mbs,decomp_p90_mbs,ok\n");
+    } else {
+        std::printf("%zu MB per corpus, %zu reps after %zu warm-up, MB/s of uncompressed data as p50 / p10 / p90\n\n",
+            options.size >> 20, options.reps, options.warmup);
+        std::printf("%-7s %-9s %8s  %26s  %26s\n", "corpus", "codec", "ratio", "compress MB/s", "decompress MB/s");
+    }
+    bool failed = false;
+    for (const Corpus& corpus : corpora) {
+        if (!options.corpora.empty() && std::find(options.corpora.begin(), options.corpora.end(), corpus.name) == options.corpora.end()) {
+            continue;
+        }
+        std::vector<uint8_t> data = corpus.make(options.size, 1);
+        for (int level : options.levels) {
+            try {
+                failed |= !benchDeflate(options, corpus.name, data, level);
+            } catch (const std::exception& e) {
+                std::fprintf(stderr, "%s deflate-%d: %s\n", corpus.name, level, e.what());
+                failed = true;
+            }
+        }
+        #ifdef DEFLATE_BENCH_ZLIB
+        if (options.zlib) {
+            for (int level : {1, 6, 9}) {
+                failed |= !benchZlib(options, corpus.name, data, level);
+            }
+        }
+        #endif
+        if (!options.csv) {
+            std::printf("\n");
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -1,12 +1,59 @@
 #include "../include/deflate.hpp"
 #include "../include/inflate.hpp"
+#include <atomic>
 #include <cstddef>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <new>
 #include <filesystem>
+#include <random>
 #include <vector>
 #include "../build/external/include/libdeflate.h"
 
+// counts every operator new so the reuse test can check a warmed up context stays off the heap
+// atomic since the parallel calls allocate from their workers, and every plain, array and nothrow form is replaced
+// so nothing the library allocates gets freed through these
+static std::atomic<size_t> allocations(0);
+static void* countedAlloc(size_t size) noexcept {
+    allocations++;
+    return std::malloc(size ? size : 1);
+}
+void* operator new(size_t size) {
+    void* p = countedAlloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) {
+    void* p = countedAlloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+
 struct File {
     char* data;
     size_t size;
@@ -253,6 +300,978 @@ void testInflateZlibFile(std::string path) {
     std::cerr << "[PASS] inflate::decompressZlib matches libdeflate: " << path << "\n";
 }
 
+// True if libdeflate decompresses the raw DEFLATE data back to original.
+bool libdeflateInflatesTo(File& original, const void* compressed, size_t compressedSize) {
+    libdeflate_decompressor* decompressor = libdeflate_alloc_decompressor();
+    File libInflated(original.size + 1);
+    size_t libInflatedSize = 0;
+    libdeflate_result libResult = libdeflate_deflate_decompress(
+        decompressor,
+        compressed, compressedSize,
+        libInflated.data, libInflated.size,
+        &libInflatedSize);
+    libdeflate_free_decompressor(decompressor);
+    libInflated.size = libInflatedSize;
+    return libResult == LIBDEFLATE_SUCCESS && sameData(&original, &libInflated);
+}
+
+// Compresses a file straight into a compressBound sized buffer, checks libdeflate
+// reads it back, then checks that a buffer which is too small throws.
+void testCompressBound(std::string path, int compressionLevel) {
+    File original = readFile(path);
+    size_t bound = deflate::compressBound(original.size);
+    File compressed(bound);
+    size_t compressedSize = deflate::compress(original.data, original.size, compressed.data, bound, compressionLevel);
+
+    if (!libdeflateInflatesTo(original, compressed.data, compressedSize)) {
+        std::cerr << "[FAIL] compress into caller buffer does not round-trip for " << path << "\n";
+        return;
+    }
+
+    bool threw = false;
+    try {
+        deflate::compress(original.data, original.size, compressed.data, compressedSize / 2, compressionLevel);
+    } catch (std::runtime_error& e) {
+        threw = true;
+    }
+    std::cerr << (threw
+        ? "[PASS] compress into caller buffer (" + std::to_string(compressedSize) + " of " + std::to_string(bound) + " bytes): " + path + "\n"
+        : "[FAIL] compress into an undersized buffer did not throw for " + path + "\n");
+}
+
+// Feeds a file to deflate::Stream in small pieces with sync and full flushes
+// mixed in, checks every flushed frame ends byte aligned on the empty stored
+// block, then checks libdeflate reads the whole stream back.
+void testStreamCompress(std::string path, int compressionLevel, size_t pieceSize) {
+    File original = readFile(path);
+    deflate::Stream stream(compressionLevel);
+    std::vector<uint8_t> compressed;
+    size_t pieces = 0;
+    for (size_t i = 0; i < original.size; i += pieceSize, pieces++) {
+        size_t n = std::min(pieceSize, original.size - i);
+        deflate::Flush flush = deflate::NO_FLUSH;
+        if (pieces % 4 == 3) {
+            flush = deflate::SYNC_FLUSH;
+        } else if (pieces % 9 == 8) {
+            flush = deflate::FULL_FLUSH;
+        }
+        std::vector<uint8_t> frame = stream.compress(original.data + i, n, flush);
+        if (flush != deflate::NO_FLUSH) {
+            size_t end = frame.size();
+            if (end < 4 || frame[end - 4] != 0 || frame[end - 3] != 0 || frame[end - 2] != 0xff || frame[end - 1] != 0xff) {
+                std::cerr << "[FAIL] deflate::Stream flush is not byte aligned for " << path << "\n";
+                return;
+            }
+        }
+        compressed.insert(compressed.end(), frame.begin(), frame.end());
+    }
+    std::vector<uint8_t> last = stream.finish();
+    compressed.insert(compressed.end(), last.begin(), last.end());
+
+    std::cerr << (libdeflateInflatesTo(original, compressed.data(), compressed.size())
+        ? "[PASS] deflate::Stream round-trip (" + std::to_string(compressed.size()) + " bytes): " + path + "\n"
+        : "[FAIL] deflate::Stream round-trip for " + path + "\n");
+}
+
+// Compresses a file with a given strategy and checks libdeflate reads it back.
+void testStrategy(std::string path, int compressionLevel, deflate::Strategy strategy, std::string name) {
+    File original = readFile(path);
+    std::vector<uint8_t> compressed = deflate::compress(original.data, original.size, compressionLevel, strategy);
+    std::cerr << (libdeflateInflatesTo(original, compressed.data(), compressed.size())
+        ? "[PASS] " + name + " strategy (" + std::to_string(compressed.size()) + " bytes): " + path + "\n"
+        : "[FAIL] " + name + " strategy round-trip for " + path + "\n");
+}
+
+// Random bytes should be caught by the incompressibility probe and go out as
+// stored blocks: no bigger than the stored framing and still a valid stream.
+void testIncompressible(size_t size, int compressionLevel) {
+    File original(size);
+    uint32_t state = 0x12345678;
+    for (size_t i = 0; i < size; i++) {
+        state = state * 1664525 + 1013904223;
+        original.data[i] = (char)(state >> 24);
+    }
+    std::vector<uint8_t> compressed = deflate::compress(original.data, original.size, compressionLevel);
+    size_t storedSize = size + (size / KB32 + 1) * 5;
+    bool ok = compressed.size() <= storedSize + 1 && libdeflateInflatesTo(original, compressed.data(), compressed.size());
+    std::cerr << (ok
+        ? "[PASS] incompressible input stored (" + std::to_string(compressed.size()) + " bytes for " + std::to_string(size) + ")\n"
+        : "[FAIL] incompressible input was not stored cleanly\n");
+}
+
+// Pins the kernels to scalar, SSE2 and then everything the CPU has, and checks
+// each set compresses to the same bytes and inflates libdeflate output back.
+void testKernelVariants(std::string path) {
+    File original = readFile(path);
+    libdeflate_compressor* compressor = libdeflate_alloc_compressor(6);
+    File libCompressed(original.size + 100);
+    size_t libCompressedSize = libdeflate_deflate_compress(
+        compressor, original.data, original.size,
+        libCompressed.data, original.size + 100);
+    libdeflate_free_compressor(compressor);
+
+    deflate_cpu::Features all = deflate_cpu::detected();
+    deflate_cpu::Features sse2;
+    sse2.sse2 = true;
+    std::vector<std::pair<std::string, deflate_cpu::Features>> variants = {
+        {"scalar", deflate_cpu::Features()}, {"sse2", sse2}, {"detected", all}
+    };
+    std::vector<uint8_t> reference;
+    bool ok = true;
+    for (auto& variant : variants) {
+        deflate_cpu::restrict(variant.second);
+        std::vector<uint8_t> compressed = deflate::compress(original.data, original.size, 2);
+        if (reference.empty()) {
+            reference = compressed;
+        }
+        std::vector<uint8_t> inflated = inflate::decompress(libCompressed.data, libCompressedSize);
+        File roundTrip(inflated.size());
+        std::memcpy(roundTrip.data, inflated.data(), inflated.size());
+        if (compressed != reference || !sameData(&original, &roundTrip)) {
+            std::cerr << "[FAIL] " << variant.first << " kernels disagree for " << path << "\n";
+            ok = false;
+        }
+    }
+    deflate_cpu::restrict(all);
+    if (ok) {
+        std::cerr << "[PASS] scalar, sse2 and detected kernels agree: " << path << "\n";
+    }
+}
+
+void testContextReuse(std::string path, int level) {
+    File original = readFile(path);
+    std::vector<uint8_t> expected = deflate::compress(original.data, original.size, level);
+    deflate::Compressor compressor(level);
+    inflate::Decompressor decompressor;
+    std::vector<uint8_t> compressed(deflate::compressBound(original.size));
+    File roundTrip(original.size);
+    bool ok = true;
+    size_t warm = 0;
+    for (int i = 0; i < 3; i++) {
+        if (i == 1) {
+            warm = allocations;
+        }
+        size_t size = compressor.compress(original.data, original.size, compressed.data(), compressed.size());
+        size_t out = decompressor.decompress(compressed.data(), size, roundTrip.data, roundTrip.size);
+        if (size != expected.size() || std::memcmp(compressed.data(), expected.data(), size) != 0) {
+            std::cerr << "[FAIL] Compressor output differs from deflate::compress for " << path << " on call " << i << "\n";
+            ok = false;
+        }
+        if (out != original.size || !sameData(&original, &roundTrip)) {
+            std::cerr << "[FAIL] Decompressor round-trip mismatch for " << path << " on call " << i << "\n";
+            ok = false;
+        }
+    }
+    if (allocations != warm) {
+        std::cerr << "[FAIL] " << (allocations - warm) << " heap allocations after warm-up for " << path << "\n";
+        ok = false;
+    }
+    if (ok) {
+        std::cerr << "[PASS] reused Compressor/Decompressor (level " << level << ", no allocations after warm-up): " << path << "\n";
+    }
+}
+
+struct PoolStats {
+    size_t live = 0;
+    size_t peak = 0;
+};
+
+void testCallbackAllocator(std::string path, int level) {
+    File original = readFile(path);
+    PoolStats stats;
+    deflate_memory::Callbacks callbacks;
+    callbacks.opaque = &stats;
+    callbacks.alloc = [](void* opaque, size_t size, size_t alignment) -> void* {
+        PoolStats* s = (PoolStats*)opaque;
+        s->live += size;
+        s->peak = std::max(s->peak, s->live);
+        return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    };
+    callbacks.free = [](void* opaque, void* p, size_t size, size_t) {
+        ((PoolStats*)opaque)->live -= size;
+        std::free(p);
+    };
+    deflate_memory::CallbackResource pool(callbacks);
+    std::vector<uint8_t> compressed(deflate::compressBound(original.size));
+    File roundTrip(original.size);
+    size_t before = allocations;
+    size_t out = 0;
+    {
+        deflate::Compressor compressor(level, deflate::DEFAULT_STRATEGY, &pool);
+        inflate::Decompressor decompressor(&pool);
+        size_t size = compressor.compress(original.data, original.size, compressed.data(), compressed.size());
+        out = decompressor.decompress(compressed.data(), size, roundTrip.data, roundTrip.size);
+    }
+    bool ok = true;
+    if (out != original.size || !sameData(&original, &roundTrip)) {
+        std::cerr << "[FAIL] round-trip through the callback allocator mismatched for " << path << "\n";
+        ok = false;
+    }
+    if (allocations != before) {
+        std::cerr << "[FAIL] " << (allocations - before) << " allocations bypassed the callbacks for " << path << "\n";
+        ok = false;
+    }
+    if (stats.peak == 0 || stats.live != 0) {
+        std::cerr << "[FAIL] callbacks saw peak " << stats.peak << " and " << stats.live << " bytes never freed for " << path << "\n";
+        ok = false;
+    }
+    if (ok) {
+        std::cerr << "[PASS] all working memory through the callbacks (level " << level << ", peak " << stats.peak << " bytes): " << path << "\n";
+    }
+}
+
+void testBatch(std::string path, int level) {
+    File original = readFile(path);
+    // records of 2 to 64 KB cut out of the file, plus an empty one
+    std::vector<std::pair<size_t, size_t>> records;
+    size_t sizes[] = {2048, 65536, 7000, 32768, 12345, 40000, 0};
+    for (size_t offset = 0, k = 0; offset < original.size; k++) {
+        size_t size = std::min(sizes[k % 7], original.size - offset);
+        records.push_back({offset, size});
+        offset += size;
+    }
+    std::vector<std::vector<uint8_t>> compressed(records.size());
+    std::vector<deflate::BatchItem> items(records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        compressed[i].resize(deflate::compressBound(records[i].second));
+        items[i].in = original.data + records[i].first;
+        items[i].in_size = records[i].second;
+        items[i].out = compressed[i].data();
+        items[i].out_cap = compressed[i].size();
+    }
+    bool ok = deflate::compressBatch(items, level, deflate::DEFAULT_STRATEGY, 4) == 0;
+    File roundTrip(original.size);
+    std::vector<inflate::BatchItem> back(records.size());
+    for (size_t i = 0; i < records.size() && ok; i++) {
+        std::vector<uint8_t> expected = deflate::compress(original.data + records[i].first, records[i].second, level);
+        if (items[i].out_size != expected.size() || std::memcmp(compressed[i].data(), expected.data(), expected.size()) != 0) {
+            std::cerr << "[FAIL] batch item " << i << " differs from deflate::compress for " << path << "\n";
+            ok = false;
+        }
+        back[i].in = compressed[i].data();
+        back[i].in_size = items[i].out_size;
+        back[i].out = roundTrip.data + records[i].first;
+        back[i].out_cap = records[i].second;
+    }
+    // one that can't fit has to fail on its own without taking the batch down
+    uint8_t small[16];
+    inflate::BatchItem too_small;
+    too_small.in = compressed[1].data();
+    too_small.in_size = items[1].out_size;
+    too_small.out = small;
+    too_small.out_cap = sizeof(small);
+    back.push_back(too_small);
+    if (ok && inflate::decompressBatch(back, 4) != 1) {
+        std::cerr << "[FAIL] decompressBatch should fail exactly the undersized item for " << path << "\n";
+        ok = false;
+    }
+    if (ok && (back.back().ok || back.back().error.empty())) {
+        std::cerr << "[FAIL] undersized batch item wasn't reported for " << path << "\n";
+        ok = false;
+    }
+    if (ok && !sameData(&original, &roundTrip)) {
+        std::cerr << "[FAIL] batch round-trip mismatch for " << path << "\n";
+        ok = false;
+    }
+    if (ok) {
+        std::cerr << "[PASS] compressBatch/decompressBatch over " << records.size() << " records (level " << level << "): " << path << "\n";
+    }
+}
+
+void testBatchReuse(std::string path, int level) {
+    File original = readFile(path);
+    deflate::BatchCompressor compressor(level, deflate::DEFAULT_STRATEGY, 3);
+    inflate::BatchDecompressor decompressor(3);
+    bool ok = true;
+    // the same workers take several batches of different sizes, an empty one included
+    size_t record = 9000;
+    size_t batches[] = {original.size / record, 0, 5, 1};
+    for (size_t batch : batches) {
+        std::vector<std::vector<uint8_t>> compressed(batch);
+        std::vector<deflate::BatchItem> items(batch);
+        for (size_t i = 0; i < batch; i++) {
+            size_t size = std::min(record, original.size - i * record);
+            compressed[i].resize(deflate::compressBound(size));
+            items[i].in = original.data + i * record;
+            items[i].in_size = size;
+            items[i].out = compressed[i].data();
+            items[i].out_cap = compressed[i].size();
+        }
+        if (compressor.compress(items) != 0) {
+            std::cerr << "[FAIL] BatchCompressor failed items for " << path << "\n";
+            ok = false;
+            break;
+        }
+        File roundTrip(original.size);
+        std::vector<inflate::BatchItem> back(batch);
+        for (size_t i = 0; i < batch; i++) {
+            std::vector<uint8_t> expected = deflate::compress(original.data + i * record, items[i].in_size, level);
+            if (items[i].out_size != expected.size() || std::memcmp(compressed[i].data(), expected.data(), expected.size()) != 0) {
+                std::cerr << "[FAIL] BatchCompressor item " << i << " differs from deflate::compress for " << path << "\n";
+                ok = false;
+            }
+            back[i].in = compressed[i].data();
+            back[i].in_size = items[i].out_size;
+            back[i].out = roundTrip.data + i * record;
+            back[i].out_cap = items[i].in_size;
+        }
+        if (ok && (decompressor.decompress(back) != 0 || std::memcmp(roundTrip.data, original.data, std::min(batch * record, original.size)) != 0)) {
+            std::cerr << "[FAIL] BatchDecompressor round-trip mismatch for " << path << "\n";
+            ok = false;
+        }
+        if (!ok) {
+            break;
+        }
+    }
+    if (ok) {
+        std::cerr << "[PASS] BatchCompressor/BatchDecompressor reused over " << std::size(batches) << " batches on " << compressor.threads() << " workers (level " << level << "): " << path << "\n";
+    }
+}
+
+void testSourceSink(std::string path, int level) {
+    File original = readFile(path);
+    // hands out at most 1000 bytes a read, the compressor has to keep going until its chunk is full
+    size_t offset = 0;
+    deflate_io::CallbackSource source([&](uint8_t* dst, size_t n) -> size_t {
+        size_t take = std::min({n, (size_t)1000, original.size - offset});
+        std::memcpy(dst, original.data + offset, take);
+        offset += take;
+        return take;
+    });
+    FILE* f = std::tmpfile();
+    deflate_io::FileSink file_sink(f);
+    size_t compressed_size = deflate::compressSource(source, file_sink, level);
+    std::rewind(f);
+    std::vector<uint8_t> compressed(compressed_size);
+    size_t read = std::fread(compressed.data(), 1, compressed_size, f);
+    std::vector<uint8_t> expected = deflate::compress(original.data, original.size, level);
+    std::rewind(f);
+    std::vector<uint8_t> inflated;
+    deflate_io::FileSource file_source(f);
+    deflate_io::VectorSink vector_sink(inflated);
+    size_t size = inflate::decompressSource(file_source, vector_sink);
+    std::fclose(f);
+    File roundTrip(inflated.size());
+    std::memcpy(roundTrip.data, inflated.data(), inflated.size());
+    if (read != compressed_size || compressed != expected) {
+        std::cerr << "[FAIL] compressSource output differs from deflate::compress for " << path << "\n";
+    } else if (size != original.size || !sameData(&original, &roundTrip)) {
+        std::cerr << "[FAIL] decompressSource round-trip mismatch for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] callback source -> FILE* -> vector sink (level " << level << "): " << path << "\n";
+    }
+}
+
+void testPipeline(std::string path, int level) {
+    File original = readFile(path);
+    std::vector<uint8_t> expected = deflate::compress(original.data, original.size, level);
+    // tiny rings so both threads spend most of their time waiting on each other
+    std::vector<uint8_t> compressed;
+    {
+        deflate_io::MemorySource source(original.data, original.size);
+        deflate_io::ReadAhead<deflate_io::MemorySource> ahead(source, 5000, 2);
+        deflate_io::VectorSink vector_sink(compressed);
+        deflate_io::WriteBehind<deflate_io::VectorSink> sink(vector_sink, 3000, 3);
+        deflate::compressSource(ahead, sink, level);
+        sink.finish();
+    }
+    std::vector<uint8_t> inflated;
+    {
+        deflate_io::MemorySource source(compressed.data(), compressed.size());
+        deflate_io::ReadAhead<deflate_io::MemorySource> ahead(source, 777, 2);
+        deflate_io::VectorSink vector_sink(inflated);
+        deflate_io::WriteBehind<deflate_io::VectorSink> sink(vector_sink, 10000, 2);
+        inflate::decompressSource(ahead, sink);
+        sink.finish();
+    }
+    // a sink that fails on the writer thread has to surface on the compressing one
+    bool rethrown = false;
+    try {
+        deflate_io::CallbackSink failing([&](const uint8_t*, size_t) -> void {
+            throw std::runtime_error("disk full");
+        });
+        deflate_io::MemorySource source(original.data, original.size);
+        deflate_io::WriteBehind<decltype(failing)> sink(failing, 1024, 2);
+        deflate::compressSource(source, sink, level);
+        sink.finish();
+    } catch (const std::runtime_error& e) {
+        rethrown = std::string(e.what()) == "disk full";
+    }
+    File roundTrip(inflated.size());
+    std::memcpy(roundTrip.data, inflated.data(), inflated.size());
+    if (compressed != expected) {
+        std::cerr << "[FAIL] pipelined compress output differs from deflate::compress for " << path << "\n";
+    } else if (!sameData(&original, &roundTrip)) {
+        std::cerr << "[FAIL] pipelined decompress round-trip mismatch for " << path << "\n";
+    } else if (!rethrown) {
+        std::cerr << "[FAIL] writer error didn't reach the caller for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] read ahead -> compress -> write behind (level " << level << "): " << path << "\n";
+    }
+}
+
+void testGzip(std::string path, int level) {
+    File original = readFile(path);
+    deflate::GzipHeader header;
+    header.name = path;
+    header.comment = "written by deflate.hpp";
+    header.extra = {'d', 'h', 2, 0, 1, 2};
+    header.mtime = 1700000000;
+    header.os = 3;
+    header.header_crc = true;
+    std::vector<uint8_t> gz = deflate::compressGzip(original.data, original.size, level, deflate::DEFAULT_STRATEGY, header);
+    bool libReads = false;
+    {
+        libdeflate_decompressor* decompressor = libdeflate_alloc_decompressor();
+        File libInflated(original.size + 1);
+        size_t libInflatedSize = 0;
+        libdeflate_result r = libdeflate_gzip_decompress(decompressor, gz.data(), gz.size(), libInflated.data, libInflated.size, &libInflatedSize);
+        libdeflate_free_decompressor(decompressor);
+        libInflated.size = libInflatedSize;
+        libReads = r == LIBDEFLATE_SUCCESS && sameData(&original, &libInflated);
+    }
+    libdeflate_compressor* compressor = libdeflate_alloc_compressor(6);
+    File libCompressed(original.size + 100);
+    size_t libCompressedSize = libdeflate_gzip_compress(compressor, original.data, original.size, libCompressed.data, libCompressed.size);
+    libdeflate_free_compressor(compressor);
+    std::vector<uint8_t> fromLib = inflate::decompressGzip(libCompressed.data, libCompressedSize);
+
+    // two members back to back decode to both outputs, the header comes from the first
+    std::vector<uint8_t> twice = gz;
+    twice.insert(twice.end(), libCompressed.data, libCompressed.data + libCompressedSize);
+    deflate::GzipHeader read;
+    std::vector<uint8_t> both = inflate::decompressGzip(twice.data(), twice.size(), &read);
+    bool headerKept = read.name == header.name && read.comment == header.comment && read.extra == header.extra &&
+        read.mtime == header.mtime && read.os == header.os && read.header_crc;
+
+    bool corruptCaught = false;
+    std::vector<uint8_t> corrupt = gz;
+    corrupt[corrupt.size() - 8] ^= 1;
+    try {
+        inflate::decompressGzip(corrupt.data(), corrupt.size());
+    } catch (const std::runtime_error&) {
+        corruptCaught = true;
+    }
+
+    // both crc kernels against libdeflate's
+    uint32_t expectedCrc = libdeflate_crc32(0, original.data, original.size);
+    deflate_cpu::Features all = deflate_cpu::detected();
+    deflate_cpu::restrict(deflate_cpu::Features());
+    uint32_t scalarCrc = deflate_cpu::kernels().crc32(0, (const uint8_t*)original.data, original.size);
+    deflate_cpu::restrict(all);
+    uint32_t detectedCrc = deflate_cpu::kernels().crc32(0, (const uint8_t*)original.data, original.size);
+
+    deflate::compressGzip(path, "hppdeflate_gz", level);
+    size_t fileSize = inflate::decompressGzip("hppdeflate_gz", "hppinflate_gz");
+    File roundTrip = readFile("hppinflate_gz");
+
+    std::vector<uint8_t> expectedBoth(original.data, original.data + original.size);
+    expectedBoth.insert(expectedBoth.end(), original.data, original.data + original.size);
+    if (!libReads) {
+        std::cerr << "[FAIL] libdeflate can't read compressGzip output for " << path << "\n";
+    } else if (fromLib != std::vector<uint8_t>(original.data, original.data + original.size)) {
+        std::cerr << "[FAIL] decompressGzip can't read libdeflate gzip output for " << path << "\n";
+    } else if (both != expectedBoth || !headerKept) {
+        std::cerr << "[FAIL] multi-member gzip or header fields wrong for " << path << "\n";
+    } else if (!corruptCaught) {
+        std::cerr << "[FAIL] corrupt gzip crc not caught for " << path << "\n";
+    } else if (scalarCrc != expectedCrc || detectedCrc != expectedCrc) {
+        std::cerr << "[FAIL] crc-32 kernels disagree with libdeflate for " << path << "\n";
+    } else if (fileSize != original.size || !sameData(&original, &roundTrip)) {
+        std::cerr << "[FAIL] gzip file round-trip mismatch for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] gzip both ways with libdeflate, multi-member, crc checked (level " << level << "): " << path << "\n";
+    }
+}
+
+void testZlib(std::string path, int level) {
+    File original = readFile(path);
+    std::vector<uint8_t> originalBytes(original.data, original.data + original.size);
+    std::vector<uint8_t> z = deflate::compressZlib(original.data, original.size, level);
+    bool libReads = false;
+    {
+        libdeflate_decompressor* decompressor = libdeflate_alloc_decompressor();
+        File libInflated(original.size + 1);
+        size_t libInflatedSize = 0;
+        libdeflate_result r = libdeflate_zlib_decompress(decompressor, z.data(), z.size(), libInflated.data, libInflated.size, &libInflatedSize);
+        libdeflate_free_decompressor(decompressor);
+        libInflated.size = libInflatedSize;
+        libReads = r == LIBDEFLATE_SUCCESS && sameData(&original, &libInflated);
+    }
+    libdeflate_compressor* compressor = libdeflate_alloc_compressor(6);
+    File libCompressed(original.size + 100);
+    size_t libCompressedSize = libdeflate_zlib_compress(compressor, original.data, original.size, libCompressed.data, libCompressed.size);
+    libdeflate_free_compressor(compressor);
+    std::vector<uint8_t> fromLib = inflate::decompressZlib(libCompressed.data, libCompressedSize);
+
+    // a flipped trailer bit, a header that fails FCHECK and a non deflate method all have to be refused
+    size_t caught = 0;
+    std::vector<std::vector<uint8_t>> broken(3, z);
+    broken[0][z.size() - 1] ^= 1;
+    broken[1][1] ^= 1;
+    broken[2][0] = 0x77;
+    for (auto& b : broken) {
+        try {
+            inflate::decompressZlib(b.data(), b.size());
+        } catch (const std::runtime_error&) {
+            caught++;
+        }
+    }
+
+    uint32_t expectedAdler = libdeflate_adler32(1, original.data, original.size);
+    deflate_cpu::Features all = deflate_cpu::detected();
+    deflate_cpu::Features ssse3;
+    ssse3.ssse3 = true;
+    bool kernelsAgree = true;
+    for (auto& features : {deflate_cpu::Features(), ssse3, all}) {
+        deflate_cpu::restrict(features);
+        kernelsAgree = kernelsAgree && deflate_cpu::kernels().adler32(1, (const uint8_t*)original.data, original.size) == expectedAdler;
+    }
+    deflate_cpu::restrict(all);
+
+    if (!libReads) {
+        std::cerr << "[FAIL] libdeflate can't read compressZlib output for " << path << "\n";
+    } else if (fromLib != originalBytes) {
+        std::cerr << "[FAIL] decompressZlib can't read libdeflate zlib output for " << path << "\n";
+    } else if (caught != broken.size()) {
+        std::cerr << "[FAIL] corrupt zlib data not caught for " << path << "\n";
+    } else if (!kernelsAgree) {
+        std::cerr << "[FAIL] adler-32 kernels disagree with libdeflate for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] zlib both ways with libdeflate, header and adler-32 checked (level " << level << "): " << path << "\n";
+    }
+}
+
+// rpc style json messages that share their keys and little else
+std::vector<std::vector<uint8_t>> makeMessages(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    const char* statuses[] = {"ok", "pending", "failed", "retrying"};
+    const char* regions[] = {"us-east-1", "eu-west-2", "ap-south-1"};
+    std::vector<std::vector<uint8_t>> messages;
+    for (size_t i = 0; i < count; i++) {
+        std::string m = "{\"request_id\":\"" + std::to_string(rng()) + "\",\"user_name\":\"user" + std::to_string(rng() % 100000) +
+            "\",\"timestamp\":" + std::to_string(1700000000 + rng() % 1000000) + ",\"status\":\"" + statuses[rng() % 4] +
+            "\",\"region\":\"" + regions[rng() % 3] + "\",\"payload\":{\"items\":[";
+        size_t items = 1 + rng() % 12;
+        for (size_t j = 0; j < items; j++) {
+            m += std::string(j ? "," : "") + "{\"sku\":\"SKU-" + std::to_string(rng() % 1000000) + "\",\"quantity\":" + std::to_string(rng() % 50) +
+                ",\"unit_price_cents\":" + std::to_string(rng() % 100000) + ",\"currency\":\"USD\",\"gift_wrap\":" + (rng() % 2 ? "true" : "false") + "}";
+        }
+        m += "]},\"trace\":{\"span_id\":\"" + std::to_string(rng()) + "\",\"sampled\":true}}";
+        messages.emplace_back(m.begin(), m.end());
+    }
+    return messages;
+}
+
+void testDictionary(int level) {
+    std::vector<std::vector<uint8_t>> training = makeMessages(200, 1);
+    std::vector<std::vector<uint8_t>> messages = makeMessages(100, 2);
+    std::vector<uint8_t> bytes = deflate::buildDictionary(training);
+    deflate::Dictionary dictionary(bytes);
+    deflate::Compressor compressor(level);
+    inflate::Decompressor decompressor;
+    size_t raw = 0;
+    size_t plain = 0;
+    size_t withDictionary = 0;
+    bool ok = bytes.size() <= 32768;
+    for (auto& m : messages) {
+        raw += m.size();
+        plain += deflate::compress((char*)m.data(), m.size(), level).size();
+        std::vector<uint8_t> c = compressor.compress(m.data(), m.size(), dictionary);
+        withDictionary += c.size();
+        std::vector<uint8_t> out(m.size());
+        size_t n = decompressor.decompress(c.data(), c.size(), out.data(), out.size(), bytes.data(), bytes.size());
+        ok = ok && n == m.size() && out == m;
+        ok = ok && c == deflate::compress(m.data(), m.size(), dictionary, level);
+        ok = ok && inflate::decompressWithDictionary(c.data(), c.size(), bytes.data(), bytes.size()) == m;
+        std::vector<uint8_t> z = deflate::compressZlib(m.data(), m.size(), dictionary, level);
+        ok = ok && inflate::decompressZlibWithDictionary(z.data(), z.size(), bytes.data(), bytes.size()) == m;
+    }
+    // a zlib stream with FDICT set can't be read without its dictionary or with a different one
+    std::vector<uint8_t> z = deflate::compressZlib(messages[0].data(), messages[0].size(), dictionary, level);
+    size_t refused = 0;
+    try {
+        inflate::decompressZlib(z.data(), z.size());
+    } catch (const std::runtime_error&) {
+        refused++;
+    }
+    try {
+        inflate::decompressZlibWithDictionary(z.data(), z.size(), bytes.data(), bytes.size() - 1);
+    } catch (const std::runtime_error&) {
+        refused++;
+    }
+    std::cerr << "   " << messages.size() << " messages, " << raw << " bytes: " << plain << " compressed plain, "
+              << withDictionary << " with a " << bytes.size() << " byte dictionary\n";
+    if (!ok) {
+        std::cerr << "[FAIL] dictionary round-trip mismatch (level " << level << ")\n";
+    } else if (refused != 2) {
+        std::cerr << "[FAIL] zlib stream decoded without its dictionary (level " << level << ")\n";
+    } else if (withDictionary * 10 > plain * 6) {
+        std::cerr << "[FAIL] dictionary saved less than 40% (level " << level << ")\n";
+    } else {
+        std::cerr << "[PASS] preset dictionary, raw and zlib (level " << level << ")\n";
+    }
+}
+
+// ranges pulled out through an index, raw from libdeflate and gzip with two members so a range can cross into the second one
+void testIndex(std::string path, int level, size_t span) {
+    File original = readFile(path);
+    std::vector<uint8_t> originalBytes(original.data, original.data + original.size);
+    libdeflate_compressor* compressor = libdeflate_alloc_compressor(6);
+    std::vector<uint8_t> raw(original.size + 1000);
+    raw.resize(libdeflate_deflate_compress(compressor, original.data, original.size, raw.data(), raw.size()));
+    libdeflate_free_compressor(compressor);
+    size_t half = original.size / 2;
+    std::vector<uint8_t> gz = deflate::compressGzip(original.data, half, level);
+    std::vector<uint8_t> second = deflate::compressGzip(original.data + half, original.size - half, level);
+    gz.insert(gz.end(), second.begin(), second.end());
+
+    bool ok = true;
+    size_t points = 0;
+    std::mt19937 rng(7);
+    std::vector<uint8_t> out(3 * span);
+    for (auto format : {inflate::RAW, inflate::GZIP}) {
+        std::vector<uint8_t>& z = (format == inflate::RAW) ? raw : gz;
+        inflate::Index built = inflate::buildIndex(z.data(), z.size(), format, span);
+        // the sidecar has to come back the same as the index it was saved from
+        built.save("hppindex_sidecar");
+        inflate::Index index = inflate::Index::load("hppindex_sidecar");
+        ok = ok && index.serialize() == built.serialize() && index.out_size == original.size;
+        points += index.points.size();
+        writeBufferToFile((char*)z.data(), z.size(), "hppindex_data");
+        for (int i = 0; i < 40 && ok; i++) {
+            uint64_t offset = (i == 0) ? half - span / 2 : rng() % (original.size + 10);
+            size_t len = (i == 1) ? out.size() : rng() % out.size();
+            size_t expected = (offset < original.size) ? std::min<size_t>(len, original.size - offset) : 0;
+            size_t got = inflate::extract(index, z.data(), z.size(), offset, out.data(), len);
+            ok = ok && got == expected && std::equal(out.begin(), out.begin() + got, originalBytes.begin() + offset);
+            got = inflate::extract(index, "hppindex_data", offset, out.data(), len);
+            ok = ok && got == expected && std::equal(out.begin(), out.begin() + got, originalBytes.begin() + offset);
+        }
+    }
+
+    // an index for other data or a damaged sidecar has to be refused rather than decode garbage
+    size_t refused = 0;
+    inflate::Index index = inflate::buildIndex(raw.data(), raw.size(), inflate::RAW, span);
+    std::vector<uint8_t> bytes = index.serialize();
+    for (size_t cut : {bytes.size() / 2, (size_t)5}) {
+        try {
+            inflate::Index::deserialize(bytes.data(), cut);
+        } catch (const std::runtime_error&) {
+            refused++;
+        }
+    }
+    try {
+        inflate::extract(index, gz.data(), gz.size(), 0, out.data(), out.size());
+    } catch (const std::runtime_error&) {
+        refused++;
+    }
+
+    if (!ok) {
+        std::cerr << "[FAIL] indexed range mismatch for " << path << "\n";
+    } else if (refused != 3) {
+        std::cerr << "[FAIL] bad index accepted for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] indexed random access, raw and gzip, " << points << " checkpoints: " << path << "\n";
+    }
+}
+
+// seekable output has to read as a normal stream and chunk by chunk, raw with a sidecar table and gzip carrying its own
+void testSeekable(std::string path, int level, size_t chunkSize) {
+    File original = readFile(path);
+    std::vector<uint8_t> originalBytes(original.data, original.data + original.size);
+    deflate::SeekTable table;
+    std::vector<uint8_t> raw = deflate::compressSeekable(original.data, original.size, table, chunkSize, level, deflate::DEFAULT_STRATEGY, 4);
+    std::vector<uint8_t> gz = deflate::compressGzipSeekable(original.data, original.size, chunkSize, level);
+    bool plain = libdeflateInflatesTo(original, raw.data(), raw.size()) && inflate::decompress(raw) == originalBytes
+        && inflate::decompressGzip(gz.data(), gz.size()) == originalBytes;
+
+    table.save("hppseek_sidecar");
+    deflate::SeekTable sidecar = inflate::SeekTable::load("hppseek_sidecar");
+    inflate::SeekTable carried = inflate::readSeekTable(gz.data(), gz.size());
+    bool tables = sidecar.serialize() == table.serialize() && carried.chunks.size() == table.chunks.size() && carried.outSize() == original.size;
+
+    bool chunks = inflate::decompressSeekable(raw.data(), raw.size(), sidecar, 4) == originalBytes
+        && inflate::decompressSeekable(gz.data(), gz.size(), carried) == originalBytes;
+    std::vector<uint8_t> out(chunkSize);
+    for (size_t i = 0; i < carried.chunks.size() && chunks; i += 3) {
+        size_t n = inflate::decompressChunk(gz.data(), gz.size(), carried, i, out.data(), out.size());
+        chunks = n == carried.chunks[i].out_size && std::equal(out.begin(), out.begin() + n, originalBytes.begin() + carried.chunks[i].out_offset);
+    }
+
+    // a table that doesn't belong to the data has to throw instead of decoding garbage
+    size_t refused = 0;
+    deflate::SeekTable wrong = table;
+    wrong.chunks[0].out_size++;
+    for (auto* t : {&wrong, &carried}) {
+        try {
+            inflate::decompressSeekable(raw.data(), raw.size(), *t);
+        } catch (const std::runtime_error&) {
+            refused++;
+        }
+    }
+
+    if (!plain) {
+        std::cerr << "[FAIL] seekable output doesn't read as a normal stream for " << path << "\n";
+    } else if (!tables) {
+        std::cerr << "[FAIL] seek table didn't survive the sidecar or the gzip trailer for " << path << "\n";
+    } else if (!chunks) {
+        std::cerr << "[FAIL] seekable chunk decode mismatch for " << path << "\n";
+    } else if (refused != 2) {
+        std::cerr << "[FAIL] mismatched seek table accepted for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] seekable raw and gzip, " << table.chunks.size() << " chunks, " << raw.size() << " bytes: " << path << "\n";
+    }
+}
+
+// an edit near the start of the input should leave the rest of the rsyncable output byte for byte the same
+void testRsyncable(std::string path, int level, size_t averageChunk) {
+    File original = readFile(path);
+    std::vector<uint8_t> originalBytes(original.data, original.data + original.size);
+    std::vector<uint8_t> edited = originalBytes;
+    edited.insert(edited.begin() + edited.size() / 20, {'e', 'd', 'i', 't'});
+
+    std::vector<uint8_t> raw = deflate::compressRsyncable(originalBytes.data(), originalBytes.size(), averageChunk, level);
+    std::vector<uint8_t> rawEdited = deflate::compressRsyncable(edited.data(), edited.size(), averageChunk, level);
+    std::vector<uint8_t> gz = deflate::compressGzipRsyncable(edited.data(), edited.size(), averageChunk, level);
+    bool ok = libdeflateInflatesTo(original, raw.data(), raw.size()) && inflate::decompress(rawEdited) == edited
+        && inflate::decompressGzip(gz.data(), gz.size()) == edited
+        && inflate::decompressGzipParallel(gz.data(), gz.size(), 4) == edited;
+
+    size_t same = 0;
+    while (same < raw.size() && same < rawEdited.size() && raw[raw.size() - 1 - same] == rawEdited[rawEdited.size() - 1 - same]) {
+        same++;
+    }
+
+    if (!ok) {
+        std::cerr << "[FAIL] rsyncable output mismatch for " << path << "\n";
+    } else if (same < raw.size() / 2) {
+        std::cerr << "[FAIL] rsyncable output didn't resync after an edit for " << path << ", " << same << " of " << raw.size() << " bytes the same\n";
+    } else {
+        std::cerr << "[PASS] rsyncable (level " << level << "), last " << same << " of " << raw.size() << " bytes unchanged by an edit: " << path << "\n";
+    }
+}
+
+// every kind of splittable input has to come out the same as the serial decode, whatever the pieces turned out to be
+void testParallelDecompress(std::string path, int level, size_t copies) {
+    File original = readFile(path);
+    std::vector<uint8_t> data;
+    for (size_t i = 0; i < copies; i++) {
+        data.insert(data.end(), original.data, original.data + original.size);
+        data[data.size() - 1 - i] ^= (uint8_t)i;
+    }
+    size_t piece = 200 * 1024;
+
+    // concatenated members, and BGZF whose "BC" subfield gets patched with each member's size once it's known
+    std::vector<uint8_t> members;
+    std::vector<uint8_t> bgzf;
+    deflate::GzipHeader bc;
+    bc.extra = {'B', 'C', 2, 0, 0, 0};
+    for (size_t at = 0; at < data.size(); at += piece) {
+        size_t n = std::min(piece, data.size() - at);
+        std::vector<uint8_t> member = deflate::compressGzip(data.data() + at, n, level);
+        members.insert(members.end(), member.begin(), member.end());
+        for (size_t b = at; b < at + n; b += 65280) {
+            std::vector<uint8_t> block = deflate::compressGzip(data.data() + b, std::min((size_t)65280, at + n - b), level, deflate::DEFAULT_STRATEGY, bc);
+            block[16] = (uint8_t)(block.size() - 1);
+            block[17] = (uint8_t)((block.size() - 1) >> 8);
+            bgzf.insert(bgzf.end(), block.begin(), block.end());
+        }
+    }
+    std::vector<uint8_t> flushed = deflate::compressGzipSeekable(data.data(), data.size(), piece, level);
+    deflate::SeekTable table;
+    std::vector<uint8_t> rawFlushed = deflate::compressSeekable(data.data(), data.size(), table, piece, level);
+    // sync flushes keep the window, so every piece after the first needs the one before it and gets redone serially
+    deflate::Stream stream(level);
+    std::vector<uint8_t> synced;
+    for (size_t at = 0; at < data.size(); at += piece) {
+        size_t n = std::min(piece, data.size() - at);
+        std::vector<uint8_t> part = stream.compress(data.data() + at, n, deflate::SYNC_FLUSH);
+        synced.insert(synced.end(), part.begin(), part.end());
+    }
+    std::vector<uint8_t> end = stream.finish();
+    synced.insert(synced.end(), end.begin(), end.end());
+
+    bool ok = inflate::decompressGzipParallel(members.data(), members.size(), 4) == data
+        && inflate::decompressGzipParallel(bgzf.data(), bgzf.size(), 4) == data
+        && inflate::decompressGzipParallel(flushed.data(), flushed.size(), 4) == data
+        && inflate::decompressParallel(rawFlushed.data(), rawFlushed.size(), 4) == data
+        && inflate::decompressParallel(synced.data(), synced.size(), 4) == data;
+
+    // a member whose crc is off has to throw, wherever it is
+    bool caught = false;
+    members[members.size() - 8] ^= 1;
+    try {
+        inflate::decompressGzipParallel(members.data(), members.size(), 4);
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+
+    if (!ok) {
+        std::cerr << "[FAIL] parallel decompress mismatch for " << path << "\n";
+    } else if (!caught) {
+        std::cerr << "[FAIL] parallel decompress missed a bad crc for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] parallel members, BGZF, full and sync flushes (level " << level << "): " << path << " x" << copies << "\n";
+    }
+}
+
+void testSpeculative(std::string path, int level, size_t copies, bool speculated) {
+    File original = readFile(path);
+    std::vector<uint8_t> data;
+    for (size_t i = 0; i < copies; i++) {
+        data.insert(data.end(), original.data, original.data + original.size);
+        data[data.size() - 1 - i] ^= (uint8_t)i;
+    }
+
+    // one member with no flush points, so every piece past the first has to find its own block start
+    std::vector<uint8_t> gzip = deflate::compressGzip(data.data(), data.size(), level);
+    std::vector<uint8_t> raw = deflate::compress(data, level);
+    std::vector<uint8_t> twice = gzip;
+    twice.insert(twice.end(), gzip.begin(), gzip.end());
+    std::vector<uint8_t> doubled = data;
+    doubled.insert(doubled.end(), data.begin(), data.end());
+
+    // the output is the same even when every piece gets redone, so the report has to show some were kept
+    inflate::SpeculationReport report;
+    bool ok = inflate::decompressSpeculative(raw.data(), raw.size(), 4, &report) == inflate::decompress(raw)
+        && inflate::decompressSpeculative(raw.data(), raw.size(), 4) == data
+        && inflate::decompressGzipSpeculative(gzip.data(), gzip.size(), 4) == data
+        && inflate::decompressGzipSpeculative(twice.data(), twice.size(), 4) == doubled;
+
+    bool caught = false;
+    gzip[gzip.size() - 8] ^= 1;
+    try {
+        inflate::decompressGzipSpeculative(gzip.data(), gzip.size(), 4);
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+
+    if (!ok) {
+        std::cerr << "[FAIL] speculative decompress mismatch for " << path << "\n";
+    } else if (!caught) {
+        std::cerr << "[FAIL] speculative decompress missed a bad crc for " << path << "\n";
+    } else if (report.first != 1 || (speculated && report.accepted == 0)) {
+        std::cerr << "[FAIL] speculative decompress kept no speculated piece for " << path << " (" << report.accepted << " kept, " << report.redone << " redone)\n";
+    } else {
+        std::cerr << "[PASS] speculative single stream (level " << level << ", " << report.accepted << " pieces kept, " << report.redone << " redone): " << path << " x" << copies << "\n";
+    }
+}
+
+// the pipelined compressor has to give exactly what the serial in-place one does, whatever the thread count
+void testPipelined(std::string path, int level, deflate::Strategy strategy) {
+    File original = readFile(path);
+    deflate::compress(path, "hppdeflate_serial", level, strategy);
+    File serial = readFile("hppdeflate_serial");
+    std::vector<uint8_t> serialBytes(serial.data, serial.data + serial.size);
+    bool same = true;
+    for (size_t threads : {1, 2, 5}) {
+        same = same && deflate::compressParallel(original.data, original.size, level, strategy, threads) == serialBytes;
+    }
+    std::vector<uint8_t> gz = deflate::compressGzipParallel(original.data, original.size, level, strategy);
+    std::vector<uint8_t> originalBytes(original.data, original.data + original.size);
+
+    if (!same) {
+        std::cerr << "[FAIL] pipelined compress differs from the serial output for " << path << "\n";
+    } else if (!libdeflateInflatesTo(original, serialBytes.data(), serialBytes.size()) || inflate::decompressGzip(gz.data(), gz.size()) != originalBytes) {
+        std::cerr << "[FAIL] pipelined compress round-trip mismatch for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] pipelined compress matches serial (level " << level << "): " << path << "\n";
+    }
+}
+
+void testMappedFile(std::string path, int level) {
+    File original = readFile(path);
+    size_t compressed_size = deflate::compress(path, "hppdeflate_mapped", level);
+    File compressed = readFile("hppdeflate_mapped");
+    size_t size = inflate::decompress("hppdeflate_mapped", "hppinflate_mapped");
+    File roundTrip = readFile("hppinflate_mapped");
+    if (compressed_size != compressed.size || !libdeflateInflatesTo(original, compressed.data, compressed.size)) {
+        std::cerr << "[FAIL] mapped compress output isn't valid deflate for " << path << "\n";
+    } else if (size != original.size || !sameData(&original, &roundTrip)) {
+        std::cerr << "[FAIL] mapped decompress round-trip mismatch for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] mapped file -> deflate -> inflate (level " << level << "): " << path << "\n";
+    }
+}
+
+void testStats(std::string path, int level) {
+    File original = readFile(path);
+    deflate::Compressor plain(level);
+    std::vector<uint8_t> expected = plain.compress(original.data, original.size);
+
+    deflate::Stats cs;
+    deflate::Compressor compressor(level);
+    compressor.setStats(&cs);
+    std::vector<uint8_t> compressed = compressor.compress(original.data, original.size);
+    inflate::Stats ds;
+    inflate::Decompressor decompressor;
+    decompressor.setStats(&ds);
+    std::vector<uint8_t> back;
+    decompressor.decompress(compressed.data(), compressed.size(), back);
+
+    uint64_t lengths = 0;
+    uint64_t distances = 0;
+    for (uint64_t n : cs.length_buckets) {
+        lengths += n;
+    }
+    for (uint64_t n : cs.distance_buckets) {
+        distances += n;
+    }
+    uint64_t blocks = cs.stored_blocks + cs.fixed_blocks + cs.dynamic_blocks;
+    bool counted = cs.bytes_in == original.size && cs.bytes_out == compressed.size() && blocks == (original.size + 32767) / 32768 &&
+        lengths == cs.matches && distances == cs.matches && (level < 2 || (cs.matches > 0 && cs.chain_searches > 0 && cs.nanoseconds[deflate::Stats::MATCH_FINDING] > 0));
+    bool decoded = ds.bytes_in == compressed.size() && ds.bytes_out == original.size && ds.stored_blocks == cs.stored_blocks &&
+        ds.fixed_blocks == cs.fixed_blocks && ds.dynamic_blocks == cs.dynamic_blocks && ds.matches == 0;
+    std::vector<uint8_t> originalBytes(original.data, original.data + original.size);
+
+    if (compressed != expected || back != originalBytes) {
+        std::cerr << "[FAIL] output changed with stats on for " << path << "\n";
+    } else if (!counted || !decoded) {
+        std::cerr << "[FAIL] stats don't add up for " << path << ": " << cs.json() << " " << ds.json() << "\n";
+    } else if (cs.json().find("\"bytes_in\":" + std::to_string(original.size)) == std::string::npos || cs.prometheus().find("deflate_matches " + std::to_string(cs.matches) + "\n") == std::string::npos) {
+        std::cerr << "[FAIL] stats export is missing counters for " << path << "\n";
+    } else {
+        std::cerr << "[PASS] stats (level " << level << ", " << blocks << " blocks, chain depth " << cs.averageChainDepth() << "): " << path << "\n";
+    }
+}
+
+void testStreamCompressBuffer(std::string path, int compressionLevel, size_t pieceSize) {
+    File original = readFile(path);
+    deflate::Stream vectorStream(compressionLevel);
+    deflate::Stream bufferStream(compressionLevel);
+    std::vector<uint8_t> expected;
+    std::vector<uint8_t> compressed;
+    std::vector<uint8_t> out;
+    size_t pieces = 0;
+    for (size_t i = 0; i < original.size; i += pieceSize, pieces++) {
+        size_t n = std::min(pieceSize, original.size - i);
+        deflate::Flush flush = (pieces % 4 == 3) ? deflate::SYNC_FLUSH : deflate::NO_FLUSH;
+        std::vector<uint8_t> frame = vectorStream.compress(original.data + i, n, flush);
+        expected.insert(expected.end(), frame.begin(), frame.end());
+        out.resize(bufferStream.outputBound(n));
+        size_t written = bufferStream.compress(original.data + i, n, out.data(), out.size(), flush);
+        compressed.insert(compressed.end(), out.begin(), out.begin() + written);
+    }
+    std::vector<uint8_t> last = vectorStream.finish();
+    expected.insert(expected.end(), last.begin(), last.end());
+    deflate_io::VectorSink sink(compressed);
+    bufferStream.finish(sink);
+    std::cerr << ((compressed == expected)
+        ? "[PASS] deflate::Stream buffer and sink overloads match the vector one (" + std::to_string(compressed.size()) + " bytes): " + path + "\n"
+        : "[FAIL] deflate::Stream buffer and sink overloads differ for " + path + "\n");
+
+    deflate::Stream small(compressionLevel);
+    uint8_t tiny[4];
+    bool threw = false;
+    try {
+        small.compress(original.data, original.size, tiny, sizeof(tiny), deflate::SYNC_FLUSH);
+    } catch (std::runtime_error& e) {
+        threw = true;
+    }
+    std::cerr << (threw ? "[PASS] deflate::Stream buffer overload throws when out_cap runs out\n" : "[FAIL] deflate::Stream buffer overload overran out_cap\n");
+}
+
 int main() {
     std::cerr << "=== deflate/inflate.hpp test suite ===\n\n";
 
@@ -273,8 +1292,8 @@ int main() {
 
     std::cerr << "\n-- Full round-trip tests (compression level 1) --\n";
     testDecompressionFile("large.bmp", 1);
-    // testDecompressionFile("test.bmp",  1);
-    // testDecompressionFile("tiny.bmp",  1);
+    testDecompressionFile("test.bmp",  1);
+    testDecompressionFile("tiny.bmp",  1);
 
     std::cerr << "\n-- Full round-trip tests (compression level 2) --\n";
     testDecompressionFile("large.bmp", 2);
@@ -285,6 +1304,122 @@ int main() {
     testDecompressionFile("test.bmp", 3);
     testDecompressionFile("tiny.bmp", 3);
 
+    // --- Caller-provided output buffer ---
+    std::cerr << "\n-- compressBound / compress into caller buffer --\n";
+    testCompressBound("test.bmp", 0);
+    testCompressBound("test.bmp", 3);
+    testCompressBound("tiny.bmp", 3);
+    testCompressBound("large.bmp", 2);
+
+    // --- Streaming compressor ---
+    std::cerr << "\n-- deflate::Stream with sync/full flushes --\n";
+    testStreamCompress("large.bmp", 1, 5000);
+    testStreamCompress("large.bmp", 2, 5000);
+    testStreamCompress("test.bmp", 3, 3000);
+    // pieces over 32K finish blocks mid byte between flushes
+    testStreamCompress("large.bmp", 2, 100000);
+    // the chained matchfinder slides along with the window instead of rehashing it every block
+    testStreamCompress("large.bmp", 3, 5000);
+    testStreamCompressBuffer("large.bmp", 2, 20000);
+
+    // --- Reusable contexts and allocators ---
+    std::cerr << "\n-- deflate::Compressor / inflate::Decompressor reuse and allocators --\n";
+    testContextReuse("large.bmp", 2);
+    testContextReuse("test.bmp", 3);
+    testContextReuse("tiny.bmp", 1);
+    testCallbackAllocator("large.bmp", 2);
+    testCallbackAllocator("test.bmp", 3);
+
+    // --- Batch API ---
+    std::cerr << "\n-- deflate::compressBatch / inflate::decompressBatch --\n";
+    testBatch("large.bmp", 2);
+    testBatch("test.bmp", 3);
+    testBatchReuse("large.bmp", 2);
+
+    // --- Templated sources and sinks ---
+    std::cerr << "\n-- compressSource / decompressSource --\n";
+    testSourceSink("large.bmp", 2);
+    testSourceSink("test.bmp", 3);
+    testPipeline("large.bmp", 2);
+    testPipeline("test.bmp", 3);
+
+    // --- Gzip container ---
+    std::cerr << "\n-- Gzip --\n";
+    testGzip("large.bmp", 2);
+    testGzip("test.bmp", 3);
+    testGzip("tiny.bmp", 1);
+
+    // --- Zlib container ---
+    std::cerr << "\n-- Zlib --\n";
+    testZlib("large.bmp", 2);
+    testZlib("test.bmp", 3);
+    testZlib("tiny.bmp", 1);
+
+    // --- Preset dictionaries ---
+    std::cerr << "\n-- Preset dictionaries --\n";
+    testDictionary(2);
+    testDictionary(3);
+
+    // --- Random access index ---
+    std::cerr << "\n-- Random access index --\n";
+    testIndex("large.bmp", 2, 256 * 1024);
+    testIndex("test.bmp", 3, 32 * 1024);
+    testIndex("tiny.bmp", 1, 1024);
+
+    // --- Seekable output ---
+    std::cerr << "\n-- Seekable deflate and gzip --\n";
+    testSeekable("large.bmp", 2, 256 * 1024);
+    testSeekable("test.bmp", 3, 4096);
+    testSeekable("tiny.bmp", 1, 100);
+
+    // --- Rsyncable output ---
+    std::cerr << "\n-- Rsyncable deflate and gzip --\n";
+    testRsyncable("large.bmp", 2, 1 << 16);
+    testRsyncable("test.bmp", 3, 1 << 12);
+
+    // --- Pipelined compression ---
+    std::cerr << "\n-- Pipelined entropy coding --\n";
+    testPipelined("large.bmp", 2, deflate::DEFAULT_STRATEGY);
+    testPipelined("large.bmp", 1, deflate::DEFAULT_STRATEGY);
+    testPipelined("test.bmp", 3, deflate::DEFAULT_STRATEGY);
+    testPipelined("test.bmp", 2, deflate::RLE);
+    testPipelined("tiny.bmp", 0, deflate::DEFAULT_STRATEGY);
+
+    // --- Stats ---
+    std::cerr << "\n-- Per-phase stats --\n";
+    testStats("large.bmp", 3);
+    testStats("test.bmp", 2);
+    testStats("tiny.bmp", 0);
+
+    // --- Parallel decompression ---
+    std::cerr << "\n-- Parallel decompression of members and flushed streams --\n";
+    testParallelDecompress("large.bmp", 1, 4);
+    testParallelDecompress("test.bmp", 2, 1);
+
+    // --- Speculative decompression ---
+    std::cerr << "\n-- Speculative decompression of single streams --\n";
+    testSpeculative("large.bmp", 1, 4, true);
+    testSpeculative("large.bmp", 3, 4, true);
+    testSpeculative("test.bmp", 2, 1, false);
+
+    // --- Compression strategies ---
+    std::cerr << "\n-- Compression strategies --\n";
+    testStrategy("large.bmp", 1, deflate::HUFFMAN_ONLY, "HUFFMAN_ONLY");
+    testStrategy("large.bmp", 1, deflate::RLE, "RLE");
+    testStrategy("test.bmp", 3, deflate::RLE, "RLE");
+    testStrategy("test.bmp", 3, deflate::FILTERED, "FILTERED");
+    testStrategy("large.bmp", 2, deflate::FILTERED, "FILTERED");
+
+    // --- Incompressible input ---
+    std::cerr << "\n-- Incompressible input --\n";
+    testIncompressible(200000, 1);
+    testIncompressible(200000, 3);
+
+    // --- Runtime kernel dispatch ---
+    std::cerr << "\n-- CPU kernel variants --\n";
+    testKernelVariants("large.bmp");
+    testKernelVariants("test.bmp");
+
     // --- File-path API round-trip ---
     std::cerr << "\n-- File-path API round-trip (test.bmp, level 3) --\n";
     deflate::compress("test.bmp", "hppdeflate_testbmp", 3);
@@ -294,6 +1429,10 @@ int main() {
     std::cerr << (sameData(&original, &roundTrip)
         ? "[PASS] test.bmp -> deflate -> inflate matches original\n"
         : "[FAIL] test.bmp -> deflate -> inflate does not match original\n");
+    testMappedFile("large.bmp", 2);
+    testMappedFile("test.bmp", 2);
+    writeBufferToFile(nullptr, 0, "hppdeflate_empty");
+    testMappedFile("hppdeflate_empty", 3);
 
     // --- inflate.hpp speed benchmark ---
     std::cerr << "\n-- inflate.hpp speed benchmark --\n";